@@ -0,0 +1,91 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/resource_pool.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#include <unistd.h>
+
+// Measures the resident memory used by empty resource pools. The
+// number of pools can be given as the first argument.
+namespace
+{
+    struct small_object
+    {
+        uint32_t m_value[4];
+    };
+
+    struct footprint
+    {
+        uint64_t m_virtual;
+        uint64_t m_resident;
+    };
+
+    /// @return The virtual and resident set size of the process in
+    ///         bytes, read from /proc/self/statm
+    footprint measure()
+    {
+        std::ifstream statm("/proc/self/statm");
+
+        uint64_t size = 0;
+        uint64_t resident = 0;
+        statm >> size >> resident;
+
+        uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        return footprint{size * page, resident * page};
+    }
+
+    void report(const char* name, const footprint& before,
+                const footprint& after, uint32_t pools)
+    {
+        std::printf("%s: rss %.1f bytes/pool, virtual %.1f bytes/pool\n",
+                    name, double(after.m_resident - before.m_resident) / pools,
+                    double(after.m_virtual - before.m_virtual) / pools);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t pools = 10000;
+
+    if (argc > 1)
+    {
+        pools = static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10));
+    }
+
+    using pool_type = recycle::resource_pool<small_object>;
+
+    std::vector<std::unique_ptr<pool_type>> storage;
+    storage.reserve(pools);
+
+    footprint before = measure();
+
+    for (uint32_t i = 0; i < pools; ++i)
+    {
+        storage.emplace_back(new pool_type());
+    }
+
+    footprint empty = measure();
+
+    // Use each pool once so it holds a single unused object
+    for (auto& pool : storage)
+    {
+        pool->allocate();
+    }
+
+    footprint used = measure();
+
+    std::printf("pools: %u\n", pools);
+    report("empty pool", before, empty, pools);
+    report("pool holding one object", before, used, pools);
+
+    return 0;
+}
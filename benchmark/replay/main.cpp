@@ -0,0 +1,176 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/resource_pool.hpp>
+#include <recycle/trace_recorder.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Replays a trace written by the recycle::trace_recorder against a
+// pool configuration and reports the hit rate, the peak memory and
+// the throughput. The allocations and releases are replayed in order
+// on a single thread, as fast as possible.
+//
+// Usage: recycle_replay <trace> [--capacity N] [--max-reuses N]
+//                               [--object-size BYTES]
+namespace
+{
+    struct options
+    {
+        const char* m_trace = nullptr;
+        std::size_t m_capacity = 10000;
+        uint32_t m_max_reuses = 0;
+        std::size_t m_object_size = 4096;
+    };
+
+    bool parse(int argc, char* argv[], options& opts)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            bool has_value = i + 1 < argc;
+
+            if (std::strcmp(argv[i], "--capacity") == 0 && has_value)
+            {
+                opts.m_capacity = std::strtoul(argv[++i], nullptr, 10);
+            }
+            else if (std::strcmp(argv[i], "--max-reuses") == 0 && has_value)
+            {
+                opts.m_max_reuses = static_cast<uint32_t>(
+                    std::strtoul(argv[++i], nullptr, 10));
+            }
+            else if (std::strcmp(argv[i], "--object-size") == 0 && has_value)
+            {
+                opts.m_object_size = std::strtoul(argv[++i], nullptr, 10);
+            }
+            else if (opts.m_trace == nullptr && argv[i][0] != '-')
+            {
+                opts.m_trace = argv[i];
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        return opts.m_trace != nullptr;
+    }
+
+    /// Counts the live objects to find the peak memory
+    struct object_counter
+    {
+        uint64_t m_constructed = 0;
+        uint64_t m_live = 0;
+        uint64_t m_peak = 0;
+    };
+}
+
+int main(int argc, char* argv[])
+{
+    options opts;
+
+    if (!parse(argc, argv, opts))
+    {
+        std::fprintf(stderr, "usage: %s <trace> [--capacity N] "
+                     "[--max-reuses N] [--object-size BYTES]\n", argv[0]);
+        return 1;
+    }
+
+    std::ifstream file(opts.m_trace, std::ios::binary);
+    std::vector<recycle::trace_event> events;
+
+    if (!recycle::trace_recorder::read_trace(file, events))
+    {
+        std::fprintf(stderr, "%s: not a valid trace\n", opts.m_trace);
+        return 1;
+    }
+
+    using buffer = std::vector<uint8_t>;
+
+    object_counter counter;
+    std::size_t object_size = opts.m_object_size;
+
+    auto make = [&counter, object_size]()
+    {
+        ++counter.m_constructed;
+        ++counter.m_live;
+
+        if (counter.m_live > counter.m_peak)
+            counter.m_peak = counter.m_live;
+
+        return std::shared_ptr<buffer>(new buffer(object_size),
+                                       [&counter](buffer* b)
+        {
+            --counter.m_live;
+            delete b;
+        });
+    };
+
+    uint64_t recorded_allocations = 0;
+    uint64_t recorded_hits = 0;
+    uint64_t allocations = 0;
+
+    std::chrono::steady_clock::duration elapsed;
+
+    {
+        recycle::resource_pool<buffer> pool(make, opts.m_capacity);
+        pool.set_max_reuses(opts.m_max_reuses);
+
+        // The objects allocated in the replay by their id in the trace
+        std::unordered_map<uint64_t, std::shared_ptr<buffer>> objects;
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (const recycle::trace_event& event : events)
+        {
+            switch (event.m_type)
+            {
+            case recycle::trace_event_type::hit:
+            case recycle::trace_event_type::miss:
+                ++recorded_allocations;
+                recorded_hits += event.m_type == recycle::trace_event_type::hit;
+                ++allocations;
+                objects[event.m_object] = pool.allocate();
+                break;
+
+            case recycle::trace_event_type::release:
+            case recycle::trace_event_type::drop:
+                // Objects allocated before the start of the trace are
+                // not known
+                objects.erase(event.m_object);
+                break;
+            }
+        }
+
+        elapsed = std::chrono::steady_clock::now() - start;
+        objects.clear();
+    }
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    uint64_t hits = allocations - counter.m_constructed;
+
+    std::printf("events: %zu\n", events.size());
+    std::printf("allocations: %llu\n", (unsigned long long) allocations);
+    std::printf("recorded hit rate: %.4f\n", recorded_allocations == 0 ? 0.0 :
+                double(recorded_hits) / recorded_allocations);
+    std::printf("replayed hit rate: %.4f\n", allocations == 0 ? 0.0 :
+                double(hits) / allocations);
+    std::printf("constructions: %llu\n",
+                (unsigned long long) counter.m_constructed);
+    std::printf("peak objects: %llu\n", (unsigned long long) counter.m_peak);
+    std::printf("peak memory: %llu bytes\n",
+                (unsigned long long) (counter.m_peak * opts.m_object_size));
+    std::printf("throughput: %.0f events/s\n",
+                seconds > 0 ? events.size() / seconds : 0.0);
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/scrub.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Measures the throughput of clearing buffers of several sizes with
+// std::memset() and with recycle::scrub() for each instruction set the
+// CPU supports. The buffers are cleared in turn, like buffers released
+// to a pool, and a working set is read between clears to show the cost
+// of evicting it from the cache. The number of bytes cleared per
+// measurement can be given as the first argument.
+namespace
+{
+    /// The working set read between clears
+    std::vector<uint8_t> working_set(256 * 1024, 1);
+
+    uint64_t touch_working_set()
+    {
+        uint64_t sum = 0;
+        for (std::size_t i = 0; i < working_set.size(); i += 64)
+            sum += working_set[i];
+
+        return sum;
+    }
+
+    template<class Clear>
+    void measure(const char* name, std::size_t size, uint64_t total,
+                 Clear clear)
+    {
+        // Enough buffers to not fit the last level cache
+        std::size_t count = std::max<std::size_t>(
+            4, (64 * 1024 * 1024) / size);
+        std::vector<std::vector<uint8_t>> buffers(
+            count, std::vector<uint8_t>(size, 0xff));
+
+        uint64_t rounds = std::max<uint64_t>(1, total / size);
+        uint64_t sum = 0;
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (uint64_t i = 0; i < rounds; ++i)
+        {
+            clear(buffers[i % count].data(), size);
+            sum += touch_working_set();
+        }
+
+        auto stop = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(stop - start).count();
+
+        std::printf("%-8s %9zu bytes: %8.2f GB/s, %8.1f ns/buffer (%llu)\n",
+                    name, size, double(rounds * size) / seconds / 1e9,
+                    seconds * 1e9 / double(rounds),
+                    static_cast<unsigned long long>(sum % 10));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t total = uint64_t(4) * 1024 * 1024 * 1024;
+
+    if (argc > 1)
+    {
+        total = std::strtoull(argv[1], nullptr, 10);
+    }
+
+    recycle::scrub_isa level = recycle::scrub_level();
+
+    std::vector<std::size_t> sizes = {4096, 16 * 1024, 64 * 1024,
+                                      256 * 1024, 1024 * 1024,
+                                      16 * 1024 * 1024};
+
+    for (std::size_t size : sizes)
+    {
+        measure("memset", size, total, [](uint8_t* data, std::size_t n)
+            { std::memset(data, 0, n); });
+
+        if (level != recycle::scrub_isa::scalar)
+        {
+            measure("avx2", size, total, [](uint8_t* data, std::size_t n)
+                { recycle::detail::scrub(data, n, recycle::scrub_isa::avx2); });
+        }
+
+        if (level == recycle::scrub_isa::avx512)
+        {
+            measure("avx512", size, total, [](uint8_t* data, std::size_t n)
+                { recycle::detail::scrub(data, n,
+                                         recycle::scrub_isa::avx512); });
+        }
+
+        measure("scrub", size, total, [](uint8_t* data, std::size_t n)
+            { recycle::scrub(data, n); });
+    }
+
+    return 0;
+}
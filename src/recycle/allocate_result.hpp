@@ -0,0 +1,114 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <cassert>
+#include <utility>
+
+namespace recycle
+{
+    /// The reasons an allocation may fail
+    enum class allocate_error
+    {
+        /// The allocation succeeded
+        none = 0,
+
+        /// The allocate function returned nullptr
+        allocate_failed,
+
+        /// The tenant has too many resources allocated
+        quota_exceeded
+    };
+
+    /// @brief The result of an allocation which may fail.
+    ///
+    /// Holds either the pointer to the resource or the reason the
+    /// allocation failed. Used by the non-throwing allocation functions
+    /// of the pools, e.g. recycle::resource_pool::try_allocate(), so
+    /// they can be used in code compiled without exceptions.
+    ///
+    /// Example:
+    ///
+    ///     auto result = pool.try_allocate();
+    ///
+    ///     if (!result)
+    ///     {
+    ///         handle(result.error());
+    ///         return;
+    ///     }
+    ///
+    ///     auto o = std::move(result.value());
+    ///
+    template<class Pointer>
+    class allocate_result
+    {
+    public:
+
+        /// The pointer type
+        using value_type = Pointer;
+
+    public:
+
+        /// Create a successful result
+        /// @param value The pointer to the resource, must not be nullptr
+        allocate_result(value_type value) :
+            m_value(std::move(value)),
+            m_error(allocate_error::none)
+        {
+            assert(m_value);
+        }
+
+        /// Create a failed result
+        /// @param error The reason the allocation failed
+        allocate_result(allocate_error error) :
+            m_error(error)
+        {
+            assert(m_error != allocate_error::none);
+        }
+
+        /// @return true if the allocation succeeded
+        bool has_value() const
+        {
+            return m_error == allocate_error::none;
+        }
+
+        /// @return true if the allocation succeeded
+        explicit operator bool() const
+        {
+            return has_value();
+        }
+
+        /// @return The pointer to the resource, only valid if the
+        ///         allocation succeeded
+        value_type& value()
+        {
+            assert(has_value());
+            return m_value;
+        }
+
+        /// @copydoc value()
+        const value_type& value() const
+        {
+            assert(has_value());
+            return m_value;
+        }
+
+        /// @return The reason the allocation failed, or
+        ///         allocate_error::none if it succeeded
+        allocate_error error() const
+        {
+            return m_error;
+        }
+
+    private:
+
+        /// The pointer to the resource
+        value_type m_value;
+
+        /// The reason the allocation failed
+        allocate_error m_error;
+    };
+}
@@ -0,0 +1,242 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <cassert>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "lifetime_policy.hpp"
+#include "no_locking_policy.hpp"
+#include "resource_pool.hpp"
+
+namespace recycle
+{
+    namespace detail
+    {
+        /// The locking policy used when the pool is not thread-safe
+        struct async_locking_policy
+        {
+            using mutex_type = std::mutex;
+            using lock_type = std::lock_guard<mutex_type>;
+        };
+
+        /// The locking policy of the pool of an async_resource_pool.
+        /// The worker threads adopt resources into it, so it is locked
+        /// with a std::mutex if no locking was requested.
+        template<class LockingPolicy>
+        using async_pool_locking = typename std::conditional<
+            std::is_same<LockingPolicy, no_locking_policy>::value,
+            async_locking_policy, LockingPolicy>::type;
+    }
+
+    /// @brief A resource pool whose resources are constructed
+    ///        asynchronously.
+    ///
+    /// The allocate function of the async_resource_pool returns a
+    /// std::future which is fulfilled once the resource has been
+    /// constructed, e.g. by a worker thread or when a network session
+    /// has been established. The allocate_async() function returns a
+    /// std::future as well:
+    ///
+    ///   - If an unused resource is available the future is ready
+    ///     immediately.
+    ///
+    ///   - Otherwise a construction is started right away and the
+    ///     future resolves from it. Since the construction is started
+    ///     before the caller waits for it, several constructions
+    ///     requested in a row are in flight at the same time.
+    ///
+    /// Resources constructed asynchronously are recycled into the
+    /// pool like any other resource. On a miss a worker thread waits
+    /// for the construction and hands the resource to the pool, the
+    /// future returned becomes ready once it has, so it can be polled
+    /// with wait_for(). Dropping that future waits for the worker.
+    /// Since the workers use the pool, it is locked with a std::mutex
+    /// when the no_locking_policy is given.
+    ///
+    /// If the allocate function resolves to a null pointer, get()
+    /// throws std::runtime_error, or aborts when exceptions are
+    /// disabled.
+    ///
+    /// Example:
+    ///
+    ///     recycle::async_resource_pool<session> pool(
+    ///         []() { return connect_async(); });
+    ///
+    ///     std::future<std::shared_ptr<session>> a = pool.allocate_async();
+    ///     std::future<std::shared_ptr<session>> b = pool.allocate_async();
+    ///
+    ///     // Both sessions are being established at this point
+    ///     auto s1 = a.get();
+    ///     auto s2 = b.get();
+    ///
+    template
+    <
+        class Value,
+        class LockingPolicy = no_locking_policy,
+        class LifetimePolicy = shared_lifetime_policy
+    >
+    class async_resource_pool
+    {
+    public:
+
+        /// The pool used to store the unused resources
+        using pool_type = resource_pool<
+            Value, detail::async_pool_locking<LockingPolicy>, LifetimePolicy>;
+
+        /// The type managed
+        using value_type = Value;
+
+        /// The pointer to the resource
+        using value_ptr = std::shared_ptr<value_type>;
+
+        /// The allocate function type
+        /// Should take no arguments and return a std::future to a
+        /// std::shared_ptr to the Value
+        using allocate_function = std::function<std::future<value_ptr>()>;
+
+        /// The recycle function type, see recycle::resource_pool
+        using recycle_function = typename pool_type::recycle_function;
+
+    public:
+
+        /// Create an async pool using a specific allocate function.
+        /// @param allocate Allocation function
+        async_resource_pool(allocate_function allocate,
+                            std::size_t capacity = pool_type::DEFAULT_CAPACITY) :
+            m_allocate(std::move(allocate)),
+            m_pool(std::make_shared<pool_type>(wait_for(m_allocate), capacity))
+        {
+            assert(m_allocate);
+        }
+
+        /// Create an async pool using a specific allocate function and
+        /// recycle function.
+        /// @param allocate Allocation function
+        /// @param recycle Recycle function
+        async_resource_pool(allocate_function allocate,
+                            recycle_function recycle,
+                            std::size_t capacity = pool_type::DEFAULT_CAPACITY) :
+            m_allocate(std::move(allocate)),
+            m_pool(std::make_shared<pool_type>(
+                wait_for(m_allocate), std::move(recycle), capacity))
+        {
+            assert(m_allocate);
+        }
+
+        /// @return A future to a resource from the pool. The future is
+        ///         ready if there was an unused resource, otherwise it
+        ///         becomes ready once the construction started by this
+        ///         call has completed and the resource was adopted.
+        std::future<value_ptr> allocate_async()
+        {
+            assert(m_pool);
+
+            value_ptr resource = m_pool->allocate_unused();
+
+            if (resource)
+            {
+                std::promise<value_ptr> ready;
+                ready.set_value(std::move(resource));
+                return ready.get_future();
+            }
+
+            std::future<value_ptr> pending = m_allocate();
+            assert(pending.valid());
+
+            // The worker adopts the resource as soon as it has been
+            // constructed, also if the caller never waits for it
+            return std::async(std::launch::async, &adopt, m_pool,
+                              std::move(pending));
+        }
+
+        /// @return A resource from the pool, waits for the
+        ///         construction on a miss
+        value_ptr allocate()
+        {
+            return allocate_async().get();
+        }
+
+        /// @returns the number of unused resources
+        std::size_t unused_resources() const
+        {
+            assert(m_pool);
+            return m_pool->unused_resources();
+        }
+
+        /// @returns the maximum number of unused resources kept
+        std::size_t capacity() const
+        {
+            assert(m_pool);
+            return m_pool->capacity();
+        }
+
+        /// Frees all unused resources
+        void free_unused()
+        {
+            assert(m_pool);
+            m_pool->free_unused();
+        }
+
+        /// @return The pool storing the unused resources, e.g. to
+        ///         configure it
+        pool_type& pool()
+        {
+            assert(m_pool);
+            return *m_pool;
+        }
+
+    private:
+
+        /// @return A synchronous allocate function waiting for the
+        ///         asynchronous one
+        static typename pool_type::allocate_function
+        wait_for(const allocate_function& allocate)
+        {
+            return [allocate]() { return checked(allocate().get()); };
+        }
+
+        /// Waits for a construction and hands the resource to the pool
+        static value_ptr adopt(std::shared_ptr<pool_type> pool,
+                               std::future<value_ptr> pending)
+        {
+            // A null resource must not reach the pool, which would
+            // then construct one synchronously on the caller's thread
+            return pool->adopt(checked(pending.get()));
+        }
+
+        /// @return The resource constructed, fails if it is null
+        static value_ptr checked(value_ptr resource)
+        {
+            if (!resource)
+            {
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+                throw std::runtime_error(
+                    "recycle::async_resource_pool: null resource");
+#else
+                std::abort();
+#endif
+            }
+
+            return resource;
+        }
+
+    private:
+
+        /// The asynchronous allocate function
+        allocate_function m_allocate;
+
+        /// The pool, shared with the pending constructions
+        std::shared_ptr<pool_type> m_pool;
+    };
+}
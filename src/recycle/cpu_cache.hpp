@@ -0,0 +1,636 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#endif
+#endif
+
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_thread_pointer) && defined(RSEQ_SIG)
+#define RECYCLE_HAS_RSEQ 1
+#endif
+#endif
+
+#ifndef RECYCLE_HAS_RSEQ
+#define RECYCLE_HAS_RSEQ 0
+#endif
+
+// The restartable push and pop are written in x86-64 assembly, other
+// architectures use the spin lock of each slot
+#if RECYCLE_HAS_RSEQ && defined(__x86_64__) && defined(__GNUC__)
+#if defined(__has_include)
+#if __has_include(<linux/membarrier.h>)
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#define RECYCLE_HAS_RSEQ_CS 1
+#endif
+#endif
+#endif
+
+#ifndef RECYCLE_HAS_RSEQ_CS
+#define RECYCLE_HAS_RSEQ_CS 0
+#endif
+
+namespace recycle
+{
+    /// @return The number of CPUs that can be returned by current_cpu()
+    inline std::size_t cpu_count()
+    {
+#if defined(__linux__)
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        if (cpus > 0)
+            return static_cast<std::size_t>(cpus);
+#endif
+        unsigned int cpus_hint = std::thread::hardware_concurrency();
+        return cpus_hint > 0 ? cpus_hint : 1;
+    }
+
+    /// @return true if the CPU id is read from the restartable
+    ///         sequences (rseq) area registered with the kernel for the
+    ///         calling thread.
+    inline bool has_rseq()
+    {
+#if RECYCLE_HAS_RSEQ
+        return __rseq_size > 0;
+#else
+        return false;
+#endif
+    }
+
+    namespace detail
+    {
+#if RECYCLE_HAS_RSEQ
+        /// @return The rseq area of the calling thread
+        inline volatile struct rseq* rseq_area()
+        {
+            char* thread_pointer =
+                static_cast<char*>(__builtin_thread_pointer());
+
+            return reinterpret_cast<volatile struct rseq*>(
+                thread_pointer + __rseq_offset);
+        }
+#endif
+
+#if RECYCLE_HAS_RSEQ_CS
+
+#define RECYCLE_RSEQ_STR_(x) #x
+#define RECYCLE_RSEQ_STR(x) RECYCLE_RSEQ_STR_(x)
+
+        /// Runs a restartable sequence committing `word = desired` if
+        /// the calling thread still runs on the CPU `cpu`, `disabled`
+        /// is zero, `word` equals `expected` and `flag` equals
+        /// `flag_expected`. The sequence is aborted if the thread is
+        /// preempted, migrated or signalled before the commit, so no
+        /// other thread on the CPU can modify the words in between.
+        /// @return true if the store was committed
+        inline bool rseq_commit(uint32_t cpu,
+                                const std::atomic<intptr_t>& disabled,
+                                std::atomic<intptr_t>& word,
+                                intptr_t expected,
+                                const std::atomic<intptr_t>& flag,
+                                intptr_t flag_expected,
+                                intptr_t desired)
+        {
+            volatile struct rseq* area = rseq_area();
+
+            // The descriptor of the sequence goes into the __rseq_cs
+            // section and the abort handler, preceded by the signature
+            // glibc registered, into __rseq_failure. Both join the
+            // section group of the inline function ("?"), so they are
+            // discarded together with its duplicates at link time.
+            __asm__ __volatile__ goto (
+                ".pushsection __rseq_cs, \"aw?\"\n\t"
+                ".balign 32\n\t"
+                "3:\n\t"
+                ".long 0x0, 0x0\n\t"
+                ".quad 1f, (2f - 1f), 4f\n\t"
+                ".popsection\n\t"
+                "leaq 3b(%%rip), %%rax\n\t"
+                "movq %%rax, %[rseq_cs]\n\t"
+                "1:\n\t"
+                "cmpl %[cpu], %[current_cpu]\n\t"
+                "jnz 4f\n\t"
+                "cmpq $0, %[disabled]\n\t"
+                "jnz %l[failed]\n\t"
+                "cmpq %[expected], %[word]\n\t"
+                "jnz %l[failed]\n\t"
+                "cmpq %[flag_expected], %[flag]\n\t"
+                "jnz %l[failed]\n\t"
+                "movq %[desired], %[word]\n\t"
+                "2:\n\t"
+                ".pushsection __rseq_failure, \"ax?\"\n\t"
+                ".byte 0x0f, 0xb9, 0x3d\n\t"
+                ".long " RECYCLE_RSEQ_STR(RSEQ_SIG) "\n\t"
+                "4:\n\t"
+                "jmp %l[failed]\n\t"
+                ".popsection\n\t"
+                :
+                : [cpu] "r" (cpu),
+                  [current_cpu] "m" (area->cpu_id),
+                  [rseq_cs] "m" (area->rseq_cs),
+                  [disabled] "m" (disabled),
+                  [word] "m" (word),
+                  [expected] "r" (expected),
+                  [flag] "m" (flag),
+                  [flag_expected] "r" (flag_expected),
+                  [desired] "r" (desired)
+                : "memory", "cc", "rax"
+                : failed);
+
+            return true;
+
+        failed:
+            return false;
+        }
+
+#undef RECYCLE_RSEQ_STR
+#undef RECYCLE_RSEQ_STR_
+
+        /// Restarts the restartable sequences running on any CPU and
+        /// orders our earlier stores before those started afterwards
+        inline void rseq_barrier()
+        {
+            long result = syscall(__NR_membarrier,
+                                  MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0);
+            assert(result == 0);
+            (void) result;
+        }
+#endif
+    }
+
+    /// @return true if the cpu_cache pushes and pops with restartable
+    ///         sequences. This needs the rseq area registered by glibc
+    ///         2.35 or newer on x86-64 and a kernel which can restart
+    ///         the sequences of other CPUs (membarrier, Linux 5.10).
+    inline bool has_rseq_critical_sections()
+    {
+#if RECYCLE_HAS_RSEQ_CS
+        static const bool available = __rseq_size > 0 &&
+            syscall(__NR_membarrier,
+                    MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0;
+
+        return available;
+#else
+        return false;
+#endif
+    }
+
+    /// @return The CPU the calling thread is currently running on.
+    ///
+    /// On Linux with a C library that registers restartable sequences
+    /// (glibc 2.35 or newer) the CPU id is read from the rseq area
+    /// which the kernel keeps updated, avoiding a system call or vDSO
+    /// call per lookup. Otherwise we fall back to
+    /// sched_getcpu() and finally to the hashed thread id on platforms
+    /// without either. The result is only a hint, the thread may
+    /// migrate to another CPU right after the call.
+    inline std::size_t current_cpu()
+    {
+#if RECYCLE_HAS_RSEQ
+        if (__rseq_size > 0)
+        {
+            int32_t cpu = static_cast<int32_t>(detail::rseq_area()->cpu_id);
+            if (cpu >= 0)
+                return static_cast<std::size_t>(cpu);
+        }
+#endif
+#if defined(__linux__)
+        int cpu = sched_getcpu();
+        if (cpu >= 0)
+            return static_cast<std::size_t>(cpu);
+#endif
+        return std::hash<std::thread::id>()(std::this_thread::get_id());
+    }
+
+    /// @brief Bounded per-CPU stacks of values.
+    ///
+    /// The cpu_cache is used by the recycle::resource_pool to keep
+    /// unused resources close to the CPU that released them.
+    ///
+    /// Where restartable sequences are available, see
+    /// has_rseq_critical_sections(), push() and pop() move the top of
+    /// the stack of the current CPU with a restartable sequence, which
+    /// the kernel aborts if the thread is preempted or migrated before
+    /// the commit. This needs no atomic read-modify-write
+    /// instructions. A flag per entry tells whether it has been
+    /// written or read after the commit, so a thread preempted in
+    /// between only makes the other threads of its CPU miss the
+    /// entry. drain() stops the sequences of all CPUs with a
+    /// membarrier() system call before emptying the stacks.
+    ///
+    /// Otherwise each CPU has its own slot guarded by a small spin
+    /// lock. Since a slot is only touched by the threads currently
+    /// running on that CPU the lock is practically uncontended, it is
+    /// only contended if a thread is preempted or migrated while
+    /// holding it.
+    ///
+    /// The memory cached is bounded by the number of CPUs times the
+    /// per-CPU capacity, independently of the number of threads. The
+    /// stack of a CPU is allocated the first time a value is pushed on
+    /// it and kept until the cache is destroyed.
+    template<class T>
+    class cpu_cache
+    {
+    public:
+
+        /// The type stored
+        using value_type = T;
+
+    public:
+
+        /// Create a new cache
+        /// @param per_cpu_capacity The maximum number of values kept
+        ///        per CPU
+        /// @param cpus The number of slots. Restartable sequences are
+        ///        only used if there is a slot for every CPU.
+        cpu_cache(std::size_t per_cpu_capacity,
+                  std::size_t cpus = cpu_count()) :
+            m_per_cpu_capacity(per_cpu_capacity),
+            m_cpus(cpus),
+            m_restartable(has_rseq_critical_sections() && cpus >= cpu_count()),
+            m_slots(new slot[cpus])
+        {
+            assert(m_cpus > 0);
+        }
+
+        ~cpu_cache()
+        {
+            for (std::size_t i = 0; i < m_cpus; ++i)
+                delete m_slots[i].m_stack.load();
+        }
+
+        cpu_cache(const cpu_cache&) = delete;
+        cpu_cache& operator=(const cpu_cache&) = delete;
+
+        /// Push a value onto the stack of the current CPU
+        /// @param value The value, moved from if the push succeeds
+        /// @return false if the stack of the current CPU is full
+        bool push(value_type& value)
+        {
+            if (m_restartable)
+                return push_restartable(value);
+
+            slot& s = current();
+            slot_lock lock(s);
+
+            intptr_t top = s.m_top.load(std::memory_order_relaxed);
+
+            if (static_cast<std::size_t>(top) >= m_per_cpu_capacity)
+                return false;
+
+            make_stack(s).m_values[top] = std::move(value);
+            s.m_top.store(top + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        /// Pop a value from the stack of the current CPU
+        /// @param value Assigned the value if the pop succeeds
+        /// @return false if the stack of the current CPU is empty
+        bool pop(value_type& value)
+        {
+            if (m_restartable)
+                return pop_restartable(value);
+
+            slot& s = current();
+            slot_lock lock(s);
+
+            intptr_t top = s.m_top.load(std::memory_order_relaxed);
+
+            if (top == 0)
+                return false;
+
+            take(*s.m_stack.load(std::memory_order_relaxed), top - 1, value);
+            s.m_top.store(top - 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        /// Moves the values of all CPUs into the output vector
+        void drain(std::vector<value_type>& out)
+        {
+            if (m_restartable)
+            {
+                drain_restartable(out);
+                return;
+            }
+
+            for (std::size_t i = 0; i < m_cpus; ++i)
+            {
+                slot& s = m_slots[i];
+                slot_lock lock(s);
+
+                intptr_t top = s.m_top.load(std::memory_order_relaxed);
+
+                for (intptr_t j = 0; j < top; ++j)
+                {
+                    out.emplace_back();
+                    take(*s.m_stack.load(std::memory_order_relaxed), j,
+                         out.back());
+                }
+
+                s.m_top.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        /// @return The number of values cached in all CPUs. With
+        ///         restartable sequences this is only a snapshot while
+        ///         other threads use the cache.
+        std::size_t size() const
+        {
+            std::size_t size = 0;
+            for (std::size_t i = 0; i < m_cpus; ++i)
+            {
+                slot& s = m_slots[i];
+
+                if (m_restartable)
+                {
+                    size += s.m_top.load(std::memory_order_relaxed);
+                    continue;
+                }
+
+                slot_lock lock(s);
+                size += s.m_top.load(std::memory_order_relaxed);
+            }
+            return size;
+        }
+
+        /// @return The maximum number of values kept per CPU
+        std::size_t per_cpu_capacity() const
+        {
+            return m_per_cpu_capacity;
+        }
+
+        /// @return The number of slots
+        std::size_t cpus() const
+        {
+            return m_cpus;
+        }
+
+        /// @return true if push() and pop() use restartable sequences
+        ///         instead of the spin lock of each slot
+        bool restartable() const
+        {
+            return m_restartable;
+        }
+
+    private:
+
+        /// The values of a CPU
+        struct stack
+        {
+            stack(std::size_t capacity) :
+                m_values(new value_type[capacity]),
+                m_ready(new std::atomic<intptr_t>[capacity]())
+            { }
+
+            /// The values, those above the top are default constructed
+            std::unique_ptr<value_type[]> m_values;
+
+            /// Whether each entry holds a value. Only used with
+            /// restartable sequences, where an entry below the top may
+            /// still be written and one above the top may still be
+            /// read by the thread which committed the new top.
+            std::unique_ptr<std::atomic<intptr_t>[]> m_ready;
+        };
+
+        /// The per-CPU state. The padding keeps the state of two
+        /// neighbouring CPUs on different cache lines.
+        struct slot
+        {
+            std::atomic<bool> m_locked{false};
+
+            /// Non-zero while drain() empties the stack
+            std::atomic<intptr_t> m_disabled{0};
+
+            /// The number of entries on the stack
+            std::atomic<intptr_t> m_top{0};
+
+            /// The stack, allocated on the first push
+            std::atomic<stack*> m_stack{nullptr};
+
+            char m_padding[64];
+        };
+
+        /// Spin lock guard for a slot
+        struct slot_lock
+        {
+            slot_lock(slot& s) :
+                m_slot(s)
+            {
+                while (m_slot.m_locked.exchange(true, std::memory_order_acquire))
+                {
+                    while (m_slot.m_locked.load(std::memory_order_relaxed))
+                        std::this_thread::yield();
+                }
+            }
+
+            ~slot_lock()
+            {
+                m_slot.m_locked.store(false, std::memory_order_release);
+            }
+
+            slot& m_slot;
+        };
+
+        /// The number of times a restartable sequence is retried after
+        /// being aborted before we give up
+        static const uint32_t max_attempts = 8;
+
+        /// @return The slot of the current CPU
+        slot& current() const
+        {
+            return m_slots[current_cpu() % m_cpus];
+        }
+
+        /// @return The stack of a slot, allocated if needed
+        stack& make_stack(slot& s)
+        {
+            stack* existing = s.m_stack.load(std::memory_order_acquire);
+
+            if (existing != nullptr)
+                return *existing;
+
+            std::unique_ptr<stack> created(new stack(m_per_cpu_capacity));
+
+            if (s.m_stack.compare_exchange_strong(
+                    existing, created.get(), std::memory_order_acq_rel))
+            {
+                return *created.release();
+            }
+
+            return *existing;
+        }
+
+        /// Moves a value out of a stack and resets the entry
+        static void take(stack& st, intptr_t position, value_type& value)
+        {
+            value = std::move(st.m_values[position]);
+            st.m_values[position] = value_type();
+        }
+
+        /// Pushes with a restartable sequence
+        bool push_restartable(value_type& value)
+        {
+#if RECYCLE_HAS_RSEQ_CS
+            for (uint32_t attempt = 0; attempt < max_attempts; ++attempt)
+            {
+                uint32_t cpu = detail::rseq_area()->cpu_id_start;
+
+                if (cpu >= m_cpus)
+                    return false;
+
+                slot& s = m_slots[cpu];
+                stack& st = make_stack(s);
+
+                intptr_t top = s.m_top.load(std::memory_order_relaxed);
+
+                if (static_cast<std::size_t>(top) >= m_per_cpu_capacity)
+                    return false;
+
+                // Reserve the entry above the top, if it has been read
+                if (detail::rseq_commit(cpu, s.m_disabled, s.m_top, top,
+                                        st.m_ready[top], 0, top + 1))
+                {
+                    st.m_values[top] = std::move(value);
+                    st.m_ready[top].store(1, std::memory_order_release);
+                    return true;
+                }
+
+                if (s.m_disabled.load(std::memory_order_relaxed) != 0)
+                    return false;
+            }
+#else
+            (void) value;
+#endif
+            return false;
+        }
+
+        /// Pops with a restartable sequence
+        bool pop_restartable(value_type& value)
+        {
+#if RECYCLE_HAS_RSEQ_CS
+            for (uint32_t attempt = 0; attempt < max_attempts; ++attempt)
+            {
+                uint32_t cpu = detail::rseq_area()->cpu_id_start;
+
+                if (cpu >= m_cpus)
+                    return false;
+
+                slot& s = m_slots[cpu];
+
+                intptr_t top = s.m_top.load(std::memory_order_relaxed);
+                stack* st = s.m_stack.load(std::memory_order_acquire);
+
+                if (top == 0 || st == nullptr)
+                    return false;
+
+                // Release the top entry, if it has been written
+                if (detail::rseq_commit(cpu, s.m_disabled, s.m_top, top,
+                                        st->m_ready[top - 1], 1, top - 1))
+                {
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    take(*st, top - 1, value);
+                    st->m_ready[top - 1].store(0, std::memory_order_release);
+                    return true;
+                }
+
+                if (s.m_disabled.load(std::memory_order_relaxed) != 0)
+                    return false;
+            }
+#else
+            (void) value;
+#endif
+            return false;
+        }
+
+        /// Drains the stacks used with restartable sequences
+        void drain_restartable(std::vector<value_type>& out)
+        {
+#if RECYCLE_HAS_RSEQ_CS
+            std::lock_guard<std::mutex> lock(m_drain_mutex);
+
+            for (std::size_t i = 0; i < m_cpus; ++i)
+                m_slots[i].m_disabled.store(1, std::memory_order_relaxed);
+
+            // Sequences which have not committed yet are restarted and
+            // see the slots disabled, so the tops stay put
+            detail::rseq_barrier();
+
+            for (std::size_t i = 0; i < m_cpus; ++i)
+            {
+                slot& s = m_slots[i];
+                stack* st = s.m_stack.load(std::memory_order_acquire);
+
+                if (st == nullptr)
+                    continue;
+
+                intptr_t top = s.m_top.load(std::memory_order_relaxed);
+
+                // Wait for the threads which committed a new top to
+                // finish writing or reading their entry
+                for (intptr_t j = 0;
+                     j < static_cast<intptr_t>(m_per_cpu_capacity); ++j)
+                {
+                    intptr_t ready = j < top ? 1 : 0;
+                    while (st->m_ready[j].load(std::memory_order_acquire) !=
+                           ready)
+                    {
+                        std::this_thread::yield();
+                    }
+                }
+
+                for (intptr_t j = 0; j < top; ++j)
+                {
+                    out.emplace_back();
+                    take(*st, j, out.back());
+                    st->m_ready[j].store(0, std::memory_order_relaxed);
+                }
+
+                s.m_top.store(0, std::memory_order_relaxed);
+            }
+
+            for (std::size_t i = 0; i < m_cpus; ++i)
+                m_slots[i].m_disabled.store(0, std::memory_order_release);
+#else
+            (void) out;
+#endif
+        }
+
+    private:
+
+        /// The maximum number of values per CPU
+        const std::size_t m_per_cpu_capacity;
+
+        /// The number of slots
+        const std::size_t m_cpus;
+
+        /// Whether restartable sequences are used
+        const bool m_restartable;
+
+        /// The slots
+        std::unique_ptr<slot[]> m_slots;
+
+        /// Serializes drain() with restartable sequences
+        std::mutex m_drain_mutex;
+    };
+}
@@ -0,0 +1,300 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace recycle
+{
+namespace detail
+{
+    /// Memory management of the control blocks used by the
+    /// recycle::resource_pool.
+    ///
+    /// Every control block is prefixed by a header which stores
+    /// whether the block was allocated on its own or as part of a
+    /// chunk. A chunk is a single allocation holding both the memory
+    /// of a std::allocate_shared call, i.e. the value and its inner
+    /// control block, and a spare control block. This allows the
+    /// pool to construct a new value and the control block of the
+    /// std::shared_ptr handed out to the user with a single malloc.
+    ///
+    /// Since the two parts of a chunk are released independently the
+    /// chunk counts its live parts and is freed with the last one. The
+    /// spare block of a chunk is therefore used once and not cached,
+    /// otherwise it would keep the memory of a dropped value alive.
+
+    /// The size reserved in front of blocks and chunks, keeps the
+    /// memory following it suitably aligned
+    static const std::size_t storage_header_size = 16;
+
+    /// Header of a chunk
+    struct chunk_header
+    {
+        /// The number of parts still in use
+        std::atomic<uint32_t> m_parts;
+    };
+
+    /// Header of a control block
+    struct block_header
+    {
+        /// The chunk the block is part of or nullptr if the block
+        /// was allocated on its own
+        chunk_header* m_chunk;
+    };
+
+    static_assert(sizeof(chunk_header) <= storage_header_size,
+                  "The chunk header does not fit");
+    static_assert(sizeof(block_header) <= storage_header_size,
+                  "The block header does not fit");
+
+    /// @return size rounded up to a multiple of the header size
+    inline std::size_t storage_align(std::size_t size)
+    {
+        return (size + storage_header_size - 1) &
+            ~(storage_header_size - 1);
+    }
+
+    /// Report a failed allocation, like operator new
+    [[noreturn]] inline void throw_bad_alloc()
+    {
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+        throw std::bad_alloc();
+#else
+        std::abort();
+#endif
+    }
+
+    /// Release one part of a chunk
+    inline void release_chunk(chunk_header* chunk)
+    {
+        assert(chunk != nullptr);
+
+        if (chunk->m_parts.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            chunk->~chunk_header();
+            std::free(chunk);
+        }
+    }
+
+    /// Allocate a control block on its own
+    /// @param size The size of the block in bytes
+    /// @return The block, throws std::bad_alloc if the allocation failed
+    inline void* allocate_block(std::size_t size)
+    {
+        void* memory = std::malloc(storage_header_size + size);
+
+        if (memory == nullptr)
+            throw_bad_alloc();
+
+        block_header* header = static_cast<block_header*>(memory);
+        header->m_chunk = nullptr;
+
+        return static_cast<uint8_t*>(memory) + storage_header_size;
+    }
+
+    /// @return true if the block is the spare block of a chunk
+    inline bool block_in_chunk(void* block)
+    {
+        assert(block != nullptr);
+
+        block_header* header = reinterpret_cast<block_header*>(
+            static_cast<uint8_t*>(block) - storage_header_size);
+
+        return header->m_chunk != nullptr;
+    }
+
+    /// Free a control block returned by allocate_block() or
+    /// allocate_chunk()
+    inline void free_block(void* block)
+    {
+        assert(block != nullptr);
+
+        block_header* header = reinterpret_cast<block_header*>(
+            static_cast<uint8_t*>(block) - storage_header_size);
+
+        if (header->m_chunk != nullptr)
+        {
+            release_chunk(header->m_chunk);
+        }
+        else
+        {
+            std::free(header);
+        }
+    }
+
+    /// Allocate a chunk
+    /// @param size The size of the memory requested in bytes
+    /// @param block_size The size of the spare control block in
+    ///        bytes, or zero if no spare block is needed
+    /// @param block Set to the spare control block if block_size is
+    ///        non-zero
+    /// @return The memory, throws std::bad_alloc if the allocation
+    ///         failed
+    inline void* allocate_chunk(std::size_t size, std::size_t block_size,
+                                void** block)
+    {
+        std::size_t memory_size = storage_align(size);
+        std::size_t total = storage_header_size + memory_size;
+
+        if (block_size > 0)
+            total += storage_header_size + block_size;
+
+        void* memory = std::malloc(total);
+
+        if (memory == nullptr)
+            throw_bad_alloc();
+
+        uint8_t* data = static_cast<uint8_t*>(memory);
+
+        chunk_header* chunk = new (memory) chunk_header;
+        chunk->m_parts.store(block_size > 0 ? 2 : 1,
+                             std::memory_order_relaxed);
+
+        if (block_size > 0)
+        {
+            assert(block != nullptr);
+
+            uint8_t* spare = data + storage_header_size + memory_size;
+
+            block_header* header = reinterpret_cast<block_header*>(spare);
+            header->m_chunk = chunk;
+
+            *block = spare + storage_header_size;
+        }
+
+        return data + storage_header_size;
+    }
+
+    /// Free the memory returned by allocate_chunk()
+    inline void free_chunk(void* memory)
+    {
+        assert(memory != nullptr);
+
+        release_chunk(reinterpret_cast<chunk_header*>(
+            static_cast<uint8_t*>(memory) - storage_header_size));
+    }
+
+    /// Allocator used with std::allocate_shared to place the value
+    /// and its control block in a chunk.
+    template<class T>
+    struct chunk_allocator
+    {
+        typedef T value_type;
+
+        /// @param block_size The size of the spare control block, zero
+        ///        if no spare block should be allocated
+        /// @param block Set to the spare control block
+        chunk_allocator(std::size_t block_size, void** block) :
+            m_block_size(block_size),
+            m_block(block)
+        { }
+
+        template<class U>
+        chunk_allocator(const chunk_allocator<U>& other) :
+            m_block_size(other.m_block_size),
+            m_block(other.m_block)
+        { }
+
+        T* allocate(std::size_t n)
+        {
+            // Only the first allocation gets the spare block
+            std::size_t block_size = m_block_size;
+            m_block_size = 0;
+
+            return static_cast<T*>(
+                allocate_chunk(n * sizeof(T), block_size, m_block));
+        }
+
+        void deallocate(T* p, std::size_t)
+        {
+            free_chunk(p);
+        }
+
+        template<class U>
+        bool operator==(const chunk_allocator<U>&) const
+        {
+            return true;
+        }
+
+        template<class U>
+        bool operator!=(const chunk_allocator<U>&) const
+        {
+            return false;
+        }
+
+        std::size_t m_block_size;
+        void** m_block;
+    };
+
+    /// Allocator used with std::allocate_shared for values with an
+    /// alignment larger than the one of malloc(), which operator new
+    /// does not provide before C++17. The offset to the start of the
+    /// allocation is stored in front of the memory returned.
+    template<class T, std::size_t Align>
+    struct aligned_allocator
+    {
+        typedef T value_type;
+
+        template<class U>
+        struct rebind
+        {
+            typedef aligned_allocator<U, Align> other;
+        };
+
+        aligned_allocator()
+        { }
+
+        template<class U>
+        aligned_allocator(const aligned_allocator<U, Align>&)
+        { }
+
+        T* allocate(std::size_t n)
+        {
+            std::size_t align = Align > alignof(T) ? Align : alignof(T);
+            void* memory = std::malloc(n * sizeof(T) + align +
+                                       sizeof(std::size_t));
+
+            if (memory == nullptr)
+                throw_bad_alloc();
+
+            uintptr_t start = reinterpret_cast<uintptr_t>(memory);
+            uintptr_t data = (start + sizeof(std::size_t) + align - 1) &
+                ~uintptr_t(align - 1);
+
+            reinterpret_cast<std::size_t*>(data)[-1] =
+                static_cast<std::size_t>(data - start);
+
+            return reinterpret_cast<T*>(data);
+        }
+
+        void deallocate(T* p, std::size_t)
+        {
+            uint8_t* data = reinterpret_cast<uint8_t*>(p);
+            std::size_t offset = reinterpret_cast<std::size_t*>(p)[-1];
+
+            std::free(data - offset);
+        }
+
+        template<class U>
+        bool operator==(const aligned_allocator<U, Align>&) const
+        {
+            return true;
+        }
+
+        template<class U>
+        bool operator!=(const aligned_allocator<U, Align>&) const
+        {
+            return false;
+        }
+    };
+}
+}
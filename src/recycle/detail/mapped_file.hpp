@@ -0,0 +1,131 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define RECYCLE_HAS_MMAP 1
+#else
+#include <fstream>
+#include <iterator>
+#define RECYCLE_HAS_MMAP 0
+#endif
+
+namespace recycle
+{
+namespace detail
+{
+    /// A read-only view of a file. The file is memory-mapped where
+    /// supported, so only the pages read are loaded, otherwise it is
+    /// read into memory.
+    class mapped_file
+    {
+    public:
+
+        mapped_file() = default;
+
+        ~mapped_file()
+        {
+            close();
+        }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        /// Map a file
+        /// @return false if the file could not be opened or is empty
+        bool open(const std::string& path)
+        {
+            close();
+
+#if RECYCLE_HAS_MMAP
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+
+            struct stat info;
+            if (::fstat(fd, &info) != 0 || info.st_size <= 0)
+            {
+                ::close(fd);
+                return false;
+            }
+
+            std::size_t size = static_cast<std::size_t>(info.st_size);
+            void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            // The mapping keeps the file open
+            ::close(fd);
+
+            if (data == MAP_FAILED)
+                return false;
+
+            m_data = static_cast<const uint8_t*>(data);
+            m_size = size;
+#else
+            std::ifstream file(path, std::ios::binary);
+            if (!file)
+                return false;
+
+            m_buffer.assign(std::istreambuf_iterator<char>(file),
+                            std::istreambuf_iterator<char>());
+
+            if (m_buffer.empty())
+                return false;
+
+            m_data = reinterpret_cast<const uint8_t*>(m_buffer.data());
+            m_size = m_buffer.size();
+#endif
+            return true;
+        }
+
+        /// Unmap the file
+        void close()
+        {
+#if RECYCLE_HAS_MMAP
+            if (m_data != nullptr)
+                ::munmap(const_cast<uint8_t*>(m_data), m_size);
+#else
+            m_buffer.clear();
+            m_buffer.shrink_to_fit();
+#endif
+            m_data = nullptr;
+            m_size = 0;
+        }
+
+        /// @return The content of the file
+        const uint8_t* data() const
+        {
+            return m_data;
+        }
+
+        /// @return The size of the file
+        std::size_t size() const
+        {
+            return m_size;
+        }
+
+    private:
+
+        /// The content
+        const uint8_t* m_data = nullptr;
+
+        /// The size of the content
+        std::size_t m_size = 0;
+
+#if !RECYCLE_HAS_MMAP
+        /// The content read into memory
+        std::vector<char> m_buffer;
+#endif
+    };
+}
+}
@@ -0,0 +1,165 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace recycle
+{
+namespace detail
+{
+    /// Detects whether a mutex has a try_lock() member function
+    template<class Mutex, class = void>
+    struct has_try_lock : std::false_type
+    { };
+
+    template<class Mutex>
+    struct has_try_lock<Mutex,
+        decltype(void(std::declval<Mutex&>().try_lock()))> :
+        std::true_type
+    { };
+
+    /// Detects whether a lock reports contention itself with a
+    /// contended() member function
+    template<class Lock, class = void>
+    struct has_contended : std::false_type
+    { };
+
+    template<class Lock>
+    struct has_contended<Lock,
+        decltype(void(std::declval<const Lock&>().contended()))> :
+        std::true_type
+    { };
+
+    /// Lock which tells whether the mutex was contended, i.e. already
+    /// locked when we tried to acquire it.
+    ///
+    /// Works with any mutex and lock type following the contract in
+    /// no_locking_policy.hpp. If the lock reports contention itself,
+    /// e.g. the lock of the recycle::profiled_locking_policy, that is
+    /// used. Otherwise contention is detected with try_lock() if the
+    /// mutex has it, or the lock is never reported as contended. If
+    /// the lock can adopt a mutex locked with try_lock(), e.g.
+    /// std::lock_guard, the uncontended path locks the mutex once.
+    template<class Mutex, class Lock>
+    class probing_lock
+    {
+    public:
+
+        /// Lock the mutex
+        probing_lock(Mutex& mutex) :
+            m_mutex(mutex)
+        {
+            m_contended = acquire(has_contended<Lock>());
+            m_locked = true;
+        }
+
+        ~probing_lock()
+        {
+            unlock();
+        }
+
+        probing_lock(const probing_lock&) = delete;
+        probing_lock& operator=(const probing_lock&) = delete;
+
+        /// @return true if the mutex was locked when we tried to
+        ///         acquire it
+        bool contended() const
+        {
+            return m_contended;
+        }
+
+        /// Unlock the mutex before the lock goes out of scope
+        void unlock()
+        {
+            if (!m_locked)
+                return;
+
+            lock().~Lock();
+            m_locked = false;
+        }
+
+    private:
+
+        /// Lock and ask the lock whether it was contended
+        /// @return true if the mutex was contended
+        bool acquire(std::true_type)
+        {
+            new (&m_storage) Lock(m_mutex);
+            return lock().contended();
+        }
+
+        /// Detect the contention ourselves
+        /// @return true if the mutex was contended
+        bool acquire(std::false_type)
+        {
+            return probe(has_try_lock<Mutex>(),
+                std::is_constructible<Lock, Mutex&, std::adopt_lock_t>());
+        }
+
+        /// Lock with try_lock() first and adopt the mutex
+        /// @return true if the mutex was contended
+        bool probe(std::true_type, std::true_type)
+        {
+            if (m_mutex.try_lock())
+            {
+                new (&m_storage) Lock(m_mutex, std::adopt_lock);
+                return false;
+            }
+
+            new (&m_storage) Lock(m_mutex);
+            return true;
+        }
+
+        /// Probe with try_lock(), the lock cannot adopt the mutex
+        /// @return true if the mutex was contended
+        bool probe(std::true_type, std::false_type)
+        {
+            bool contended = !m_mutex.try_lock();
+
+            if (!contended)
+                m_mutex.unlock();
+
+            new (&m_storage) Lock(m_mutex);
+            return contended;
+        }
+
+        /// Lock without detecting contention
+        /// @return false
+        template<class Adopt>
+        bool probe(std::false_type, Adopt)
+        {
+            new (&m_storage) Lock(m_mutex);
+            return false;
+        }
+
+        /// @return The lock
+        Lock& lock()
+        {
+            return *reinterpret_cast<Lock*>(&m_storage);
+        }
+
+    private:
+
+        /// The mutex
+        Mutex& m_mutex;
+
+        /// Whether the mutex was contended
+        bool m_contended = false;
+
+        /// Whether the lock is held
+        bool m_locked = false;
+
+        /// Storage for the lock, constructed either locking or
+        /// adopting the mutex
+        typename std::aligned_storage<sizeof(Lock), alignof(Lock)>::type
+            m_storage;
+    };
+}
+}
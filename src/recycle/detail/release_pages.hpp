@@ -0,0 +1,74 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define RECYCLE_HAS_MADVISE 1
+#else
+#define RECYCLE_HAS_MADVISE 0
+#endif
+
+namespace recycle
+{
+namespace detail
+{
+    /// @return The size of a memory page, or zero if pages cannot be
+    ///         released on this platform
+    inline std::size_t page_size()
+    {
+#if RECYCLE_HAS_MADVISE
+        static const std::size_t size =
+            static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+        return size;
+#else
+        return 0;
+#endif
+    }
+
+    /// Returns the pages fully inside a memory range to the operating
+    /// system. The memory stays mapped and is faulted in again when
+    /// used, but its content is lost. The partial pages at either end
+    /// are left alone, since they may be shared with other data.
+    /// @return true if any pages were released
+    inline bool release_pages(void* data, std::size_t size)
+    {
+#if RECYCLE_HAS_MADVISE
+        std::size_t page = page_size();
+        if (data == nullptr || page == 0)
+            return false;
+
+        uintptr_t begin = reinterpret_cast<uintptr_t>(data);
+        uintptr_t end = begin + size;
+
+        begin = (begin + page - 1) & ~uintptr_t(page - 1);
+        end = end & ~uintptr_t(page - 1);
+
+        if (end <= begin)
+            return false;
+
+        void* first = reinterpret_cast<void*>(begin);
+        std::size_t length = static_cast<std::size_t>(end - begin);
+
+#ifdef MADV_FREE
+        // The pages are only reclaimed under memory pressure, which is
+        // cheaper if they are reused soon. Older kernels reject it.
+        if (::madvise(first, length, MADV_FREE) == 0)
+            return true;
+#endif
+        return ::madvise(first, length, MADV_DONTNEED) == 0;
+#else
+        (void) data;
+        (void) size;
+        return false;
+#endif
+    }
+}
+}
@@ -0,0 +1,277 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include "mapped_file.hpp"
+
+namespace recycle
+{
+namespace detail
+{
+    /// The format of a snapshot file is a header with a magic string,
+    /// a version and the number of records, followed by the records.
+    /// A record is its size followed by the bytes written by the
+    /// serialize function. Integers are stored in little-endian byte
+    /// order.
+    struct snapshot_format
+    {
+        /// The size of the magic string
+        static const std::size_t magic_size = 8;
+
+        /// The size of the header
+        static const std::size_t header_size = magic_size + 16;
+
+        /// The version of the file format
+        static const uint64_t version = 1;
+
+        /// @return The magic string starting a snapshot file
+        static const char* magic()
+        {
+            return "RCYSNAPS";
+        }
+
+        static void store_u64(uint8_t* bytes, uint64_t value)
+        {
+            for (std::size_t i = 0; i < 8; ++i)
+                bytes[i] = static_cast<uint8_t>((value >> (8 * i)) & 0xff);
+        }
+
+        static uint64_t load_u64(const uint8_t* bytes)
+        {
+            uint64_t value = 0;
+            for (std::size_t i = 0; i < 8; ++i)
+                value |= uint64_t(bytes[i]) << (8 * i);
+
+            return value;
+        }
+    };
+
+    /// Reads the records of a memory-mapped snapshot file in order
+    class snapshot_reader
+    {
+    public:
+
+        /// Map a snapshot file
+        /// @return false if the file is not a valid snapshot
+        bool open(const std::string& path)
+        {
+            if (!m_file.open(path))
+                return false;
+
+            const uint8_t* data = m_file.data();
+
+            if (m_file.size() < snapshot_format::header_size ||
+                std::memcmp(data, snapshot_format::magic(),
+                            snapshot_format::magic_size) != 0 ||
+                snapshot_format::load_u64(data + snapshot_format::magic_size) !=
+                    snapshot_format::version)
+            {
+                m_file.close();
+                return false;
+            }
+
+            m_remaining = snapshot_format::load_u64(
+                data + snapshot_format::magic_size + 8);
+            m_offset = snapshot_format::header_size;
+            return true;
+        }
+
+        /// Read the next record
+        /// @param data Assigned the bytes of the record
+        /// @param size Assigned the size of the record
+        /// @return false if no records remain or the file is truncated
+        bool next(const uint8_t*& data, std::size_t& size)
+        {
+            if (!peek(m_offset, data, size))
+            {
+                m_remaining = 0;
+                return false;
+            }
+
+            m_offset = static_cast<std::size_t>(data - m_file.data()) + size;
+            --m_remaining;
+            return true;
+        }
+
+        /// Calls f(data, size) for each record not read yet
+        template<class Function>
+        void visit_remaining(Function f) const
+        {
+            std::size_t offset = m_offset;
+
+            for (uint64_t i = 0; i < m_remaining; ++i)
+            {
+                const uint8_t* data;
+                std::size_t size;
+
+                if (!peek(offset, data, size))
+                    return;
+
+                f(data, size);
+                offset = static_cast<std::size_t>(data - m_file.data()) + size;
+            }
+        }
+
+        /// @return The number of records not read yet
+        uint64_t remaining() const
+        {
+            return m_remaining;
+        }
+
+    private:
+
+        /// Locate the record at an offset
+        bool peek(std::size_t offset, const uint8_t*& data,
+                  std::size_t& size) const
+        {
+            if (m_remaining == 0 || m_file.size() - offset < 8)
+                return false;
+
+            uint64_t length = snapshot_format::load_u64(m_file.data() + offset);
+
+            if (length > m_file.size() - offset - 8)
+                return false;
+
+            data = m_file.data() + offset + 8;
+            size = static_cast<std::size_t>(length);
+            return true;
+        }
+
+    private:
+
+        /// The file
+        mapped_file m_file;
+
+        /// The offset of the next record
+        std::size_t m_offset = 0;
+
+        /// The number of records not read yet
+        uint64_t m_remaining = 0;
+    };
+
+    /// Writes a snapshot file. The records are written to a temporary
+    /// file which replaces the file when committed, so a crash while
+    /// writing leaves the previous snapshot intact. Each writer has
+    /// its own temporary file, so concurrent writers of the same path
+    /// do not interfere, the last one committed wins.
+    class snapshot_writer
+    {
+    public:
+
+        snapshot_writer() = default;
+
+        snapshot_writer(const snapshot_writer&) = delete;
+        snapshot_writer& operator=(const snapshot_writer&) = delete;
+
+        /// Removes the temporary file unless the snapshot was committed
+        ~snapshot_writer()
+        {
+            if (m_temporary.empty())
+                return;
+
+            m_file.close();
+            std::remove(m_temporary.c_str());
+        }
+
+        /// Start writing a snapshot file
+        /// @return false if the temporary file could not be created
+        bool open(const std::string& path)
+        {
+            m_path = path;
+            m_temporary = temporary_path(path);
+            m_count = 0;
+            m_file.open(m_temporary, std::ios::binary | std::ios::trunc);
+
+            // The count is written when committed
+            uint8_t header[snapshot_format::header_size] = {};
+            std::memcpy(header, snapshot_format::magic(),
+                        snapshot_format::magic_size);
+            snapshot_format::store_u64(header + snapshot_format::magic_size,
+                                       snapshot_format::version);
+
+            m_file.write(reinterpret_cast<const char*>(header),
+                         sizeof(header));
+
+            return m_file.good();
+        }
+
+        /// Append a record
+        void add(const uint8_t* data, std::size_t size)
+        {
+            uint8_t length[8];
+            snapshot_format::store_u64(length, size);
+
+            m_file.write(reinterpret_cast<const char*>(length), 8);
+            m_file.write(reinterpret_cast<const char*>(data),
+                         static_cast<std::streamsize>(size));
+            ++m_count;
+        }
+
+        /// Finish the snapshot and replace the file
+        /// @return false if writing failed, the file is then unchanged
+        bool commit()
+        {
+            uint8_t count[8];
+            snapshot_format::store_u64(count, m_count);
+
+            m_file.seekp(snapshot_format::magic_size + 8);
+            m_file.write(reinterpret_cast<const char*>(count), 8);
+            m_file.close();
+
+            if (m_file.fail() ||
+                std::rename(m_temporary.c_str(), m_path.c_str()) != 0)
+            {
+                return false;
+            }
+
+            m_temporary.clear();
+            return true;
+        }
+
+    private:
+
+        /// @return A path next to the snapshot not used by any other
+        ///         writer, the process id tells processes apart and a
+        ///         counter the writers of this process
+        static std::string temporary_path(const std::string& path)
+        {
+            static std::atomic<uint64_t> counter{0};
+
+#if RECYCLE_HAS_MMAP
+            uint64_t process = static_cast<uint64_t>(::getpid());
+#else
+            // Without a process id the start time tells processes apart
+            static const uint64_t process = static_cast<uint64_t>(
+                std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+            return path + ".tmp." + std::to_string(process) + "." +
+                std::to_string(counter.fetch_add(1));
+        }
+
+    private:
+
+        /// The path of the snapshot
+        std::string m_path;
+
+        /// The path of the temporary file, empty once committed
+        std::string m_temporary;
+
+        /// The temporary file
+        std::ofstream m_file;
+
+        /// The number of records written
+        uint64_t m_count = 0;
+    };
+}
+}
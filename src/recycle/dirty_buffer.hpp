@@ -0,0 +1,260 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace recycle
+{
+    /// A fixed size byte buffer keeping track of the parts written, so
+    /// a recycle function only needs to scrub or checksum those, see
+    /// dirty_recycle() and recycle::scrub_recycle. The writes are
+    /// recorded per page in a bitmap together with the high water
+    /// mark, i.e. the end of the last byte written.
+    ///
+    /// Writes through write() and writable() are recorded. Writes
+    /// through data() must be recorded with mark_dirty().
+    class dirty_buffer
+    {
+    public:
+
+        /// The default size of the pages tracked
+        static const std::size_t default_page_size = 4096;
+
+        /// Create a buffer of zeros
+        /// @param size The size of the buffer in bytes
+        /// @param page_size The granularity of the tracking in bytes
+        explicit dirty_buffer(std::size_t size,
+                              std::size_t page_size = default_page_size) :
+            m_data(new uint8_t[size]()),
+            m_size(size),
+            m_page_size(page_size),
+            m_pages(bitmap_words(size, page_size), 0)
+        { }
+
+        dirty_buffer(dirty_buffer&&) = default;
+        dirty_buffer& operator=(dirty_buffer&&) = default;
+
+        /// @return The size of the buffer in bytes
+        std::size_t size() const
+        {
+            return m_size;
+        }
+
+        /// @return The size of the pages tracked
+        std::size_t page_size() const
+        {
+            return m_page_size;
+        }
+
+        /// @return The content of the buffer
+        const uint8_t* data() const
+        {
+            return m_data.get();
+        }
+
+        /// @return The content of the buffer. Writes through the
+        ///         pointer must be recorded with mark_dirty().
+        uint8_t* data()
+        {
+            return m_data.get();
+        }
+
+        /// Copy bytes into the buffer and record the write
+        void write(std::size_t offset, const void* bytes, std::size_t size)
+        {
+            std::memcpy(writable(offset, size), bytes, size);
+        }
+
+        /// Record a write and return the memory to write to
+        /// @return The content of the buffer at the offset
+        uint8_t* writable(std::size_t offset, std::size_t size)
+        {
+            mark_dirty(offset, size);
+            return m_data.get() + offset;
+        }
+
+        /// Record a write to a part of the buffer
+        void mark_dirty(std::size_t offset, std::size_t size)
+        {
+            assert(offset <= m_size && size <= m_size - offset);
+
+            if (size == 0)
+                return;
+
+            m_dirty_size = std::max(m_dirty_size, offset + size);
+
+            std::size_t first = offset / m_page_size;
+            std::size_t last = (offset + size - 1) / m_page_size;
+
+            for (std::size_t page = first; page <= last; ++page)
+                m_pages[page / 64] |= uint64_t(1) << (page % 64);
+        }
+
+        /// @return The end of the last byte written, zero if the
+        ///         buffer is clean
+        std::size_t dirty_size() const
+        {
+            return m_dirty_size;
+        }
+
+        /// @return The number of pages written
+        std::size_t dirty_pages() const
+        {
+            std::size_t count = 0;
+
+            for (std::size_t i = 0; i < used_words(); ++i)
+            {
+                for (uint64_t word = m_pages[i]; word != 0; word &= word - 1)
+                    ++count;
+            }
+
+            return count;
+        }
+
+        /// Calls f(offset, size) for each run of pages written, in
+        /// order. A run including the last page ends at the end of
+        /// the buffer.
+        template<class Function>
+        void for_each_dirty_range(Function f) const
+        {
+            std::size_t start = 0;
+            std::size_t length = 0;
+
+            for (std::size_t i = 0; i < used_words(); ++i)
+            {
+                uint64_t word = m_pages[i];
+
+                // Clean words are skipped, so sparse writes to a large
+                // buffer cost little
+                if (word == 0 && length == 0)
+                    continue;
+
+                for (std::size_t bit = 0; bit < 64; ++bit)
+                {
+                    std::size_t page = i * 64 + bit;
+
+                    if (word & (uint64_t(1) << bit))
+                    {
+                        if (length == 0)
+                            start = page;
+
+                        ++length;
+                    }
+                    else if (length > 0)
+                    {
+                        visit(f, start, length);
+                        length = 0;
+                    }
+                }
+            }
+
+            if (length > 0)
+                visit(f, start, length);
+        }
+
+        /// Forget the writes, e.g. once the buffer has been scrubbed
+        void clear_dirty()
+        {
+            std::fill(m_pages.begin(), m_pages.begin() + used_words(), 0);
+            m_dirty_size = 0;
+        }
+
+    private:
+
+        /// @return The number of bitmap words needed to track a buffer,
+        ///         each word holds the bits of 64 pages
+        static std::size_t bitmap_words(std::size_t size,
+                                        std::size_t page_size)
+        {
+            assert(page_size > 0);
+
+            std::size_t pages = (size + page_size - 1) / page_size;
+            return (pages + 63) / 64;
+        }
+
+        /// @return The number of bitmap words up to the high water mark
+        std::size_t used_words() const
+        {
+            if (m_dirty_size == 0)
+                return 0;
+
+            return (m_dirty_size - 1) / m_page_size / 64 + 1;
+        }
+
+        /// Calls f with the bytes of a run of pages
+        template<class Function>
+        void visit(Function& f, std::size_t page, std::size_t pages) const
+        {
+            std::size_t offset = page * m_page_size;
+            std::size_t end = std::min(m_size, offset + pages * m_page_size);
+
+            f(offset, end - offset);
+        }
+
+    private:
+
+        /// The content
+        std::unique_ptr<uint8_t[]> m_data;
+
+        /// The size of the content
+        std::size_t m_size;
+
+        /// The size of the pages tracked
+        std::size_t m_page_size;
+
+        /// One bit per page, set if the page was written
+        std::vector<uint64_t> m_pages;
+
+        /// The end of the last byte written
+        std::size_t m_dirty_size = 0;
+    };
+
+    /// A recycle function for pools of dirty_buffer calling a function
+    /// for each range written, e.g. to scrub or checksum the buffer,
+    /// after which the writes are forgotten.
+    template<class Function>
+    struct dirty_recycle_function
+    {
+        template<class BufferPtr>
+        void operator()(const BufferPtr& buffer) const
+        {
+            dirty_buffer& b = *buffer;
+            const Function& f = m_function;
+
+            b.for_each_dirty_range(
+                [&b, &f](std::size_t offset, std::size_t size)
+                { f(b, offset, size); });
+
+            b.clear_dirty();
+        }
+
+        /// Called with the buffer, the offset and size of each range
+        Function m_function;
+    };
+
+    /// Example:
+    ///
+    ///     recycle::resource_pool<recycle::dirty_buffer> pool(
+    ///         [] { return std::make_shared<recycle::dirty_buffer>(65536); },
+    ///         recycle::dirty_recycle(
+    ///             [](recycle::dirty_buffer& b, std::size_t o, std::size_t n)
+    ///             { checksum.update(b.data() + o, n); }));
+    ///
+    /// @return A recycle function calling f(buffer, offset, size) for
+    ///         each range written
+    template<class Function>
+    dirty_recycle_function<Function> dirty_recycle(Function f)
+    {
+        return dirty_recycle_function<Function>{std::move(f)};
+    }
+}
@@ -0,0 +1,98 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+
+namespace recycle
+{
+    namespace detail
+    {
+        /// @return The flag set when the process starts exiting
+        inline std::atomic<bool>& exiting_flag()
+        {
+            static std::atomic<bool> exiting{false};
+            return exiting;
+        }
+
+        /// @return The flag enabling the leak on exit for all pools
+        inline std::atomic<bool>& global_leak_on_exit()
+        {
+            static std::atomic<bool> enabled{false};
+            return enabled;
+        }
+
+        /// Called by std::exit() or when main() returns
+        inline void mark_exiting()
+        {
+            exiting_flag().store(true, std::memory_order_relaxed);
+        }
+
+        /// Registers mark_exiting() with std::atexit() on the first
+        /// call. Since the functions registered run in the reverse
+        /// order, together with the destructors of static objects, the
+        /// flag is set before any static pool constructed before the
+        /// first call is destroyed. It is only registered once, as the
+        /// C runtime only guarantees 32 registrations.
+        /// @return true if the handler was registered
+        inline bool register_exit_handler()
+        {
+            static const bool registered = std::atexit(&mark_exiting) == 0;
+            return registered;
+        }
+
+        /// Storage left behind by a pool at exit. The leaked nodes
+        /// stay reachable from a static list so leak checkers do not
+        /// report them.
+        struct leaked_node
+        {
+            leaked_node* m_next = nullptr;
+        };
+
+        /// @return The head of the list of leaked storage
+        inline std::atomic<leaked_node*>& leaked_list()
+        {
+            static std::atomic<leaked_node*> head{nullptr};
+            return head;
+        }
+
+        /// Keeps leaked storage reachable
+        inline void keep_leaked(leaked_node* node)
+        {
+            std::atomic<leaked_node*>& head = leaked_list();
+
+            node->m_next = head.load(std::memory_order_relaxed);
+            while (!head.compare_exchange_weak(node->m_next, node,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed))
+            { }
+        }
+    }
+
+    /// Leak the unused resources of all pools when the process exits,
+    /// see resource_pool::set_leak_on_exit(). Affects the static pools
+    /// constructed before the leak on exit is first enabled, by this
+    /// call or by a pool, e.g. call it at the start of main() once the
+    /// function-local static pools are constructed.
+    /// @param enabled Whether the unused resources are leaked
+    inline void set_leak_on_exit(bool enabled)
+    {
+        if (enabled)
+            detail::register_exit_handler();
+
+        detail::global_leak_on_exit().store(enabled,
+                                            std::memory_order_relaxed);
+    }
+
+    /// @return true if std::exit() was called or main() returned. The
+    ///         exit is only detected once the leak on exit has been
+    ///         enabled, before that false is returned.
+    inline bool process_exiting()
+    {
+        return detail::exiting_flag().load(std::memory_order_relaxed);
+    }
+}
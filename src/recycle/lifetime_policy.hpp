@@ -0,0 +1,95 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <memory>
+
+namespace recycle
+{
+    /// Defines the default lifetime policy for the
+    /// recycle::resource_pool.
+    ///
+    /// The lifetime policy decides how objects allocated from the
+    /// pool refer back to the pool they should be recycled into. A
+    /// valid lifetime policy defines the pointer type stored in each
+    /// object, how it is created from the pool and how it is turned
+    /// into something which can be dereferenced:
+    ///
+    ///     using pointer = policy::pointer_type<pool>;
+    ///
+    ///     pointer p = policy::make_pointer(pool_object);
+    ///
+    ///     if (auto pool = policy::lock(p))
+    ///     {
+    ///         ... // the pool is alive and can be used through pool
+    ///     }
+    ///
+    /// With the shared_lifetime_policy the objects store a
+    /// std::weak_ptr to the pool, so objects may safely outlive the
+    /// pool. Once the pool is gone the objects are simply destroyed
+    /// when released.
+    struct shared_lifetime_policy
+    {
+        /// The back-pointer type stored in the allocated objects
+        template<class Pool>
+        using pointer_type = std::weak_ptr<Pool>;
+
+        /// The pool is allowed to die before its objects
+        static const bool pool_outlives_objects = false;
+
+        /// @return A back-pointer to the pool
+        template<class Pool>
+        static std::weak_ptr<Pool> make_pointer(Pool& pool)
+        {
+            return pool.shared_from_this();
+        }
+
+        /// @return The pool if it is still alive otherwise an empty
+        ///         std::shared_ptr
+        template<class Pool>
+        static std::shared_ptr<Pool> lock(const std::weak_ptr<Pool>& pool)
+        {
+            return pool.lock();
+        }
+    };
+
+    /// Lifetime policy for pools which are guaranteed to outlive all
+    /// objects allocated from them, e.g., pools that live for the
+    /// entire lifetime of the process.
+    ///
+    /// The objects store a raw pointer to the pool, which avoids the
+    /// atomic reference counting of the std::weak_ptr used by the
+    /// shared_lifetime_policy every time an object is allocated and
+    /// released.
+    ///
+    /// It is undefined behavior if an object, or a std::weak_ptr to
+    /// it, is still alive when the pool is destroyed. In debug builds
+    /// the pool asserts that no objects are outstanding when it is
+    /// destroyed.
+    struct pool_outlives_objects_policy
+    {
+        /// The back-pointer type stored in the allocated objects
+        template<class Pool>
+        using pointer_type = Pool*;
+
+        /// The pool must outlive its objects
+        static const bool pool_outlives_objects = true;
+
+        /// @return A back-pointer to the pool
+        template<class Pool>
+        static Pool* make_pointer(Pool& pool)
+        {
+            return &pool;
+        }
+
+        /// @return The pool
+        template<class Pool>
+        static Pool* lock(Pool* pool)
+        {
+            return pool;
+        }
+    };
+}
@@ -0,0 +1,553 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "detail/block_storage.hpp"
+#include "no_locking_policy.hpp"
+
+namespace recycle
+{
+    namespace detail
+    {
+        /// @return The next unused number of a type derived from Base
+        template<class Base>
+        std::size_t next_poly_type_id()
+        {
+            static std::atomic<std::size_t> next{0};
+            return next.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /// @return The number of a type derived from Base, assigned the
+        ///         first time it is asked for. The types derived from
+        ///         the same base are numbered densely from zero.
+        template<class Base, class Derived>
+        std::size_t poly_type_id()
+        {
+            static const std::size_t id = next_poly_type_id<Base>();
+            return id;
+        }
+    }
+
+    /// @brief The poly resource pool recycles objects of several types
+    ///        derived from a common base.
+    ///
+    /// Each derived type has its own free list, while the capacity and
+    /// the memory budget for unused objects are shared by all types.
+    /// The type of an allocation is known at compile time, so the free
+    /// list is found without RTTI and the objects are destroyed
+    /// through their own type. Each type derived from the base is
+    /// numbered the first time it is allocated, and the number indexes
+    /// the free lists of every pool directly. The released objects
+    /// carry that number. The base does not need a virtual destructor.
+    ///
+    /// The allocated objects are handed out as std::shared_ptr<Base>
+    /// and go back to the free list of their type when released. The
+    /// objects may outlive the pool.
+    ///
+    /// Example:
+    ///
+    ///     recycle::poly_resource_pool<message> pool;
+    ///
+    ///     std::shared_ptr<message> m = pool.allocate<ack_message>();
+    ///
+    template<class Base, class LockingPolicy = no_locking_policy>
+    class poly_resource_pool
+    {
+    public:
+
+        /// The base type of the objects
+        using base_type = Base;
+
+        /// The pointer to the objects
+        using value_ptr = std::shared_ptr<base_type>;
+
+        /// The recycle function type
+        /// If specified the recycle function will be called every time
+        /// an object is released
+        using recycle_function = std::function<void(base_type&)>;
+
+        /// The locking policy mutex type
+        using mutex_type = typename LockingPolicy::mutex_type;
+
+        /// The locking policy lock type
+        using lock_type = typename LockingPolicy::lock_type;
+
+        /// The default maximum number of unused objects kept in the
+        /// pool
+        static const std::size_t DEFAULT_CAPACITY = 10000;
+
+        /// The default memory budget, i.e. no limit
+        static const std::size_t UNLIMITED_BYTES =
+            std::numeric_limits<std::size_t>::max();
+
+    public:
+
+        /// Create a pool
+        /// @param capacity The maximum number of unused objects kept of
+        ///        all types
+        /// @param max_bytes The largest total size of the unused
+        ///        objects kept, counted as the sizeof() their types
+        poly_resource_pool(std::size_t capacity = DEFAULT_CAPACITY,
+                           std::size_t max_bytes = UNLIMITED_BYTES) :
+            m_pool(std::make_shared<impl>(recycle_function(), capacity,
+                                          max_bytes))
+        { }
+
+        /// Create a pool using a recycle function
+        /// @param recycle Recycle function
+        /// @param capacity The maximum number of unused objects kept of
+        ///        all types
+        /// @param max_bytes The largest total size of the unused
+        ///        objects kept, counted as the sizeof() their types
+        poly_resource_pool(recycle_function recycle,
+                           std::size_t capacity = DEFAULT_CAPACITY,
+                           std::size_t max_bytes = UNLIMITED_BYTES) :
+            m_pool(std::make_shared<impl>(std::move(recycle), capacity,
+                                          max_bytes))
+        {
+            assert(m_pool->m_recycle);
+        }
+
+        /// The pool owns unused objects of types only known when they
+        /// were allocated, so it is not copyable
+        poly_resource_pool(const poly_resource_pool&) = delete;
+        poly_resource_pool& operator=(const poly_resource_pool&) = delete;
+
+        /// Move constructor
+        poly_resource_pool(poly_resource_pool&& other) = default;
+
+        /// Move assignment
+        poly_resource_pool& operator=(poly_resource_pool&& other) = default;
+
+        /// Allocate an object of a derived type
+        /// @return An unused object of the type, or a default
+        ///         constructed one if none is unused
+        template<class Derived>
+        value_ptr allocate()
+        {
+            static_assert(std::is_base_of<base_type, Derived>::value,
+                          "The type must derive from the base type");
+            static_assert(std::is_default_constructible<Derived>::value,
+                          "The type must be default constructible");
+
+            assert(m_pool);
+
+            const std::size_t id = detail::poly_type_id<Base, Derived>();
+
+            control_block* block = nullptr;
+            base_type* object = m_pool->take(id, &destroy<Derived>,
+                                             sizeof(Derived), block);
+
+            if (object == nullptr)
+            {
+                // The control block is handed back if the constructor
+                // throws
+                block_guard guard(*m_pool, block);
+                object = new Derived();
+                guard.dismiss();
+            }
+
+            return value_ptr(object,
+                deleter(m_pool, id, &destroy<Derived>),
+                block_allocator<base_type>(block, m_pool));
+        }
+
+        /// @returns the number of unused objects of all types
+        std::size_t unused_resources() const
+        {
+            assert(m_pool);
+
+            lock_type lock(m_pool->m_mutex);
+            return m_pool->m_unused;
+        }
+
+        /// @returns the number of unused objects of a type
+        template<class Derived>
+        std::size_t unused_resources() const
+        {
+            assert(m_pool);
+
+            const std::size_t id = detail::poly_type_id<Base, Derived>();
+
+            lock_type lock(m_pool->m_mutex);
+
+            if (id >= m_pool->m_types.size())
+                return 0;
+
+            return m_pool->m_types[id].m_free.size();
+        }
+
+        /// @returns the total size of the unused objects
+        std::size_t unused_bytes() const
+        {
+            assert(m_pool);
+
+            lock_type lock(m_pool->m_mutex);
+            return m_pool->m_unused_bytes;
+        }
+
+        /// @returns the maximum number of unused objects kept
+        std::size_t capacity() const
+        {
+            assert(m_pool);
+            return m_pool->m_capacity;
+        }
+
+        /// @returns the largest total size of the unused objects kept
+        std::size_t max_bytes() const
+        {
+            assert(m_pool);
+            return m_pool->m_max_bytes;
+        }
+
+        /// Frees all unused objects
+        void free_unused()
+        {
+            assert(m_pool);
+            m_pool->free_unused();
+        }
+
+    private:
+
+        /// Destroys an object through its own type
+        template<class Derived>
+        static void destroy(base_type* object)
+        {
+            delete static_cast<Derived*>(object);
+        }
+
+        /// Function destroying an object of a given type
+        using destroy_function = void (*)(base_type*);
+
+        /// An unused control block, see resource_pool
+        struct control_block
+        {
+            control_block* m_next;
+        };
+
+        /// The unused objects of a type
+        struct type_list
+        {
+            /// The unused objects
+            std::vector<base_type*> m_free;
+
+            /// Destroys an object of the type
+            destroy_function m_destroy = nullptr;
+
+            /// The size of the type
+            std::size_t m_size = 0;
+        };
+
+        /// The pool state, shared with the allocated objects
+        struct impl
+        {
+            impl(recycle_function recycle, std::size_t capacity,
+                 std::size_t max_bytes) :
+                m_recycle(std::move(recycle)),
+                m_capacity(capacity),
+                m_max_bytes(max_bytes)
+            { }
+
+            impl(const impl&) = delete;
+            impl& operator=(const impl&) = delete;
+
+            ~impl()
+            {
+                free_unused();
+            }
+
+            /// Takes an unused object of a type and an unused control
+            /// block, taking the lock once
+            /// @param id The number of the type
+            /// @param block Assigned a control block if one is unused
+            /// @return The object or nullptr if none is unused
+            base_type* take(std::size_t id, destroy_function destroy,
+                            std::size_t size, control_block*& block)
+            {
+                lock_type lock(m_mutex);
+
+                if (m_free_blocks != nullptr)
+                {
+                    block = m_free_blocks;
+                    m_free_blocks = block->m_next;
+                    --m_free_block_count;
+                }
+
+                // The first allocation of a type from this pool
+                // registers it
+                if (id >= m_types.size())
+                    m_types.resize(id + 1);
+
+                type_list& type = m_types[id];
+
+                if (type.m_destroy == nullptr)
+                {
+                    type.m_destroy = destroy;
+                    type.m_size = size;
+                }
+
+                if (type.m_free.empty())
+                    return nullptr;
+
+                base_type* object = type.m_free.back();
+                type.m_free.pop_back();
+
+                --m_unused;
+                m_unused_bytes -= type.m_size;
+
+                return object;
+            }
+
+            /// Called when an object is released
+            void recycle(std::size_t id, base_type* object)
+            {
+                if (m_recycle)
+                {
+                    m_recycle(*object);
+                }
+
+                destroy_function destroy;
+                {
+                    lock_type lock(m_mutex);
+
+                    // The type was registered when the object was
+                    // allocated
+                    assert(id < m_types.size());
+                    type_list& type = m_types[id];
+
+                    if (m_unused < m_capacity &&
+                        type.m_size <= m_max_bytes - m_unused_bytes)
+                    {
+                        type.m_free.push_back(object);
+
+                        ++m_unused;
+                        m_unused_bytes += type.m_size;
+                        return;
+                    }
+
+                    destroy = type.m_destroy;
+                }
+
+                destroy(object);
+            }
+
+            /// Caches a control block
+            /// @return true if the block was cached otherwise the
+            ///         caller should release the memory.
+            bool recycle_block(void* memory)
+            {
+                lock_type lock(m_mutex);
+
+                if (m_free_block_count >= m_capacity)
+                    return false;
+
+                control_block* block = static_cast<control_block*>(memory);
+                block->m_next = m_free_blocks;
+                m_free_blocks = block;
+                ++m_free_block_count;
+                return true;
+            }
+
+            /// Frees the unused objects and control blocks, the objects
+            /// are destroyed without holding the lock
+            void free_unused()
+            {
+                std::vector<type_list> types;
+                control_block* blocks;
+                {
+                    lock_type lock(m_mutex);
+
+                    for (type_list& type : m_types)
+                    {
+                        types.emplace_back();
+                        types.back().m_destroy = type.m_destroy;
+                        types.back().m_free.swap(type.m_free);
+                    }
+
+                    blocks = m_free_blocks;
+                    m_free_blocks = nullptr;
+                    m_free_block_count = 0;
+                    m_unused = 0;
+                    m_unused_bytes = 0;
+                }
+
+                for (type_list& type : types)
+                {
+                    for (base_type* object : type.m_free)
+                        type.m_destroy(object);
+                }
+
+                while (blocks != nullptr)
+                {
+                    control_block* next = blocks->m_next;
+                    detail::free_block(blocks);
+                    blocks = next;
+                }
+            }
+
+            /// The recycle function
+            recycle_function m_recycle;
+
+            /// The maximum number of unused objects
+            const std::size_t m_capacity;
+
+            /// The largest total size of the unused objects
+            const std::size_t m_max_bytes;
+
+            /// The free lists indexed by the number of the type, the
+            /// types not allocated from this pool have no destroy
+            /// function
+            std::vector<type_list> m_types;
+
+            /// The number of unused objects
+            std::size_t m_unused = 0;
+
+            /// The total size of the unused objects
+            std::size_t m_unused_bytes = 0;
+
+            /// Head of the intrusive list of unused control blocks
+            control_block* m_free_blocks = nullptr;
+
+            /// The number of unused control blocks
+            std::size_t m_free_block_count = 0;
+
+            /// Mutex used to coordinate access to the pool
+            mutable mutex_type m_mutex;
+        };
+
+        /// Hands back an unused control block when it goes out of
+        /// scope, unless dismissed
+        struct block_guard
+        {
+            block_guard(impl& pool, control_block*& block) :
+                m_pool(pool),
+                m_block(block)
+            { }
+
+            ~block_guard()
+            {
+                if (m_armed && m_block != nullptr &&
+                    !m_pool.recycle_block(m_block))
+                {
+                    detail::free_block(m_block);
+                }
+            }
+
+            block_guard(const block_guard&) = delete;
+            block_guard& operator=(const block_guard&) = delete;
+
+            /// The block is used, keep it
+            void dismiss()
+            {
+                m_armed = false;
+            }
+
+            impl& m_pool;
+            control_block*& m_block;
+            bool m_armed = true;
+        };
+
+        /// The allocator of the control blocks of the objects handed
+        /// out, all have the same size since the std::shared_ptr
+        /// always rebinds to the same control block type
+        template<class T>
+        struct block_allocator
+        {
+            typedef T value_type;
+
+            block_allocator(control_block* block,
+                            const std::weak_ptr<impl>& pool) :
+                m_block(block),
+                m_pool(pool)
+            { }
+
+            template<class U>
+            block_allocator(const block_allocator<U>& other) :
+                m_block(other.m_block),
+                m_pool(other.m_pool)
+            { }
+
+            T* allocate(std::size_t n)
+            {
+                if (m_block != nullptr && n == 1)
+                {
+                    T* result = reinterpret_cast<T*>(m_block);
+                    m_block = nullptr;
+                    return result;
+                }
+
+                return static_cast<T*>(detail::allocate_block(n * sizeof(T)));
+            }
+
+            void deallocate(T* p, std::size_t n)
+            {
+                // The block must be able to hold the intrusive free
+                // list link
+                assert(sizeof(T) >= sizeof(control_block));
+
+                auto pool = m_pool.lock();
+
+                if (n == 1 && pool && pool->recycle_block(p))
+                    return;
+
+                detail::free_block(p);
+            }
+
+            control_block* m_block;
+            std::weak_ptr<impl> m_pool;
+        };
+
+        /// The deleter returning an object to the free list of its
+        /// type, or destroying it if the pool died
+        struct deleter
+        {
+            deleter(const std::weak_ptr<impl>& pool, std::size_t id,
+                    destroy_function destroy) :
+                m_pool(pool),
+                m_id(id),
+                m_destroy(destroy)
+            { }
+
+            void operator()(base_type* object)
+            {
+                auto pool = m_pool.lock();
+
+                if (pool)
+                {
+                    pool->recycle(m_id, object);
+                }
+                else
+                {
+                    m_destroy(object);
+                }
+            }
+
+            /// The pool
+            std::weak_ptr<impl> m_pool;
+
+            /// The type id of the object
+            std::size_t m_id;
+
+            /// Destroys the object if the pool died
+            destroy_function m_destroy;
+        };
+
+    private:
+
+        /// The pool impl
+        std::shared_ptr<impl> m_pool;
+    };
+}
@@ -0,0 +1,215 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <cassert>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace recycle
+{
+namespace detail
+{
+    /// The resources released into a recycle::pool_scope for one pool
+    struct scope_batch
+    {
+        virtual ~scope_batch()
+        { }
+
+        /// Returns the resources to the pool
+        virtual void flush() = 0;
+    };
+
+    /// The batches of a recycle::pool_scope, one per pool. A pool is
+    /// identified by its address and a tag unique to its type, so a
+    /// batch left by a pool which died is never mistaken for the batch
+    /// of a pool of another type created at the same address.
+    class scope_state
+    {
+    public:
+
+        /// @param parent The scope which was active on the thread when
+        ///        this one was created, or nullptr
+        scope_state(scope_state* parent) :
+            m_parent(parent)
+        { }
+
+        scope_state(const scope_state&) = delete;
+        scope_state& operator=(const scope_state&) = delete;
+
+        /// @return The batch of a pool in this scope or nullptr
+        scope_batch* find_local(const void* pool, const void* type) const
+        {
+            for (const auto& batch : m_batches)
+            {
+                if (batch.m_pool == pool && batch.m_type == type)
+                    return batch.m_batch.get();
+            }
+
+            return nullptr;
+        }
+
+        /// @return The batch of a pool in the innermost scope the pool
+        ///         was attached to or nullptr
+        scope_batch* find(const void* pool, const void* type) const
+        {
+            for (const scope_state* s = this; s != nullptr; s = s->m_parent)
+            {
+                scope_batch* batch = s->find_local(pool, type);
+
+                if (batch != nullptr)
+                    return batch;
+            }
+
+            return nullptr;
+        }
+
+        /// Adds the batch of a pool
+        void insert(const void* pool, const void* type,
+                    std::unique_ptr<scope_batch> batch)
+        {
+            assert(find_local(pool, type) == nullptr);
+
+            entry e;
+            e.m_pool = pool;
+            e.m_type = type;
+            e.m_batch = std::move(batch);
+            m_batches.push_back(std::move(e));
+        }
+
+        /// Returns the resources of all batches to their pools
+        void flush()
+        {
+            for (auto& batch : m_batches)
+                batch.m_batch->flush();
+        }
+
+        /// @return The enclosing scope or nullptr
+        scope_state* parent() const
+        {
+            return m_parent;
+        }
+
+    private:
+
+        /// A batch and the pool it belongs to
+        struct entry
+        {
+            const void* m_pool;
+            const void* m_type;
+            std::unique_ptr<scope_batch> m_batch;
+        };
+
+    private:
+
+        /// The enclosing scope
+        scope_state* m_parent;
+
+        /// The batches
+        std::vector<entry> m_batches;
+    };
+
+    /// @return The innermost scope active on the calling thread
+    inline scope_state*& current_scope()
+    {
+        static thread_local scope_state* scope = nullptr;
+        return scope;
+    }
+}
+
+    /// @brief Returns the resources released during a scope in one
+    ///        batch per pool.
+    ///
+    /// While a pool_scope is alive, resources of the pools it was
+    /// attached to which are released on the same thread are kept in
+    /// the scope instead of being pushed into the pool one at a time.
+    /// Allocations from those pools on the same thread reuse the
+    /// resources kept in the scope first without taking the pool lock.
+    /// When the scope ends, or flush() is called, the resources are
+    /// returned to each pool taking its lock once.
+    ///
+    /// Handles may still be released at any time before the scope
+    /// ends. Resources released on other threads bypass the scope. A
+    /// scope keeps at most as many resources of a pool as the capacity
+    /// the pool had when it was attached, once that is reached they
+    /// are returned to the pool early.
+    ///
+    /// A pool_scope is bound to the thread which created it and scopes
+    /// nest, a resource is kept by the innermost scope its pool was
+    /// attached to. Pools using the pool_outlives_objects_policy must
+    /// outlive the scopes they are attached to.
+    ///
+    /// Example:
+    ///
+    ///     {
+    ///         recycle::pool_scope scope;
+    ///
+    ///         auto header = scope.allocate(header_pool);
+    ///         auto payload = scope.allocate(payload_pool);
+    ///         ...
+    ///     } // Returned to header_pool and payload_pool here
+    ///
+    class pool_scope
+    {
+    public:
+
+        /// Create a scope and make it the active scope of the calling
+        /// thread
+        pool_scope() :
+            m_state(detail::current_scope())
+        {
+            detail::current_scope() = &m_state;
+        }
+
+        /// Returns the resources kept to their pools
+        ~pool_scope()
+        {
+            assert(detail::current_scope() == &m_state &&
+                   "Scopes must be destroyed in reverse order on the "
+                   "thread which created them");
+
+            // Resources released while flushing, e.g. by a recycle
+            // function, go to the enclosing scope
+            detail::current_scope() = m_state.parent();
+            m_state.flush();
+        }
+
+        pool_scope(const pool_scope&) = delete;
+        pool_scope& operator=(const pool_scope&) = delete;
+
+        /// Attach a pool to the scope, resources of the pool released
+        /// on this thread are kept in the scope from now on
+        template<class Pool>
+        void attach(Pool& pool)
+        {
+            pool.m_pool->attach(m_state);
+        }
+
+        /// Allocate a resource from a pool attached to the scope
+        /// @param pool The pool, attached if it is not already
+        /// @param args Passed to the pool's allocate(), e.g. a key or
+        ///        a priority
+        template<class Pool, class... Args>
+        auto allocate(Pool& pool, Args&&... args) ->
+            decltype(pool.allocate(std::forward<Args>(args)...))
+        {
+            attach(pool);
+            return pool.allocate(std::forward<Args>(args)...);
+        }
+
+        /// Returns the resources kept so far to their pools
+        void flush()
+        {
+            m_state.flush();
+        }
+
+    private:
+
+        /// The batches of the scope
+        detail::scope_state m_state;
+    };
+}
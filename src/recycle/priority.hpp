@@ -0,0 +1,22 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+namespace recycle
+{
+    /// The priority of an allocation. High priority allocations may
+    /// use the unused resources reserved with
+    /// recycle::resource_pool::set_reserved().
+    enum class priority
+    {
+        /// Regular allocations
+        normal,
+
+        /// Critical allocations, e.g. control-plane requests which
+        /// must not starve during overload
+        high
+    };
+}
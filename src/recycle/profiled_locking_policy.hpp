@@ -0,0 +1,243 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+
+#include "detail/probing_lock.hpp"
+
+namespace recycle
+{
+    /// @brief Histogram of durations with power of two buckets.
+    ///
+    /// Bucket 0 counts durations of zero nanoseconds and bucket i
+    /// counts durations in [2^(i-1), 2^i) nanoseconds. The last bucket
+    /// also counts all longer durations. Recording is lock-free.
+    class lock_histogram
+    {
+    public:
+
+        /// The number of buckets
+        static const std::size_t bucket_count = 40;
+
+    public:
+
+        lock_histogram()
+        {
+            reset();
+        }
+
+        lock_histogram(const lock_histogram&) = delete;
+        lock_histogram& operator=(const lock_histogram&) = delete;
+
+        /// Record a duration
+        void record(std::chrono::nanoseconds duration)
+        {
+            uint64_t ns = duration.count() > 0 ?
+                static_cast<uint64_t>(duration.count()) : 0;
+
+            std::size_t i = 0;
+            while (ns != 0 && i < bucket_count - 1)
+            {
+                ns >>= 1;
+                ++i;
+            }
+
+            m_buckets[i].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /// @return The number of durations recorded in a bucket
+        uint64_t bucket(std::size_t i) const
+        {
+            assert(i < bucket_count);
+            return m_buckets[i].load(std::memory_order_relaxed);
+        }
+
+        /// @return The shortest duration counted in a bucket
+        static std::chrono::nanoseconds bucket_floor(std::size_t i)
+        {
+            assert(i < bucket_count);
+            return std::chrono::nanoseconds(i == 0 ? 0 : uint64_t(1) << (i - 1));
+        }
+
+        /// @return The number of durations recorded
+        uint64_t count() const
+        {
+            uint64_t count = 0;
+            for (std::size_t i = 0; i < bucket_count; ++i)
+                count += bucket(i);
+            return count;
+        }
+
+        /// Clear the histogram
+        void reset()
+        {
+            for (std::size_t i = 0; i < bucket_count; ++i)
+                m_buckets[i].store(0, std::memory_order_relaxed);
+        }
+
+    private:
+
+        /// The counts
+        std::atomic<uint64_t> m_buckets[bucket_count];
+    };
+
+    /// The statistics of a mutex used with the
+    /// recycle::profiled_locking_policy
+    struct lock_statistics
+    {
+        /// The time spent waiting to acquire the mutex
+        lock_histogram m_wait;
+
+        /// The time the mutex was held
+        lock_histogram m_hold;
+
+        /// The number of times the mutex was acquired
+        std::atomic<uint64_t> m_acquisitions{0};
+
+        /// The number of times the mutex was already locked when we
+        /// tried to acquire it
+        std::atomic<uint64_t> m_contended{0};
+
+        /// Clear the statistics
+        void reset()
+        {
+            m_wait.reset();
+            m_hold.reset();
+            m_acquisitions.store(0, std::memory_order_relaxed);
+            m_contended.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    /// @brief Locking policy measuring how the mutex of a pool is used.
+    ///
+    /// Wraps any locking policy with the mutex_type and lock_type
+    /// described in no_locking_policy.hpp and records the time spent
+    /// waiting for and holding the mutex, as well as the number of
+    /// contended acquisitions. This tells whether the throughput of a
+    /// pool is limited by its lock or by the cost of constructing
+    /// resources.
+    ///
+    /// Contention is detected with try_lock() if the inner mutex has
+    /// it, otherwise only the wait time is recorded. If the inner lock
+    /// can adopt a mutex locked with try_lock(), e.g.
+    /// std::lock_guard, the uncontended path locks the mutex once.
+    ///
+    /// Example:
+    ///
+    ///     using policy = recycle::profiled_locking_policy<lock_policy>;
+    ///
+    ///     recycle::resource_pool<heavy_object, policy> pool;
+    ///     ...
+    ///     const recycle::lock_statistics& stats =
+    ///         pool.mutex().statistics();
+    ///
+    template<class Inner>
+    struct profiled_locking_policy
+    {
+        /// The wrapped mutex type
+        using inner_mutex_type = typename Inner::mutex_type;
+
+        /// The wrapped lock type
+        using inner_lock_type = typename Inner::lock_type;
+
+        /// The clock used for the measurements
+        using clock_type = std::chrono::steady_clock;
+
+        class lock_type;
+
+        /// The mutex and its statistics
+        class mutex_type
+        {
+        public:
+
+            mutex_type() = default;
+
+            mutex_type(const mutex_type&) = delete;
+            mutex_type& operator=(const mutex_type&) = delete;
+
+            /// @return The statistics of the mutex
+            const lock_statistics& statistics() const
+            {
+                return m_statistics;
+            }
+
+            /// Clear the statistics
+            void reset_statistics()
+            {
+                m_statistics.reset();
+            }
+
+        private:
+
+            friend class lock_type;
+
+            /// The wrapped mutex
+            inner_mutex_type m_mutex;
+
+            /// The statistics
+            lock_statistics m_statistics;
+        };
+
+        /// The lock measuring the wait and hold times
+        class lock_type
+        {
+        public:
+
+            lock_type(mutex_type& mutex) :
+                m_mutex(mutex),
+                m_start(clock_type::now()),
+                m_lock(mutex.m_mutex),
+                m_acquired(clock_type::now())
+            {
+                lock_statistics& stats = m_mutex.m_statistics;
+                stats.m_wait.record(m_acquired - m_start);
+                stats.m_acquisitions.fetch_add(1, std::memory_order_relaxed);
+
+                if (m_lock.contended())
+                    stats.m_contended.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            ~lock_type()
+            {
+                clock_type::duration hold = clock_type::now() - m_acquired;
+
+                // Release before recording so the bookkeeping is not
+                // part of the critical section
+                m_lock.unlock();
+
+                m_mutex.m_statistics.m_hold.record(hold);
+            }
+
+            lock_type(const lock_type&) = delete;
+            lock_type& operator=(const lock_type&) = delete;
+
+            /// @return true if the mutex was locked when we tried to
+            ///         acquire it
+            bool contended() const
+            {
+                return m_lock.contended();
+            }
+
+        private:
+
+            /// The mutex
+            mutex_type& m_mutex;
+
+            /// When we started acquiring the mutex
+            clock_type::time_point m_start;
+
+            /// The lock of the wrapped mutex
+            detail::probing_lock<inner_mutex_type, inner_lock_type> m_lock;
+
+            /// When the mutex was acquired
+            clock_type::time_point m_acquired;
+        };
+    };
+}
@@ -6,16 +6,36 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
 #include <vector>
 #include <memory>
 #include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <cstdlib> 
 
+#include "allocate_result.hpp"
+#include "cpu_cache.hpp"
+#include "detail/block_storage.hpp"
+#include "detail/probing_lock.hpp"
+#include "detail/release_pages.hpp"
+#include "detail/snapshot_file.hpp"
+#include "leak_on_exit.hpp"
+#include "lifetime_policy.hpp"
 #include "no_locking_policy.hpp"
+#include "pool_scope.hpp"
+#include "priority.hpp"
+#include "trace_recorder.hpp"
 
 namespace recycle
 {
@@ -25,8 +45,15 @@ namespace recycle
     /// expensive to create objects where you would like to create a
     /// factory capable of recycling the objects.
     ///
-    ///
-    template<class Value, class LockingPolicy = no_locking_policy>
+    /// The LockingPolicy makes the pool thread-safe, see
+    /// no_locking_policy.hpp. The LifetimePolicy decides whether the
+    /// allocated objects may outlive the pool, see lifetime_policy.hpp.
+    template
+    <
+        class Value,
+        class LockingPolicy = no_locking_policy,
+        class LifetimePolicy = shared_lifetime_policy
+    >
     class resource_pool
     {
     public:
@@ -39,6 +66,7 @@ namespace recycle
 
         /// The allocate function type
         /// Should take no arguments and return an std::shared_ptr to the Value
+        /// or nullptr if the allocation failed, see try_allocate()
         using allocate_function = std::function<value_ptr()>;
 
         /// The recycle function type
@@ -48,12 +76,63 @@ namespace recycle
         /// used.
         using recycle_function = std::function<void(value_ptr)>;
 
+        /// The footprint function type
+        /// Should return the footprint of a resource, e.g. the
+        /// capacity of a pooled container
+        using footprint_function = std::function<std::size_t(const value_type&)>;
+
+        /// The shrink function type
+        /// Should reduce the footprint of a resource, e.g. by calling
+        /// shrink_to_fit() on a pooled container
+        using shrink_function = std::function<void(value_type&)>;
+
+        /// The memory range function type
+        /// Should return the memory backing a resource, e.g. the data
+        /// of a large buffer
+        using memory_range_function =
+            std::function<std::pair<void*, std::size_t>(value_type&)>;
+
+        /// The key identifying the state of a resource, e.g. a hash of
+        /// the profile a codec is configured for
+        using key_type = std::size_t;
+
+        /// The reconfigure function type
+        /// Called when a resource is allocated for a key different
+        /// from the one it was last used with
+        using reconfigure_function = std::function<void(value_type&, key_type)>;
+
+        /// The tenant type, identifies a user of a shared pool
+        using tenant_type = uint32_t;
+
+        /// The executor type
+        /// Should run the task passed, e.g. on a thread pool
+        using executor_function =
+            std::function<void(std::function<void()>)>;
+
+        /// The serialize function type
+        /// Should append the state of a resource to the buffer
+        using serialize_function =
+            std::function<void(const value_type&, std::vector<uint8_t>&)>;
+
+        /// The deserialize function type
+        /// Should return a resource with the state given by the bytes
+        /// written by the serialize function, or nullptr if the
+        /// resource cannot be restored
+        using deserialize_function =
+            std::function<value_ptr(const uint8_t*, std::size_t)>;
+
         /// The locking policy mutex type
         using mutex_type = typename LockingPolicy::mutex_type;
 
         /// The locking policy lock type
         using lock_type = typename LockingPolicy::lock_type;
 
+        /// The lifetime policy
+        using lifetime_policy = LifetimePolicy;
+
+        /// The default maximum number of unused resources kept in
+        /// the pool. Storage for the unused resources is allocated on
+        /// demand, so the capacity is only an upper limit.
         static const std::size_t DEFAULT_CAPACITY = 10000;
 
     public:
@@ -73,6 +152,11 @@ namespace recycle
         ///
         /// It looks quite ugly and if somebody can fix in a simpler way
         /// please do :)
+        ///
+        /// Pools created with the default constructor construct the
+        /// values themselves. On a miss the value, its control block
+        /// and the control block of the returned std::shared_ptr<T>
+        /// are placed in a single allocation.
         template
         <
             class T = Value,
@@ -80,297 +164,3541 @@ namespace recycle
                 std::is_default_constructible<T>::value, uint8_t>::type = 0
         >
         resource_pool(std::size_t capacity = DEFAULT_CAPACITY) :
-            m_pool(std::make_shared<impl>(
-                       allocate_function(std::make_shared<value_type>), capacity))
+            m_pool(std::make_shared<impl>(capacity))
+        { }
+
+        /// Create a resource pool using a specific allocate function.
+        /// @param allocate Allocation function
+        resource_pool(allocate_function allocate, std::size_t capacity = DEFAULT_CAPACITY) :
+            m_pool(std::make_shared<impl>(std::move(allocate), capacity))
+        { }
+
+        /// Create a resource pool using a specific allocate function and
+        /// recycle function.
+        /// @param allocate Allocation function
+        /// @param recycle Recycle function
+        resource_pool(allocate_function allocate, recycle_function recycle, std::size_t capacity = DEFAULT_CAPACITY) :
+            m_pool(std::make_shared<impl>(std::move(allocate),
+                                          std::move(recycle), capacity))
+        { }
+
+        /// Copy constructor
+        resource_pool(const resource_pool& other) :
+            m_pool(std::make_shared<impl>(*other.m_pool))
         { }
 
-        /// Create a resource pool using a specific allocate function.
-        /// @param allocate Allocation function
-        resource_pool(allocate_function allocate, std::size_t capacity = DEFAULT_CAPACITY) :
-            m_pool(std::make_shared<impl>(std::move(allocate), capacity))
-        { }
+        /// Move constructor
+        resource_pool(resource_pool&& other) :
+            m_pool(std::move(other.m_pool))
+        {
+            assert(m_pool);
+        }
+
+        /// Copy assignment
+        resource_pool& operator=(const resource_pool& other)
+        {
+            resource_pool tmp(other);
+            std::swap(*this, tmp);
+            return *this;
+        }
+
+        /// Move assignment
+        resource_pool& operator=(resource_pool&& other)
+        {
+            m_pool = std::move(other.m_pool);
+            return *this;
+        }
+
+        /// @returns the number of unused resources
+        std::size_t unused_resources() const
+        {
+            assert(m_pool);
+            return m_pool->unused_resources();
+        }
+
+        /// @returns the maximum number of unused resources kept, see
+        ///          also enable_capacity_tuning()
+        std::size_t capacity() const
+        {
+            assert(m_pool);
+            return m_pool->capacity();
+        }
+
+        /// Frees all unused resources
+        void free_unused()
+        {
+            assert(m_pool);
+            m_pool->free_unused();
+        }
+
+        /// Frees all unused resources. The unused resources are
+        /// detached from the pool and destroyed in parallel.
+        ///
+        /// The call only returns before the resources are destroyed if
+        /// a destruction executor is set, see
+        /// set_destruction_executor(). Without one the destruction is
+        /// synchronous: the caller and up to three joined threads
+        /// destroy the resources before the call returns.
+        /// @return A future which is ready when all the resources
+        ///         have been destroyed, always ready without an
+        ///         executor
+        std::future<void> free_unused_async()
+        {
+            assert(m_pool);
+            return m_pool->free_unused_async();
+        }
+
+        /// Destroy the unused resources in parallel in
+        /// free_unused_async() and when the pool is destroyed. This
+        /// helps when destroying the resources is expensive, e.g. for
+        /// large buffers, since the caller does not wait.
+        ///
+        /// The resources left when the pool is destroyed are destroyed
+        /// by the executor after the pool, so the executor must outlive
+        /// the pool. An executor is required for asynchronous
+        /// destruction: without one the unused resources are destroyed
+        /// by the pool's destructor, and free_unused_async() destroys
+        /// them synchronously with up to four threads, including the
+        /// caller, which are joined before it returns.
+        ///
+        /// Must be called before the pool is shared between threads.
+        /// @param executor Runs the destruction tasks
+        /// @param tasks The largest number of tasks the resources are
+        ///        split into
+        void set_destruction_executor(executor_function executor,
+                                      std::size_t tasks = 4)
+        {
+            assert(m_pool);
+            assert(executor);
+            assert(tasks > 0);
+
+            m_pool->set_destruction_executor(std::move(executor), tasks);
+        }
+
+        /// Leak the unused resources and control blocks when the pool
+        /// is destroyed while the process exits, e.g. a static pool,
+        /// since the operating system reclaims the memory anyway. This
+        /// saves the time spent destroying millions of resources on a
+        /// restart. Destroying the pool before the process exits still
+        /// destroys the unused resources. See also
+        /// recycle::set_leak_on_exit() enabling this for all pools.
+        ///
+        /// The exit is detected by a std::atexit() handler registered
+        /// once, when the leak on exit is first enabled for any pool,
+        /// which only runs before the destructors of the static pools
+        /// constructed before that. Static pools constructed later,
+        /// e.g. function-local static pools initialized afterwards, are
+        /// destroyed normally. Call it before the pool is shared
+        /// between threads.
+        /// @param enabled Whether the unused resources are leaked
+        void set_leak_on_exit(bool enabled = true)
+        {
+            assert(m_pool);
+            m_pool->set_leak_on_exit(enabled);
+        }
+
+        /// Write the unused resources to a snapshot file, e.g. before a
+        /// restart, see restore_snapshot(). Resources restored from a
+        /// previous snapshot but not allocated yet are written too.
+        ///
+        /// The unused resources, including those in the per-CPU cache,
+        /// are taken out of the pool while they are serialized and put
+        /// back afterwards, so the pool is not locked during the disk
+        /// I/O. Allocations in the meantime construct new resources.
+        /// The file is written next to the path and renamed into
+        /// place, so the previous snapshot is intact if writing fails.
+        /// @param path The path of the snapshot file
+        /// @param serialize Writes the state of a resource
+        /// @return false if the file could not be written
+        bool save_snapshot(const std::string& path,
+                           const serialize_function& serialize)
+        {
+            assert(m_pool);
+            assert(serialize);
+            return m_pool->save_snapshot(path, serialize);
+        }
+
+        /// Restore the resources of a snapshot file written by
+        /// save_snapshot(). The file is memory-mapped and the resources
+        /// are restored lazily, one on each allocation which misses
+        /// the free list, so a restarted process can serve requests
+        /// right away and only pays for the resources used. The file
+        /// is unmapped when all its resources have been restored.
+        ///
+        /// Restoring replaces the resources not restored yet from a
+        /// previous snapshot. Must be called before the pool is shared
+        /// between threads.
+        /// @param path The path of the snapshot file
+        /// @param deserialize Restores a resource
+        /// @return false if the file is missing or not a snapshot
+        bool restore_snapshot(const std::string& path,
+                              deserialize_function deserialize)
+        {
+            assert(m_pool);
+            assert(deserialize);
+            return m_pool->restore_snapshot(path, std::move(deserialize));
+        }
+
+        /// @return The number of resources of the restored snapshot
+        ///         which have not been allocated yet
+        std::size_t snapshot_resources() const
+        {
+            assert(m_pool);
+            return m_pool->snapshot_resources();
+        }
+
+        /// @return A resource from the pool, or nullptr if the allocate
+        ///         function returned nullptr.
+        value_ptr allocate()
+        {
+            assert(m_pool);
+
+            request r;
+            return m_pool->allocate(r);
+        }
+
+        /// Allocate a resource without relying on exceptions to report
+        /// failures. The allocate function may signal a failure by
+        /// returning nullptr.
+        /// @return The resource or the reason the allocation failed
+        allocate_result<value_ptr> try_allocate()
+        {
+            return make_result(allocate());
+        }
+
+        /// @copydoc try_allocate()
+        /// @param key The state requested, see allocate(key_type)
+        allocate_result<value_ptr> try_allocate(key_type key)
+        {
+            return make_result(allocate(key));
+        }
+
+        /// @return An unused resource from the pool or nullptr if there
+        ///         are no unused resources. No resource is constructed.
+        value_ptr allocate_unused()
+        {
+            assert(m_pool);
+
+            request r;
+            r.m_construct = false;
+            return m_pool->allocate(r);
+        }
+
+        /// Hand out a resource constructed outside the pool, e.g. by
+        /// an asynchronous factory. The resource is recycled into the
+        /// pool when released, like any resource allocated from it.
+        /// @param resource The resource
+        /// @return The resource managed by the pool
+        value_ptr adopt(value_ptr resource)
+        {
+            assert(m_pool);
+            assert(resource);
+
+            request r;
+            r.m_adopt = std::move(resource);
+            return m_pool->allocate(r);
+        }
+
+        /// Allocate a resource in a specific state. An unused resource
+        /// last used with the same key is preferred. Otherwise any
+        /// unused resource, or a new one, is passed to the
+        /// reconfigure function before it is returned.
+        ///
+        /// The lookup is O(1) through an index of the unused resources
+        /// by key. Resources cached per CPU are not indexed.
+        ///
+        /// @param key The state requested
+        /// @return A resource from the pool.
+        value_ptr allocate(key_type key)
+        {
+            assert(m_pool);
+
+            request r;
+            r.m_key = &key;
+            return m_pool->allocate(r);
+        }
+
+        /// Allocate a resource with a priority. High priority
+        /// allocations may use the unused resources reserved with
+        /// set_reserved(), normal allocations construct a new resource
+        /// when only reserved ones are left.
+        /// @param p The priority of the allocation
+        /// @return A resource from the pool.
+        value_ptr allocate(priority p)
+        {
+            assert(m_pool);
+
+            request r;
+            r.m_priority = p;
+            return m_pool->allocate(r);
+        }
+
+        /// Reserve unused resources for high priority allocations. The
+        /// last unused resources in the free list are only handed out
+        /// to allocate(priority::high). Resources cached per CPU are
+        /// not reserved.
+        ///
+        /// Must be called before the pool is shared between threads.
+        /// @param reserved The number of unused resources reserved
+        void set_reserved(std::size_t reserved)
+        {
+            assert(m_pool);
+            m_pool->set_reserved(reserved);
+        }
+
+        /// A decision of the capacity tuning
+        struct capacity_decision
+        {
+            /// The number of the window, counting from zero
+            uint64_t m_window = 0;
+
+            /// The capacity before the decision
+            std::size_t m_old_capacity = 0;
+
+            /// The capacity after the decision
+            std::size_t m_new_capacity = 0;
+
+            /// The allocations which missed the free list
+            uint64_t m_misses = 0;
+
+            /// The resources dropped since the pool was full
+            uint64_t m_drops = 0;
+
+            /// The smallest number of unused resources in the window,
+            /// i.e. the resources which were never needed
+            std::size_t m_idle = 0;
+        };
+
+        /// The number of decisions kept by the capacity tuning
+        static const std::size_t max_decisions = 64;
+
+        /// Adjust the capacity to the workload. At the end of every
+        /// window of allocations the capacity is
+        ///
+        ///   - grown if resources were dropped because the pool was
+        ///     full and new resources were later constructed on a miss,
+        ///
+        ///   - shrunk if some unused resources were never needed
+        ///     during the window.
+        ///
+        /// The capacity stays within the given bounds. Only
+        /// allocations taking the pool mutex are counted, i.e. not
+        /// the ones served by the per-CPU cache.
+        ///
+        /// Must be called before the pool is shared between threads.
+        /// @param min_capacity The smallest capacity
+        /// @param max_capacity The largest capacity
+        /// @param window The number of allocations between decisions
+        void enable_capacity_tuning(std::size_t min_capacity,
+                                    std::size_t max_capacity,
+                                    uint32_t window = 1024)
+        {
+            assert(m_pool);
+            m_pool->enable_capacity_tuning(min_capacity, max_capacity, window);
+        }
+
+        /// @return The most recent decisions of the capacity tuning,
+        ///         the oldest first. At most max_decisions are kept.
+        std::vector<capacity_decision> capacity_decisions() const
+        {
+            assert(m_pool);
+            return m_pool->capacity_decisions();
+        }
+
+        /// Record the allocations and releases of the pool, e.g. to
+        /// replay them offline against other pool configurations with
+        /// the recycle_replay program. Copies of the pool do not
+        /// record.
+        ///
+        /// Must be called before the pool is shared between threads.
+        /// @param recorder The recorder, nullptr to stop recording
+        void set_trace_recorder(std::shared_ptr<trace_recorder> recorder)
+        {
+            assert(m_pool);
+            m_pool->set_trace_recorder(std::move(recorder));
+        }
+
+        /// Link the pool to a parent pool of the same value type, e.g.
+        /// an unsynchronized pool per worker thread to a locked pool
+        /// shared by the process.
+        ///
+        /// On a miss the pool takes up to batch unused resources from
+        /// the parent taking the parent's lock once, keeping the ones
+        /// it does not need. If the parent has no unused resources it
+        /// allocates one, asking its own parent first, so the pool
+        /// never constructs resources itself. Releases beyond the
+        /// capacity move the released resource and unused ones, up to
+        /// batch in total, back to the parent. When the pool is
+        /// destroyed its unused resources go to the parent. The number
+        /// of reuses and keys of a resource are not transferred.
+        ///
+        /// The pool keeps the parent alive. Copies of the pool use the
+        /// same parent. Must be called before the pool is shared
+        /// between threads.
+        /// @param parent The parent pool
+        /// @param batch The largest number of resources moved between
+        ///        the pools at once
+        template<class ParentLockingPolicy, class ParentLifetimePolicy>
+        void set_parent(resource_pool<value_type, ParentLockingPolicy,
+                                      ParentLifetimePolicy>& parent,
+                        std::size_t batch = 8)
+        {
+            assert(m_pool);
+            assert(parent.m_pool);
+            assert(batch > 0);
+
+            auto parent_pool = parent.m_pool;
+
+            std::unique_ptr<parent_link> link(new parent_link());
+
+            link->m_take = [parent_pool](std::size_t count, bool construct,
+                                         std::vector<value_ptr>& resources)
+            {
+                return parent_pool->give_to_child(count, construct,
+                                                  resources);
+            };
+
+            link->m_give = [parent_pool](std::vector<value_ptr>& resources)
+            {
+                parent_pool->take_from_child(resources);
+            };
+
+            link->m_batch = batch;
+
+            m_pool->set_parent(std::move(link));
+        }
+
+        /// Limit the resources used by a tenant of a shared pool.
+        ///
+        /// A tenant may have at most max_outstanding resources
+        /// allocated with try_allocate_for() at a time. Allocations
+        /// beyond the limit wait for at most the given time for one of
+        /// the tenant's resources to be released, and are rejected
+        /// otherwise. At most max_retained unused resources released
+        /// by the tenant are kept in the pool, so a single tenant
+        /// cannot fill the pool with its resources.
+        ///
+        /// The free list is shared fairly by the tenants with a quota:
+        /// each keeps at most its share of the capacity, i.e. the
+        /// capacity divided by the number of tenants with a quota,
+        /// also if its max_retained is larger.
+        ///
+        /// Must be called before the pool is shared between threads.
+        /// @param tenant The tenant
+        /// @param max_outstanding The maximum number of allocated
+        ///        resources
+        /// @param max_retained The maximum number of unused resources
+        ///        kept
+        /// @param wait The maximum time to wait for a resource to be
+        ///        released
+        void set_tenant_quota(
+            tenant_type tenant, std::size_t max_outstanding,
+            std::size_t max_retained,
+            std::chrono::microseconds wait = std::chrono::microseconds(0))
+        {
+            assert(m_pool);
+            m_pool->set_tenant_quota(tenant, max_outstanding, max_retained,
+                                     wait);
+        }
+
+        /// Allocate a resource on behalf of a tenant. Tenants without a
+        /// quota are not limited or tracked.
+        /// @param tenant The tenant
+        /// @return The resource or the reason the allocation failed,
+        ///         allocate_error::quota_exceeded if the tenant has too
+        ///         many resources allocated
+        allocate_result<value_ptr> try_allocate_for(tenant_type tenant)
+        {
+            assert(m_pool);
+
+            request r;
+            r.m_tenant = m_pool->find_tenant(tenant);
+
+            value_ptr resource = m_pool->allocate(r);
+
+            if (r.m_error != allocate_error::none)
+                return allocate_result<value_ptr>(r.m_error);
+
+            return make_result(std::move(resource));
+        }
+
+        /// The usage of the pool by a tenant
+        struct tenant_statistics
+        {
+            /// The number of resources allocated
+            std::size_t m_outstanding = 0;
+
+            /// The number of unused resources released by the tenant
+            /// kept in the pool
+            std::size_t m_retained = 0;
+
+            /// The number of successful allocations
+            uint64_t m_allocations = 0;
+
+            /// The number of allocations rejected by the quota
+            uint64_t m_rejections = 0;
+
+            /// The number of allocations which waited for the quota
+            uint64_t m_waits = 0;
+        };
+
+        /// @return The usage of the pool by a tenant, all zeros if the
+        ///         tenant has no quota
+        tenant_statistics tenant_stats(tenant_type tenant) const
+        {
+            assert(m_pool);
+            return m_pool->tenant_stats(tenant);
+        }
+
+        /// Limit the number of resources constructed concurrently.
+        ///
+        /// When a burst of allocations hits an empty pool, every caller
+        /// would otherwise construct a resource, overshooting the
+        /// working set only to drop the excess when it is recycled.
+        /// With a limit, callers missing the pool while the maximum
+        /// number of constructions are in flight wait for a resource
+        /// to be recycled or a construction to finish. After waiting
+        /// for the given time they construct a resource anyway.
+        ///
+        /// Must be called before the pool is shared between threads.
+        /// @param max_constructions The maximum number of concurrent
+        ///        constructions, zero for no limit
+        /// @param wait The maximum time a caller waits
+        void set_max_constructions(std::size_t max_constructions,
+                                   std::chrono::microseconds wait)
+        {
+            assert(m_pool);
+            m_pool->set_max_constructions(max_constructions, wait);
+        }
+
+        /// Set the function called when a resource is allocated for a
+        /// different key than it was last used with.
+        ///
+        /// Must be called before the pool is shared between threads.
+        /// @param reconfigure The reconfigure function
+        void set_reconfigure_function(reconfigure_function reconfigure)
+        {
+            assert(m_pool);
+            m_pool->set_reconfigure_function(std::move(reconfigure));
+        }
+
+        /// Enables per-CPU caching of unused resources and control
+        /// blocks. Resources released on a CPU are kept in a small
+        /// per-CPU stack and handed out again to threads running on
+        /// the same CPU without taking the pool's lock, with
+        /// restartable sequences where available, see
+        /// recycle::cpu_cache. The memory cached is bounded by the
+        /// number of CPUs, not the number of threads using the pool.
+        ///
+        /// The per-CPU stacks are in addition to the pool's capacity
+        /// and the per-CPU capacity is fixed the first time the cache
+        /// is enabled.
+        ///
+        /// @param per_cpu_capacity The maximum number of unused
+        ///        resources kept per CPU
+        void enable_cpu_cache(std::size_t per_cpu_capacity)
+        {
+            assert(m_pool);
+            m_pool->enable_cpu_cache(per_cpu_capacity);
+        }
+
+        /// Enable the per-CPU cache only while the pool is contended.
+        ///
+        /// The pool starts out with the single free list. When the
+        /// fraction of contended acquisitions of the pool mutex, over
+        /// a window of acquisitions, reaches the given threshold the
+        /// per-CPU cache is enabled. A window without any contention
+        /// never enables it. While the cache is enabled the mutex is
+        /// still probed every few operations served by the cache on
+        /// each CPU. Once no window has reached the threshold for the
+        /// cool-down the cache is disabled again and its resources are
+        /// moved back to the free list.
+        ///
+        /// Contention is detected with the try_lock() member function
+        /// of the mutex, or reported by the lock itself as with the
+        /// recycle::profiled_locking_policy, so the cache is never
+        /// enabled for other mutex types.
+        ///
+        /// Must be called before the pool is shared between threads.
+        /// @param per_cpu_capacity The maximum number of resources
+        ///        cached per CPU
+        /// @param threshold The fraction of contended acquisitions
+        ///        enabling the cache
+        /// @param window The number of acquisitions between decisions
+        /// @param cooldown The time the cache stays enabled after the
+        ///        last contended window
+        void enable_adaptive_cpu_cache(
+            std::size_t per_cpu_capacity, double threshold = 0.05,
+            uint32_t window = 1024,
+            std::chrono::milliseconds cooldown = std::chrono::milliseconds(100))
+        {
+            assert(m_pool);
+            m_pool->enable_adaptive_cpu_cache(
+                per_cpu_capacity, threshold, window, cooldown);
+        }
+
+        /// @return true if the per-CPU cache is enabled
+        bool cpu_cache_enabled() const
+        {
+            assert(m_pool);
+            return m_pool->cpu_cache_enabled();
+        }
+
+        /// @return The mutex of the pool, e.g. to read the statistics
+        ///         of the recycle::profiled_locking_policy
+        const mutex_type& mutex() const
+        {
+            assert(m_pool);
+            return m_pool->mutex();
+        }
+
+        /// Retire resources after they have been reused a number of
+        /// times. A retired resource is destroyed instead of being
+        /// recycled into the pool.
+        ///
+        /// Must be called before the pool is shared between threads.
+        /// @param max_reuses The number of reuses, zero to never
+        ///        retire resources
+        void set_max_reuses(uint32_t max_reuses)
+        {
+            assert(m_pool);
+            m_pool->set_max_reuses(max_reuses);
+        }
+
+        /// Guard against resources that grew too large, e.g. a pooled
+        /// buffer that once held a giant message. When a resource is
+        /// recycled with a footprint above the limit it is shrunk, if a
+        /// shrink function is given, and destroyed if the footprint is
+        /// still above the limit.
+        ///
+        /// Must be called before the pool is shared between threads.
+        /// @param footprint Returns the footprint of a resource
+        /// @param max_footprint The largest footprint kept in the pool
+        /// @param shrink Optional function reducing the footprint
+        void set_footprint_limit(footprint_function footprint,
+                                 std::size_t max_footprint,
+                                 shrink_function shrink = shrink_function())
+        {
+            assert(m_pool);
+            assert(footprint);
+
+            m_pool->set_footprint_limit(std::move(footprint), max_footprint,
+                                        std::move(shrink));
+        }
+
+        /// Release the memory of idle resources to the operating system
+        /// while keeping the resources, e.g. for multi-megabyte
+        /// buffers. When more than watermark resources are unused, the
+        /// pages of the ones used least recently are released with
+        /// madvise(). The resources stay in the pool and their pages
+        /// are faulted in again when they are reused, which is cheaper
+        /// than destroying and allocating them.
+        ///
+        /// The content of the released memory is lost, e.g. a pooled
+        /// buffer reads as zeros or stale data, while the rest of the
+        /// resource is unchanged. Only the pages fully inside the range
+        /// are released. The memory is released while holding the
+        /// lock, since another thread may reuse the resource. Does
+        /// nothing on platforms without madvise().
+        ///
+        /// Must be called before the pool is shared between threads.
+        /// @param watermark The number of unused resources kept intact
+        /// @param range Returns the memory of a resource
+        void set_soft_trim(std::size_t watermark, memory_range_function range)
+        {
+            assert(m_pool);
+            assert(range);
+            m_pool->set_soft_trim(watermark, std::move(range));
+        }
+
+        /// Release the memory of all unused resources beyond the
+        /// watermark, e.g. when the system is low on memory. Resources
+        /// are also released as they become idle, see set_soft_trim().
+        void trim_unused()
+        {
+            assert(m_pool);
+            m_pool->trim_unused();
+        }
+
+        /// @return The number of unused resources whose memory has been
+        ///         released
+        std::size_t trimmed_resources() const
+        {
+            assert(m_pool);
+            return m_pool->trimmed_resources();
+        }
+
+    private:
+
+        /// @return The result of an allocation which constructs on a
+        ///         miss, i.e. failed only if the allocate function failed
+        static allocate_result<value_ptr> make_result(value_ptr resource)
+        {
+            if (!resource)
+                return allocate_result<value_ptr>(allocate_error::allocate_failed);
+
+            return allocate_result<value_ptr>(std::move(resource));
+        }
+
+        /// The link of a pool to its parent, see set_parent()
+        struct parent_link
+        {
+            /// Takes up to a number of unused resources from the
+            /// parent, or constructs one if it has none and
+            /// construction is allowed
+            /// @return true if the resources were unused
+            std::function<bool(std::size_t, bool,
+                               std::vector<value_ptr>&)> m_take;
+
+            /// Gives resources to the parent
+            std::function<void(std::vector<value_ptr>&)> m_give;
+
+            /// The largest number of resources moved at once
+            std::size_t m_batch = 1;
+        };
+
+        /// The quota and usage of a tenant
+        struct tenant_state
+        {
+            /// The maximum number of allocated resources
+            std::size_t m_max_outstanding = 0;
+
+            /// The maximum number of unused resources kept
+            std::size_t m_max_retained = 0;
+
+            /// The maximum time to wait for a resource to be released
+            std::chrono::microseconds m_wait{0};
+
+            std::atomic<std::size_t> m_outstanding{0};
+            std::atomic<std::size_t> m_retained{0};
+            std::atomic<uint64_t> m_allocations{0};
+            std::atomic<uint64_t> m_rejections{0};
+            std::atomic<uint64_t> m_waits{0};
+        };
+
+        /// The parameters of an allocation
+        struct request
+        {
+            /// The state requested or nullptr for any state
+            const key_type* m_key = nullptr;
+
+            /// Whether a resource is constructed on a miss
+            bool m_construct = true;
+
+            /// The priority, decides whether reserved resources are used
+            priority m_priority = priority::normal;
+
+            /// A resource constructed outside the pool, handed out
+            /// instead of one from the free list
+            value_ptr m_adopt;
+
+            /// The tenant allocating, if it has a quota
+            tenant_state* m_tenant = nullptr;
+
+            /// Set to the reason the allocation failed
+            allocate_error m_error = allocate_error::none;
+
+            /// Set if an unused resource was handed out
+            bool m_hit = false;
+        };
+
+        /// An unused resource and its bookkeeping
+        struct entry
+        {
+            entry(value_ptr resource = value_ptr(), uint32_t reuses = 0) :
+                m_resource(std::move(resource)),
+                m_reuses(reuses)
+            { }
+
+            /// The resource
+            value_ptr m_resource;
+
+            /// The number of times the resource has been reused
+            uint32_t m_reuses;
+
+            /// Whether the resource has been allocated with a key
+            bool m_has_key = false;
+
+            /// The key the resource was last allocated with
+            key_type m_key = 0;
+
+            /// The position in the key index, only valid while the
+            /// resource is in the free list
+            std::size_t m_key_slot = 0;
+
+            /// The tenant the resource was allocated by, if it has a
+            /// quota
+            tenant_state* m_tenant = nullptr;
+
+            /// Whether the resource counts towards the tenant's
+            /// retained resources
+            bool m_retained = false;
+
+            /// Whether the memory of the resource has been released,
+            /// only valid while the resource is in the free list
+            bool m_trimmed = false;
+        };
+
+        /// The actual pool implementation. We use the
+        /// enable_shared_from_this helper to make sure we can pass a
+        /// "back-pointer" to the pooled objects. The idea behind this
+        /// is that we need objects to be able to add themselves back
+        /// into the pool once they go out of scope.
+        struct impl : public std::enable_shared_from_this<impl>
+        {
+            /// @copydoc resource_pool::resource_pool(std::size_t)
+            impl(std::size_t capacity) :
+                m_capacity(capacity)
+            { }
+
+            /// @copydoc resource_pool::resource_pool(allocate_function)
+            impl(allocate_function allocate, std::size_t capacity) :
+                m_allocate(std::move(allocate)),
+                m_capacity(capacity)
+            {
+                assert(m_allocate);
+            }
+
+            /// @copydoc resource_pool::resource_pool(allocate_function,
+            ///                                       recycle_function)
+            impl(allocate_function allocate, recycle_function recycle, std::size_t capacity) :
+                m_allocate(std::move(allocate)),
+                m_recycle(std::move(recycle)),
+                m_capacity(capacity)
+            {
+                assert(m_allocate);
+                assert(m_recycle);
+            }
+
+            /// Copy constructor
+            impl(const impl& other) :
+                std::enable_shared_from_this<impl>(other),
+                m_allocate(other.m_allocate),
+                m_recycle(other.m_recycle),
+                m_max_reuses(other.m_max_reuses),
+                m_capacity(other.m_capacity)
+            {
+                const extras& config = other.get_extras();
+
+                if (other.find_extras() != nullptr)
+                {
+                    extras& mine = make_extras();
+                    mine.m_footprint = config.m_footprint;
+                    mine.m_max_footprint = config.m_max_footprint;
+                    mine.m_shrink = config.m_shrink;
+                    mine.m_reconfigure = config.m_reconfigure;
+                    mine.m_reserved = config.m_reserved;
+                }
+
+                std::size_t size = other.unused_resources();
+                m_free_vector.reserve(size);
+                for (std::size_t i = 0; i < size; ++i)
+                {
+                    value_ptr resource = construct(nullptr);
+
+                    if (!resource)
+                        break;
+
+                    m_free_vector.push_back(std::move(resource));
+                }
+
+                if (config.m_adaptive)
+                {
+                    enable_adaptive_cpu_cache(
+                        config.m_cpu_resources->per_cpu_capacity(),
+                        config.m_adaptive->m_threshold,
+                        config.m_adaptive->m_window,
+                        config.m_adaptive->m_cooldown);
+                }
+                else if (other.cpu_cache_enabled())
+                {
+                    enable_cpu_cache(config.m_cpu_resources->per_cpu_capacity());
+                }
+
+                if (config.m_throttle)
+                {
+                    set_max_constructions(config.m_throttle->m_max_constructions,
+                                          config.m_throttle->m_wait);
+                }
+
+                if (config.m_tuning)
+                {
+                    enable_capacity_tuning(config.m_tuning->m_min_capacity,
+                                           config.m_tuning->m_max_capacity,
+                                           config.m_tuning->m_window);
+                }
+
+                if (config.m_tenants)
+                {
+                    for (const auto& tenant : config.m_tenants->m_states)
+                    {
+                        set_tenant_quota(tenant.first,
+                                         tenant.second->m_max_outstanding,
+                                         tenant.second->m_max_retained,
+                                         tenant.second->m_wait);
+                    }
+                }
+
+                if (config.m_parent)
+                {
+                    set_parent(std::unique_ptr<parent_link>(
+                        new parent_link(*config.m_parent)));
+                }
+
+                if (config.m_destruction)
+                {
+                    set_destruction_executor(config.m_destruction->m_executor,
+                                             config.m_destruction->m_tasks);
+                }
+
+                if (other.m_leak_on_exit)
+                {
+                    set_leak_on_exit(true);
+                }
+
+                if (config.m_soft_trim)
+                {
+                    set_soft_trim(config.m_soft_trim->m_watermark,
+                                  config.m_soft_trim->m_range);
+                }
+            }
+
+            /// Move constructor
+            impl(impl&& other) :
+                std::enable_shared_from_this<impl>(other),
+                m_allocate(std::move(other.m_allocate)),
+                m_recycle(std::move(other.m_recycle)),
+                m_max_reuses(other.m_max_reuses),
+                m_leak_on_exit(other.m_leak_on_exit),
+                m_capacity(other.m_capacity),
+                m_free_vector(std::move(other.m_free_vector)),
+                m_free_blocks(other.m_free_blocks),
+                m_free_block_count(other.m_free_block_count),
+                m_cpu_cache_enabled(other.m_cpu_cache_enabled.load()),
+                m_extras(other.m_extras.exchange(nullptr))
+            {
+                other.m_free_blocks = nullptr;
+                other.m_free_block_count = 0;
+                other.m_cpu_cache_enabled = false;
+            }
+
+            ~impl()
+            {
+                // With the pool_outlives_objects_policy the objects
+                // hold raw pointers to the pool, so they must all be
+                // released before the pool dies.
+                assert(!lifetime_policy::pool_outlives_objects ||
+                       outstanding() == 0);
+
+                if ((m_leak_on_exit ||
+                     detail::global_leak_on_exit().load(
+                         std::memory_order_relaxed)) &&
+                    process_exiting())
+                {
+                    leak();
+                    delete m_extras.load();
+                    return;
+                }
+
+                const extras& state = get_extras();
+
+                // The unused resources go back to the parent, e.g. when
+                // the pool of a worker thread is destroyed
+                if (state.m_parent && !m_free_vector.empty())
+                {
+                    std::vector<value_ptr> resources;
+                    for (entry& resource : m_free_vector)
+                    {
+                        forget(resource);
+                        resources.push_back(std::move(resource.m_resource));
+                    }
+
+                    state.m_parent->m_give(resources);
+                }
+
+                // Destroying many expensive resources should not delay
+                // the caller, e.g. when draining a process
+                if (state.m_destruction)
+                {
+                    std::vector<entry> resources;
+                    detach_unused(resources);
+                    destroy_async(std::move(resources));
+                }
+
+                m_free_vector.clear();
+                free_blocks();
+                delete m_extras.load();
+            }
+
+            /// Copy assignment
+            impl& operator=(const impl& other)
+            {
+                impl tmp(other);
+                std::swap(*this, tmp);
+                return *this;
+            }
+
+            /// Move assignment
+            impl& operator=(impl&& other)
+            {
+                free_blocks();
+
+                m_allocate = std::move(other.m_allocate);
+                m_recycle = std::move(other.m_recycle);
+                m_max_reuses = other.m_max_reuses;
+                m_capacity = other.m_capacity;
+                m_free_vector = std::move(other.m_free_vector);
+                m_leak_on_exit = other.m_leak_on_exit;
+                m_free_blocks = other.m_free_blocks;
+                m_free_block_count = other.m_free_block_count;
+                m_cpu_cache_enabled = other.m_cpu_cache_enabled.load();
+                delete m_extras.exchange(other.m_extras.exchange(nullptr));
+
+                other.m_free_blocks = nullptr;
+                other.m_free_block_count = 0;
+                other.m_cpu_cache_enabled = false;
+                return *this;
+            }
+
+            /// Allocate a new value from the pool
+            /// @param r The parameters of the allocation
+            value_ptr allocate(request& r)
+            {
+                entry resource;
+                control_block* block = nullptr;
+
+                // The cached control block is handed back if the
+                // allocate or reconfigure function throws
+                block_guard guard(*this, block);
+
+                const key_type* key = r.m_key;
+
+                if (r.m_tenant != nullptr && !admit(*r.m_tenant))
+                {
+                    r.m_error = allocate_error::quota_exceeded;
+                    return value_ptr();
+                }
+
+                // The admission is released if no resource is handed
+                // out, also if the allocate function throws
+                admission admitted(*this, r.m_tenant);
+
+                if (r.m_adopt)
+                {
+                    resource.m_resource = std::move(r.m_adopt);
+                    block = take_block();
+                }
+                else if (!take_or_construct(r, resource, block))
+                {
+                    return value_ptr();
+                }
+
+                forget(resource);
+                resource.m_tenant = r.m_tenant;
+
+                if (r.m_tenant != nullptr)
+                {
+                    r.m_tenant->m_allocations.fetch_add(
+                        1, std::memory_order_relaxed);
+                }
+
+                if (key != nullptr)
+                {
+                    const reconfigure_function& reconfigure =
+                        get_extras().m_reconfigure;
+
+                    if (reconfigure &&
+                        !(resource.m_has_key && resource.m_key == *key))
+                    {
+                        reconfigure(*resource.m_resource, *key);
+                    }
+
+                    resource.m_has_key = true;
+                    resource.m_key = *key;
+                }
+
+                pool_pointer pool = lifetime_policy::make_pointer(*this);
+
+                // Here we create a std::shared_ptr<T> with a naked
+                // pointer to the resource and a custom deleter
+                // object. The custom deleter object stores two
+                // things:
+                //
+                //   1. A std::weak_ptr<T> to the pool (used when we
+                //      need to put the resource back in the pool). If
+                //      the pool dies before the resource then we can
+                //      detect this with the weak_ptr and no try to
+                //      access it.
+                //
+                //   2. A std::shared_ptr<T> that points to the actual
+                //      resource and is the one actually keeping it alive.
+                //
+                // The allocator hands the cached control block (if
+                // any) to the std::shared_ptr<T>. The allocator's
+                // value_type doesn't matter, will rebind it
+                // anyway. (See: shared_ptr_base.h : 468)
+                //
+                // With the pool_outlives_objects_policy the deleter
+                // and allocator store a raw pointer instead of the
+                // std::weak_ptr<T>.
+                value_type* naked = resource.m_resource.get();
+                trace(r.m_hit ? trace_event_type::hit : trace_event_type::miss,
+                      naked);
+
+                // From here the deleter releases the block and the
+                // admission
+                guard.dismiss();
+                admitted.dismiss();
+                value_ptr result(naked, deleter(pool, std::move(resource)),
+                                 SimpleAllocator<void>(block, pool));
+                count_outstanding(1);
+                return result;
+            }
+
+            /// @copydoc resource_pool::free_unused()
+            void free_unused()
+            {
+                // The resources are destroyed without holding the lock
+                std::vector<entry> resources;
+
+                lock_type lock(m_mutex);
+                detach_unused(resources);
+            }
+
+            /// @copydoc resource_pool::free_unused_async()
+            std::future<void> free_unused_async()
+            {
+                std::vector<entry> resources;
+                {
+                    lock_type lock(m_mutex);
+                    detach_unused(resources);
+                }
+
+                return destroy_async(std::move(resources));
+            }
+
+            /// @copydoc resource_pool::set_leak_on_exit()
+            void set_leak_on_exit(bool enabled)
+            {
+                if (enabled)
+                    detail::register_exit_handler();
+
+                m_leak_on_exit = enabled;
+            }
+
+            /// @copydoc resource_pool::save_snapshot()
+            bool save_snapshot(const std::string& path,
+                               const serialize_function& serialize)
+            {
+                detail::snapshot_writer writer;
+                if (!writer.open(path))
+                    return false;
+
+                // The resources are put back also if serialize throws
+                saved_resources saved(*this);
+
+                std::vector<uint8_t> buffer;
+
+                for (const entry& resource : saved.m_resources)
+                {
+                    buffer.clear();
+                    serialize(*resource.m_resource, buffer);
+                    writer.add(buffer.data(), buffer.size());
+                }
+
+                // The records not restored yet are copied as they are
+                if (saved.m_snapshot)
+                {
+                    saved.m_snapshot->m_reader.visit_remaining(
+                        [&writer](const uint8_t* data, std::size_t size)
+                        { writer.add(data, size); });
+                }
+
+                return writer.commit();
+            }
+
+            /// @copydoc resource_pool::restore_snapshot()
+            bool restore_snapshot(const std::string& path,
+                                  deserialize_function deserialize)
+            {
+                std::shared_ptr<snapshot> restored(new snapshot());
+                if (!restored->m_reader.open(path))
+                    return false;
+
+                restored->m_deserialize = std::move(deserialize);
+
+                extras& state = make_extras();
+
+                lock_type lock(m_mutex);
+                state.m_snapshot = restored->m_reader.remaining() > 0 ?
+                    std::move(restored) : nullptr;
+
+                return true;
+            }
+
+            /// @copydoc resource_pool::snapshot_resources()
+            std::size_t snapshot_resources() const
+            {
+                lock_type lock(m_mutex);
+                const extras& state = get_extras();
+
+                return state.m_snapshot ?
+                    static_cast<std::size_t>(state.m_snapshot->m_reader.remaining()) :
+                    0;
+            }
+
+            /// @copydoc resource_pool::set_destruction_executor()
+            void set_destruction_executor(executor_function executor,
+                                          std::size_t tasks)
+            {
+                extras& state = make_extras();
+                state.m_destruction.reset(new destruction());
+                state.m_destruction->m_executor = std::move(executor);
+                state.m_destruction->m_tasks = tasks;
+            }
+
+            /// @copydoc resource_pool::unused_resources()
+            std::size_t unused_resources() const
+            {
+                lock_type lock(m_mutex);
+                std::size_t size = m_free_vector.size();
+                const extras& state = get_extras();
+
+                if (state.m_cpu_resources)
+                    size += state.m_cpu_resources->size();
+
+                return size;
+            }
+
+            /// @copydoc resource_pool::enable_cpu_cache()
+            void enable_cpu_cache(std::size_t per_cpu_capacity)
+            {
+                extras& state = make_extras();
+
+                lock_type lock(m_mutex);
+
+                // The caches are never destroyed before the pool, so
+                // a thread which observes the enabled flag can
+                // always use them.
+                if (!state.m_cpu_resources)
+                {
+                    state.m_cpu_resources.reset(
+                        new cpu_cache<entry>(per_cpu_capacity));
+                    state.m_cpu_blocks.reset(
+                        new cpu_cache<control_block*>(per_cpu_capacity));
+                }
+
+                m_cpu_cache_enabled.store(true, std::memory_order_release);
+            }
+
+            /// @copydoc resource_pool::enable_adaptive_cpu_cache()
+            void enable_adaptive_cpu_cache(
+                std::size_t per_cpu_capacity, double threshold,
+                uint32_t window, std::chrono::milliseconds cooldown)
+            {
+                assert(per_cpu_capacity > 0);
+                assert(window > 0);
+
+                extras& state = make_extras();
+                state.m_adaptive.reset(new adaptive());
+                state.m_adaptive->m_threshold = threshold;
+                state.m_adaptive->m_window = window;
+                state.m_adaptive->m_cooldown = cooldown;
+                state.m_adaptive->m_cpus = cpu_count();
+                state.m_adaptive->m_ticks.reset(
+                    new typename adaptive::tick[state.m_adaptive->m_cpus]);
+
+                lock_type lock(m_mutex);
+
+                if (!state.m_cpu_resources)
+                {
+                    state.m_cpu_resources.reset(
+                        new cpu_cache<entry>(per_cpu_capacity));
+                    state.m_cpu_blocks.reset(
+                        new cpu_cache<control_block*>(per_cpu_capacity));
+                }
+            }
+
+            /// @return The number of objects allocated which have
+            ///         not yet released their control block. Only
+            ///         tracked with the pool_outlives_objects_policy in
+            ///         debug builds.
+            std::size_t outstanding() const
+            {
+                return m_outstanding.load(std::memory_order_relaxed);
+            }
+
+            /// Counts the objects allocated or released, see
+            /// outstanding()
+            /// @param delta 1 for an allocated object, -1 for a
+            ///        released one
+            void count_outstanding(int delta)
+            {
+#ifndef NDEBUG
+                if (lifetime_policy::pool_outlives_objects)
+                {
+                    m_outstanding.fetch_add(static_cast<std::size_t>(delta),
+                                            std::memory_order_relaxed);
+                }
+#else
+                (void) delta;
+#endif
+            }
+
+            /// @copydoc resource_pool::cpu_cache_enabled()
+            bool cpu_cache_enabled() const
+            {
+                return m_cpu_cache_enabled.load(std::memory_order_acquire);
+            }
+
+            /// @copydoc resource_pool::capacity()
+            std::size_t capacity() const
+            {
+                lock_type lock(m_mutex);
+                return m_capacity;
+            }
+
+            /// This function called when a resource should be added
+            /// back into the pool
+            void recycle(entry resource)
+            {
+                const void* object = resource.m_resource.get();
+
+                if (!prepare(resource))
+                {
+                    trace(trace_event_type::drop, object);
+                    return;
+                }
+
+                if (scope_batch* batch = find_batch())
+                {
+                    trace(trace_event_type::release, object);
+                    batch->push(std::move(resource));
+                    return;
+                }
+
+                const extras& state = get_extras();
+
+                if (m_cpu_cache_enabled.load(std::memory_order_acquire) &&
+                    state.m_cpu_resources->push(resource))
+                {
+                    trace(trace_event_type::release, object);
+                    notify_waiters();
+                    sample_cpu_cache();
+                    return;
+                }
+
+                bool contended;
+                bool kept = false;
+                std::vector<value_ptr> spilled;
+                {
+                    probe_lock lock(m_mutex);
+                    contended = lock.contended();
+
+                    if (m_free_vector.size() < m_capacity)
+                    {
+                        push_free(std::move(resource));
+                        kept = true;
+                    }
+                    else if (state.m_parent)
+                    {
+                        spill(resource, spilled);
+                        kept = true;
+                    }
+                    else if (state.m_tuning)
+                    {
+                        ++state.m_tuning->m_drops;
+                    }
+                }
+
+                if (!kept)
+                    forget(resource);
+
+                if (!spilled.empty())
+                    state.m_parent->m_give(spilled);
+
+                trace(kept ? trace_event_type::release : trace_event_type::drop,
+                      object);
+
+                notify_waiters();
+                adapt(contended);
+            }
+
+            /// Runs the steps of a release which do not need the lock
+            /// @return true if the resource should be kept, otherwise
+            ///         it is destroyed when resource goes out of scope
+            bool prepare(entry& resource)
+            {
+                if (resource.m_tenant != nullptr)
+                {
+                    release(*resource.m_tenant);
+
+                    if (!retain(resource))
+                        return false;
+                }
+
+                if (m_recycle)
+                {
+                    m_recycle(resource.m_resource);
+                }
+
+                if (!keep(resource))
+                {
+                    forget(resource);
+                    return false;
+                }
+
+                return true;
+            }
+
+            /// @copydoc pool_scope::attach()
+            void attach(detail::scope_state& scope)
+            {
+                scope_batch* batch = static_cast<scope_batch*>(
+                    scope.find_local(this, type_tag()));
+
+                if (batch == nullptr)
+                {
+                    scope.insert(this, type_tag(),
+                        std::unique_ptr<detail::scope_batch>(new scope_batch(
+                            lifetime_policy::make_pointer(*this), capacity())));
+                }
+                else if (!batch->owned_by(this))
+                {
+                    // The batch was left by a pool which died at the
+                    // same address
+                    batch->flush();
+                    batch->m_pool = lifetime_policy::make_pointer(*this);
+                    batch->m_limit = capacity();
+                }
+            }
+
+            /// @copydoc resource_pool::enable_capacity_tuning()
+            void enable_capacity_tuning(std::size_t min_capacity,
+                                        std::size_t max_capacity,
+                                        uint32_t window)
+            {
+                assert(min_capacity <= max_capacity);
+                assert(window > 0);
+
+                extras& state = make_extras();
+
+                lock_type lock(m_mutex);
+
+                state.m_tuning.reset(new tuning());
+                state.m_tuning->m_min_capacity = min_capacity;
+                state.m_tuning->m_max_capacity = max_capacity;
+                state.m_tuning->m_window = window;
+                state.m_tuning->m_low_water = m_free_vector.size();
+
+                m_capacity = std::min(std::max(m_capacity, min_capacity),
+                                      max_capacity);
+                update_fair_share();
+            }
+
+            /// @copydoc resource_pool::capacity_decisions()
+            std::vector<capacity_decision> capacity_decisions() const
+            {
+                const extras& state = get_extras();
+
+                lock_type lock(m_mutex);
+
+                if (!state.m_tuning)
+                    return std::vector<capacity_decision>();
+
+                return state.m_tuning->m_decisions;
+            }
+
+            /// @copydoc resource_pool::set_trace_recorder()
+            void set_trace_recorder(std::shared_ptr<trace_recorder> recorder)
+            {
+                make_extras().m_trace = std::move(recorder);
+            }
+
+            /// @copydoc resource_pool::set_parent()
+            void set_parent(std::unique_ptr<parent_link> link)
+            {
+                make_extras().m_parent = std::move(link);
+            }
+
+            /// Takes unused resources for a child pool, taking the lock
+            /// once. If none are unused one is allocated like a
+            /// regular allocation if construct is true.
+            /// @param count The largest number of resources to take
+            /// @param resources Receives the resources
+            /// @return true if the resources were unused
+            bool give_to_child(std::size_t count, bool construct,
+                               std::vector<value_ptr>& resources)
+            {
+                {
+                    lock_type lock(m_mutex);
+
+                    while (resources.size() < count &&
+                           m_free_vector.size() > get_extras().m_reserved)
+                    {
+                        entry resource = take_free(m_free_vector.size() - 1);
+                        forget(resource);
+                        resources.push_back(std::move(resource.m_resource));
+                    }
+                }
+
+                if (!resources.empty())
+                    return true;
+
+                request r;
+                r.m_construct = construct;
+
+                entry resource;
+                control_block* block = nullptr;
+                block_guard guard(*this, block);
+
+                if (!take_or_construct(r, resource, block))
+                    return false;
+
+                forget(resource);
+                resources.push_back(std::move(resource.m_resource));
+                return r.m_hit;
+            }
+
+            /// Keeps resources released by a child pool beyond its
+            /// capacity, taking the lock once. The resources which do
+            /// not fit are passed on to our parent or destroyed.
+            void take_from_child(std::vector<value_ptr>& resources)
+            {
+                std::size_t kept = 0;
+                {
+                    lock_type lock(m_mutex);
+
+                    while (kept < resources.size() &&
+                           m_free_vector.size() < m_capacity)
+                    {
+                        push_free(entry(std::move(resources[kept])));
+                        ++kept;
+                    }
+                }
+
+                resources.erase(resources.begin(), resources.begin() + kept);
+
+                const extras& state = get_extras();
+
+                if (!resources.empty() && state.m_parent)
+                    state.m_parent->m_give(resources);
+
+                resources.clear();
+
+                if (kept > 0)
+                    notify_waiters();
+            }
+
+            /// Records an event if a trace recorder is set
+            void trace(trace_event_type type, const void* object)
+            {
+                const extras& state = get_extras();
+
+                if (state.m_trace)
+                    state.m_trace->record(type, object);
+            }
+
+            /// @copydoc resource_pool::set_reserved()
+            void set_reserved(std::size_t reserved)
+            {
+                make_extras().m_reserved = reserved;
+            }
+
+            /// @copydoc resource_pool::set_tenant_quota()
+            void set_tenant_quota(tenant_type tenant,
+                                  std::size_t max_outstanding,
+                                  std::size_t max_retained,
+                                  std::chrono::microseconds wait)
+            {
+                extras& options = make_extras();
+
+                if (!options.m_tenants)
+                    options.m_tenants.reset(new tenant_table());
+
+                std::unique_ptr<tenant_state>& state =
+                    options.m_tenants->m_states[tenant];
+
+                if (!state)
+                    state.reset(new tenant_state());
+
+                state->m_max_outstanding = max_outstanding;
+                state->m_max_retained = max_retained;
+                state->m_wait = wait;
+
+                update_fair_share();
+            }
+
+            /// @return The state of a tenant with a quota or nullptr
+            tenant_state* find_tenant(tenant_type tenant) const
+            {
+                const std::unique_ptr<tenant_table>& tenants =
+                    get_extras().m_tenants;
+
+                if (!tenants)
+                    return nullptr;
+
+                auto it = tenants->m_states.find(tenant);
+
+                if (it == tenants->m_states.end())
+                    return nullptr;
+
+                return it->second.get();
+            }
+
+            /// @copydoc resource_pool::tenant_stats()
+            tenant_statistics tenant_stats(tenant_type tenant) const
+            {
+                tenant_statistics stats;
+                const tenant_state* state = find_tenant(tenant);
+
+                if (state == nullptr)
+                    return stats;
+
+                stats.m_outstanding = state->m_outstanding.load();
+                stats.m_retained = state->m_retained.load();
+                stats.m_allocations = state->m_allocations.load();
+                stats.m_rejections = state->m_rejections.load();
+                stats.m_waits = state->m_waits.load();
+                return stats;
+            }
+
+            /// @copydoc resource_pool::set_max_constructions()
+            void set_max_constructions(std::size_t max_constructions,
+                                       std::chrono::microseconds wait)
+            {
+                if (max_constructions == 0)
+                {
+                    if (extras* state = find_extras())
+                        state->m_throttle.reset();
+
+                    return;
+                }
+
+                extras& state = make_extras();
+                state.m_throttle.reset(new throttle());
+                state.m_throttle->m_max_constructions = max_constructions;
+                state.m_throttle->m_wait = wait;
+            }
+
+            /// @copydoc resource_pool::set_reconfigure_function()
+            void set_reconfigure_function(reconfigure_function reconfigure)
+            {
+                make_extras().m_reconfigure = std::move(reconfigure);
+            }
+
+            /// @copydoc resource_pool::set_max_reuses()
+            void set_max_reuses(uint32_t max_reuses)
+            {
+                m_max_reuses = max_reuses;
+            }
+
+            /// @copydoc resource_pool::set_footprint_limit()
+            void set_footprint_limit(footprint_function footprint,
+                                     std::size_t max_footprint,
+                                     shrink_function shrink)
+            {
+                extras& state = make_extras();
+                state.m_footprint = std::move(footprint);
+                state.m_max_footprint = max_footprint;
+                state.m_shrink = std::move(shrink);
+            }
+
+            /// @copydoc resource_pool::set_soft_trim()
+            void set_soft_trim(std::size_t watermark,
+                               memory_range_function range)
+            {
+                extras& state = make_extras();
+                state.m_soft_trim.reset(new soft_trim());
+                state.m_soft_trim->m_watermark = watermark;
+                state.m_soft_trim->m_range = std::move(range);
+            }
+
+            /// @copydoc resource_pool::trim_unused()
+            void trim_unused()
+            {
+                const std::unique_ptr<soft_trim>& trimming =
+                    get_extras().m_soft_trim;
+
+                lock_type lock(m_mutex);
+
+                if (!trimming)
+                    return;
+
+                // The resources are taken from the back of the free
+                // list, so the ones in front have been idle longest
+                std::size_t watermark = trimming->m_watermark;
+                std::size_t size = m_free_vector.size();
+
+                for (std::size_t i = 0; i + watermark < size; ++i)
+                    trim(m_free_vector[i]);
+            }
+
+            /// @copydoc resource_pool::trimmed_resources()
+            std::size_t trimmed_resources() const
+            {
+                lock_type lock(m_mutex);
+
+                std::size_t trimmed = 0;
+                for (const entry& resource : m_free_vector)
+                {
+                    if (resource.m_trimmed)
+                        ++trimmed;
+                }
+
+                return trimmed;
+            }
+
+            /// The configuration of the soft trimming
+            struct soft_trim
+            {
+                /// The number of unused resources kept intact
+                std::size_t m_watermark = 0;
+
+                /// Returns the memory of a resource
+                memory_range_function m_range;
+            };
+
+            /// Releases the memory of an unused resource, the caller
+            /// must hold the lock
+            void trim(entry& resource)
+            {
+                if (resource.m_trimmed)
+                    return;
+
+                std::pair<void*, std::size_t> range =
+                    get_extras().m_soft_trim->m_range(*resource.m_resource);
+
+                resource.m_trimmed =
+                    detail::release_pages(range.first, range.second);
+            }
+
+            /// @return true if the resource should be recycled into the
+            ///         pool, false if it should be retired
+            bool keep(entry& resource) const
+            {
+                if (m_max_reuses > 0 && resource.m_reuses >= m_max_reuses)
+                {
+                    return false;
+                }
+
+                const extras& state = get_extras();
+
+                if (state.m_footprint)
+                {
+                    value_type& value = *resource.m_resource;
+
+                    if (state.m_footprint(value) <= state.m_max_footprint)
+                        return true;
+
+                    if (!state.m_shrink)
+                        return false;
+
+                    state.m_shrink(value);
+                    return state.m_footprint(value) <= state.m_max_footprint;
+                }
+
+                return true;
+            }
+
+            /// This function is called when a control block is
+            /// released
+            /// @return true if the block was cached otherwise the
+            ///         caller should release the memory.
+            bool recycle_block(void* memory)
+            {
+                // The spare block of a chunk would keep the memory of
+                // its value alive after the value was dropped
+                if (detail::block_in_chunk(memory))
+                    return false;
+
+                control_block* block = static_cast<control_block*>(memory);
+
+                if (scope_batch* batch = find_batch())
+                {
+                    batch->push(block);
+                    return true;
+                }
+
+                if (m_cpu_cache_enabled.load(std::memory_order_acquire) &&
+                    get_extras().m_cpu_blocks->push(block))
+                {
+                    return true;
+                }
+
+                lock_type lock(m_mutex);
+                return push_block(block);
+            }
+
+            /// @copydoc resource_pool::mutex()
+            const mutex_type& mutex() const
+            {
+                return m_mutex;
+            }
+
+        private:
+
+            /// The back-pointer to the pool stored in the deleter
+            /// and allocator
+            using pool_pointer =
+                typename lifetime_policy::template pointer_type<impl>;
+
+            /// The lock used on the hot paths, it tells whether the
+            /// pool mutex was contended
+            using probe_lock = detail::probing_lock<mutex_type, lock_type>;
+
+            /// An unused control block. The free list of control
+            /// blocks is intrusive, i.e. the link to the next block
+            /// is stored inside the unused memory itself, so caching
+            /// blocks costs no memory beyond the blocks themselves.
+            struct control_block
+            {
+                control_block* m_next;
+            };
+
+            /// The resources and control blocks released into a
+            /// pool_scope on the thread owning the scope
+            struct scope_batch : public detail::scope_batch
+            {
+                scope_batch(const pool_pointer& pool, std::size_t limit) :
+                    m_pool(pool),
+                    m_limit(limit)
+                { }
+
+                ~scope_batch()
+                {
+                    flush();
+                }
+
+                void flush() override
+                {
+                    if (m_resources.empty() && m_blocks.empty())
+                        return;
+
+                    // Swapped out first since destroying a resource
+                    // may release others into this batch
+                    std::vector<entry> resources;
+                    std::vector<control_block*> blocks;
+                    resources.swap(m_resources);
+                    blocks.swap(m_blocks);
+
+                    auto pool = lifetime_policy::lock(m_pool);
+
+                    if (pool)
+                    {
+                        pool->recycle_batch(resources, blocks);
+                        return;
+                    }
+
+                    for (control_block* block : blocks)
+                        detail::free_block(block);
+                }
+
+                /// Keeps a released resource. The batch is returned
+                /// to the pool once it is full, so a long-lived scope
+                /// holds no more than the pool would.
+                void push(entry resource)
+                {
+                    m_resources.push_back(std::move(resource));
+
+                    if (m_resources.size() >= m_limit)
+                        flush();
+                }
+
+                /// Keeps a released control block, see push(entry)
+                void push(control_block* block)
+                {
+                    m_blocks.push_back(block);
+
+                    if (m_blocks.size() >= m_limit)
+                        flush();
+                }
+
+                /// @return true if the pool of the batch is alive and
+                ///         at the given address
+                bool owned_by(const impl* pool) const
+                {
+                    return address(lifetime_policy::lock(m_pool)) == pool;
+                }
+
+                /// Takes a resource, preferring one last used with the
+                /// key, and a control block if the batch has them
+                void pop(const key_type* key, entry& resource,
+                         control_block*& block)
+                {
+                    if (!m_blocks.empty())
+                    {
+                        block = m_blocks.back();
+                        m_blocks.pop_back();
+                    }
+
+                    if (m_resources.empty())
+                        return;
+
+                    std::size_t position = m_resources.size() - 1;
+
+                    if (key != nullptr)
+                    {
+                        for (std::size_t i = m_resources.size(); i-- > 0;)
+                        {
+                            if (m_resources[i].m_has_key &&
+                                m_resources[i].m_key == *key)
+                            {
+                                position = i;
+                                break;
+                            }
+                        }
+                    }
+
+                    std::swap(m_resources[position], m_resources.back());
+                    resource = std::move(m_resources.back());
+                    m_resources.pop_back();
+                }
+
+                static const impl* address(const std::shared_ptr<impl>& pool)
+                {
+                    return pool.get();
+                }
+
+                static const impl* address(const impl* pool)
+                {
+                    return pool;
+                }
+
+                /// The pool
+                pool_pointer m_pool;
+
+                /// The number of resources or control blocks kept
+                /// before the batch is returned, the capacity of the
+                /// pool when it was attached
+                std::size_t m_limit;
+
+                /// The unused resources
+                std::vector<entry> m_resources;
+
+                /// The unused control blocks
+                std::vector<control_block*> m_blocks;
+            };
+
+            /// Returns the resources and control blocks kept by a
+            /// pool_scope taking the lock once. The resources which do
+            /// not fit are destroyed after the lock is released.
+            void recycle_batch(std::vector<entry>& resources,
+                               std::vector<control_block*>& blocks)
+            {
+                const extras& state = get_extras();
+
+                bool contended;
+                std::size_t kept = 0;
+                std::size_t blocks_kept = 0;
+                {
+                    probe_lock lock(m_mutex);
+                    contended = lock.contended();
+
+                    while (kept < resources.size() &&
+                           m_free_vector.size() < m_capacity)
+                    {
+                        push_free(std::move(resources[kept]));
+                        ++kept;
+                    }
+
+                    if (state.m_tuning && !state.m_parent)
+                        state.m_tuning->m_drops += resources.size() - kept;
+
+                    while (blocks_kept < blocks.size() &&
+                           push_block(blocks[blocks_kept]))
+                    {
+                        ++blocks_kept;
+                    }
+                }
+
+                for (std::size_t i = kept; i < resources.size(); ++i)
+                    forget(resources[i]);
+
+                if (state.m_parent && kept < resources.size())
+                {
+                    std::vector<value_ptr> spilled;
+                    for (std::size_t i = kept; i < resources.size(); ++i)
+                        spilled.push_back(std::move(resources[i].m_resource));
+
+                    state.m_parent->m_give(spilled);
+                }
+
+                for (std::size_t i = blocks_kept; i < blocks.size(); ++i)
+                    detail::free_block(blocks[i]);
+
+                resources.clear();
+                blocks.clear();
+
+                if (kept > 0)
+                    notify_waiters();
+
+                adapt(contended);
+            }
+
+            /// @return A tag unique to the pool type, identifying our
+            ///         batches in a pool_scope together with our address
+            static const void* type_tag()
+            {
+                static const char tag = 0;
+                return &tag;
+            }
+
+            /// @return The batch keeping the resources released on this
+            ///         thread or nullptr if no pool_scope attached to
+            ///         the pool is active
+            scope_batch* find_batch()
+            {
+                detail::scope_state* scope = detail::current_scope();
+
+                if (scope == nullptr)
+                    return nullptr;
+
+                scope_batch* batch = static_cast<scope_batch*>(
+                    scope->find(this, type_tag()));
+
+                if (batch == nullptr || !batch->owned_by(this))
+                    return nullptr;
+
+                return batch;
+            }
+
+            /// The index of the free list by key, maps a key to the
+            /// positions in the free list of the resources last used
+            /// with that key. Only keys with unused resources are kept.
+            using key_index = std::unordered_map<
+                key_type, std::vector<std::size_t>>;
+
+            /// Adds a resource to the free list, the caller must hold
+            /// the lock.
+            void push_free(entry&& resource)
+            {
+                if (resource.m_has_key)
+                {
+                    extras& state = make_extras();
+
+                    if (!state.m_key_index)
+                        state.m_key_index.reset(new key_index());
+
+                    std::vector<std::size_t>& slots =
+                        (*state.m_key_index)[resource.m_key];
+
+                    resource.m_key_slot = slots.size();
+                    slots.push_back(m_free_vector.size());
+                }
+
+                m_free_vector.push_back(std::move(resource));
+
+                // The resource pushed below the watermark is the one
+                // used least recently of those kept intact
+                const std::unique_ptr<soft_trim>& trimming =
+                    get_extras().m_soft_trim;
+
+                if (trimming && m_free_vector.size() > trimming->m_watermark)
+                {
+                    trim(m_free_vector[m_free_vector.size() - 1 -
+                                       trimming->m_watermark]);
+                }
+            }
+
+            /// Removes a resource from the free list, the last resource
+            /// takes its place. The caller must hold the lock.
+            /// @param position The position in the free list
+            /// @return The resource
+            entry take_free(std::size_t position)
+            {
+                assert(position < m_free_vector.size());
+
+                entry resource = std::move(m_free_vector[position]);
+
+                // The released pages are faulted in again on use
+                resource.m_trimmed = false;
+
+                if (resource.m_has_key)
+                {
+                    // Remove the resource from its key's slots by
+                    // moving the last slot into its place
+                    key_index& index = *get_extras().m_key_index;
+                    auto found = index.find(resource.m_key);
+                    assert(found != index.end());
+
+                    std::vector<std::size_t>& slots = found->second;
+
+                    std::size_t moved = slots.back();
+                    slots[resource.m_key_slot] = moved;
+                    m_free_vector[moved].m_key_slot = resource.m_key_slot;
+                    slots.pop_back();
+
+                    // Keys come and go, so a key without unused
+                    // resources is dropped to keep the index bounded
+                    if (slots.empty())
+                        index.erase(found);
+                }
+
+                std::size_t last = m_free_vector.size() - 1;
+
+                if (position != last)
+                {
+                    entry& moved = m_free_vector[position];
+                    moved = std::move(m_free_vector[last]);
+
+                    if (moved.m_has_key)
+                    {
+                        get_extras().m_key_index->at(moved.m_key)
+                            [moved.m_key_slot] = position;
+                    }
+                }
+
+                m_free_vector.pop_back();
+                return resource;
+            }
+
+            /// Takes an unused resource from the free list preferring
+            /// one last used with the requested key. Normal priority
+            /// requests leave the reserved resources. The caller must
+            /// hold the lock.
+            /// @return true if a resource was found
+            bool take_free(const request& r, entry& resource)
+            {
+                std::size_t reserved =
+                    r.m_priority == priority::high ? 0 : get_extras().m_reserved;
+
+                if (m_free_vector.size() <= reserved)
+                    return false;
+
+                const key_type* key = r.m_key;
+                std::size_t position;
+
+                if (key != nullptr && find_free(*key, position))
+                {
+                    resource = take_free(position);
+                    return true;
+                }
+
+                if (m_free_vector.size() > 0)
+                {
+                    resource = take_free(m_free_vector.size() - 1);
+                    return true;
+                }
+
+                return false;
+            }
+
+            /// State used to limit the number of concurrent
+            /// constructions. It uses its own mutex and condition
+            /// variable since the locking policy's mutex may not
+            /// support waiting.
+            struct throttle
+            {
+                /// The maximum number of concurrent constructions
+                std::size_t m_max_constructions = 0;
+
+                /// The maximum time to wait
+                std::chrono::microseconds m_wait{0};
+
+                /// The number of constructions in flight
+                std::size_t m_constructions = 0;
+
+                /// The number of waiting callers, read by recycle()
+                /// without taking the mutex
+                std::atomic<std::size_t> m_waiters{0};
+
+                std::mutex m_mutex;
+                std::condition_variable m_condition;
+            };
+
+            /// A construction in flight, released when it goes out of
+            /// scope also if the allocate function throws
+            struct construction_slot
+            {
+                construction_slot(impl& pool) :
+                    m_pool(pool)
+                { }
+
+                ~construction_slot()
+                {
+                    if (!m_acquired)
+                        return;
+
+                    throttle& t = *m_pool.get_extras().m_throttle;
+
+                    std::lock_guard<std::mutex> lock(t.m_mutex);
+                    --t.m_constructions;
+
+                    // The callers waiting may now construct. All are
+                    // woken, since a caller woken for the slot may
+                    // take a recycled resource instead and leave the
+                    // slot to the others.
+                    t.m_condition.notify_all();
+                }
+
+                /// Waits until a construction may start or a resource
+                /// was recycled
+                /// @param resource Assigned a recycled resource if one
+                ///        became available while waiting
+                void acquire(const request& r, entry& resource)
+                {
+                    throttle& t = *m_pool.get_extras().m_throttle;
+
+                    std::unique_lock<std::mutex> lock(t.m_mutex);
+
+                    auto deadline = std::chrono::steady_clock::now() + t.m_wait;
+
+                    // The waiter count is incremented before checking
+                    // the free list, so a recycle() that pushes after
+                    // our check sees it and notifies us.
+                    ++t.m_waiters;
+
+                    while (t.m_constructions >= t.m_max_constructions)
+                    {
+                        if (m_pool.take_unused(r, resource))
+                        {
+                            --t.m_waiters;
+                            return;
+                        }
+
+                        if (t.m_condition.wait_until(lock, deadline) ==
+                            std::cv_status::timeout)
+                        {
+                            break;
+                        }
+                    }
+
+                    --t.m_waiters;
+                    ++t.m_constructions;
+                    m_acquired = true;
+                }
+
+                impl& m_pool;
+                bool m_acquired = false;
+            };
+
+            /// Takes an unused resource from the per-CPU cache or the
+            /// free list
+            /// @return true if a resource was found
+            bool take_unused(const request& r, entry& resource)
+            {
+                if (m_cpu_cache_enabled.load(std::memory_order_acquire) &&
+                    get_extras().m_cpu_resources->pop(resource))
+                {
+                    sample_cpu_cache();
+                    return true;
+                }
+
+                lock_type lock(m_mutex);
+                return take_free(r, resource);
+            }
+
+            /// Wakes up the callers waiting for a resource or a
+            /// construction slot
+            void notify_waiters()
+            {
+                const std::unique_ptr<throttle>& t = get_extras().m_throttle;
+
+                if (!t || t->m_waiters.load(std::memory_order_seq_cst) == 0)
+                {
+                    return;
+                }
+
+                // Like when a slot frees up, a caller woken for the
+                // resource may construct instead, so all are woken
+                std::lock_guard<std::mutex> lock(t->m_mutex);
+                t->m_condition.notify_all();
+            }
+
+            /// The tenants with a quota. The table is only modified
+            /// before the pool is shared, so it is read without a lock.
+            struct tenant_table
+            {
+                std::unordered_map<tenant_type,
+                                   std::unique_ptr<tenant_state>> m_states;
+
+                /// Used to wait for a tenant's resource to be released
+                std::mutex m_mutex;
+                std::condition_variable m_condition;
+
+                /// The number of waiting callers
+                std::atomic<std::size_t> m_waiters{0};
+
+                /// The most unused resources kept per tenant, the
+                /// capacity divided by the number of tenants
+                std::atomic<std::size_t> m_fair_share{0};
+            };
+
+            /// Divides the capacity between the tenants, called when
+            /// the capacity or the tenants change
+            void update_fair_share()
+            {
+                const std::unique_ptr<tenant_table>& tenants =
+                    get_extras().m_tenants;
+
+                if (!tenants || tenants->m_states.empty())
+                    return;
+
+                std::size_t share = m_capacity / tenants->m_states.size();
+
+                tenants->m_fair_share.store(std::max<std::size_t>(share, 1),
+                                            std::memory_order_relaxed);
+            }
+
+            /// Releases a tenant's admission when it goes out of scope,
+            /// unless the resource was handed out
+            struct admission
+            {
+                admission(impl& pool, tenant_state* tenant) :
+                    m_pool(pool),
+                    m_tenant(tenant)
+                { }
+
+                ~admission()
+                {
+                    if (m_tenant != nullptr)
+                        m_pool.release(*m_tenant);
+                }
+
+                admission(const admission&) = delete;
+                admission& operator=(const admission&) = delete;
+
+                /// The resource was handed out
+                void dismiss()
+                {
+                    m_tenant = nullptr;
+                }
+
+                impl& m_pool;
+                tenant_state* m_tenant;
+            };
+
+            /// Counts an allocation towards a tenant's quota, waiting
+            /// for a resource to be released if the quota is used up
+            /// @return false if the allocation was rejected
+            bool admit(tenant_state& tenant)
+            {
+                if (try_admit(tenant))
+                    return true;
+
+                if (tenant.m_wait.count() > 0)
+                {
+                    tenant.m_waits.fetch_add(1, std::memory_order_relaxed);
+
+                    auto deadline =
+                        std::chrono::steady_clock::now() + tenant.m_wait;
+
+                    tenant_table& tenants = *get_extras().m_tenants;
+
+                    std::unique_lock<std::mutex> lock(tenants.m_mutex);
+                    ++tenants.m_waiters;
+
+                    bool admitted = tenants.m_condition.wait_until(
+                        lock, deadline, [this, &tenant]()
+                        {
+                            return try_admit(tenant);
+                        });
+
+                    --tenants.m_waiters;
+
+                    if (admitted)
+                        return true;
+                }
+
+                tenant.m_rejections.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            /// @return true if the allocation fits the tenant's quota
+            bool try_admit(tenant_state& tenant)
+            {
+                // Sequentially consistent so a waiter either sees the
+                // release or the releaser sees the waiter
+                std::size_t outstanding =
+                    tenant.m_outstanding.load(std::memory_order_seq_cst);
+
+                while (outstanding < tenant.m_max_outstanding)
+                {
+                    if (tenant.m_outstanding.compare_exchange_weak(
+                            outstanding, outstanding + 1,
+                            std::memory_order_relaxed))
+                    {
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            /// Counts a released resource of a tenant
+            void release(tenant_state& tenant)
+            {
+                tenant.m_outstanding.fetch_sub(1, std::memory_order_seq_cst);
+
+                tenant_table& tenants = *get_extras().m_tenants;
+
+                if (tenants.m_waiters.load(std::memory_order_seq_cst) == 0)
+                    return;
+
+                std::lock_guard<std::mutex> lock(tenants.m_mutex);
+                tenants.m_condition.notify_all();
+            }
+
+            /// Counts an unused resource towards its tenant's retained
+            /// resources
+            /// @return false if the tenant has too many unused
+            ///         resources kept, the resource should be dropped
+            bool retain(entry& resource)
+            {
+                tenant_state& tenant = *resource.m_tenant;
+
+                std::size_t fair_share = get_extras().m_tenants->m_fair_share.load(
+                    std::memory_order_relaxed);
+
+                std::size_t limit = std::min(tenant.m_max_retained, fair_share);
+
+                std::size_t retained =
+                    tenant.m_retained.load(std::memory_order_relaxed);
+
+                while (retained < limit)
+                {
+                    if (tenant.m_retained.compare_exchange_weak(
+                            retained, retained + 1,
+                            std::memory_order_relaxed))
+                    {
+                        resource.m_retained = true;
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            /// Stops counting an unused resource towards its tenant's
+            /// retained resources, e.g. when it is allocated again or
+            /// dropped
+            void forget(entry& resource)
+            {
+                if (!resource.m_retained)
+                    return;
+
+                resource.m_tenant->m_retained.fetch_sub(
+                    1, std::memory_order_relaxed);
+                resource.m_retained = false;
+            }
+
+            /// The unused storage of a pool left behind at exit
+            struct leaked : public detail::leaked_node
+            {
+                std::vector<entry> m_free_vector;
+                std::unique_ptr<key_index> m_key_index;
+                std::unique_ptr<cpu_cache<entry>> m_cpu_resources;
+                std::unique_ptr<cpu_cache<control_block*>> m_cpu_blocks;
+                control_block* m_free_blocks = nullptr;
+            };
+
+            /// Moves the unused resources and control blocks to storage
+            /// which is never freed
+            void leak()
+            {
+                leaked* node = new leaked();
+                node->m_free_vector.swap(m_free_vector);
+                node->m_free_blocks = m_free_blocks;
+
+                if (extras* state = find_extras())
+                {
+                    node->m_key_index = std::move(state->m_key_index);
+                    node->m_cpu_resources = std::move(state->m_cpu_resources);
+                    node->m_cpu_blocks = std::move(state->m_cpu_blocks);
+                }
+
+                m_free_blocks = nullptr;
+                m_free_block_count = 0;
+
+                detail::keep_leaked(node);
+            }
+
+            /// A snapshot file being restored
+            struct snapshot
+            {
+                /// The records not restored yet
+                detail::snapshot_reader m_reader;
+
+                /// Restores a resource
+                deserialize_function m_deserialize;
+            };
+
+            /// A record taken from the snapshot. The record keeps the
+            /// file mapped until it has been restored.
+            struct snapshot_record
+            {
+                std::shared_ptr<snapshot> m_snapshot;
+                const uint8_t* m_data = nullptr;
+                std::size_t m_size = 0;
+            };
+
+            /// The unused resources and the remaining snapshot taken
+            /// out of the pool while they are saved, and put back when
+            /// it goes out of scope
+            struct saved_resources
+            {
+                saved_resources(impl& pool) :
+                    m_pool(pool)
+                {
+                    lock_type lock(m_pool.m_mutex);
+
+                    m_resources.swap(m_pool.m_free_vector);
+
+                    extras* state = m_pool.find_extras();
+                    if (state == nullptr)
+                        return;
+
+                    state->m_key_index.reset();
+
+                    // The per-CPU stacks are drained even if the cache
+                    // was disabled, see detach_unused()
+                    if (state->m_cpu_resources)
+                        state->m_cpu_resources->drain(m_resources);
+
+                    m_snapshot.swap(state->m_snapshot);
+                }
+
+                ~saved_resources()
+                {
+                    // Resources which no longer fit are destroyed
+                    // without holding the lock
+                    std::vector<entry> excess;
+                    put_back(excess);
+                }
+
+                /// Puts the resources back, the ones which do not fit
+                /// are moved to excess
+                void put_back(std::vector<entry>& excess)
+                {
+                    lock_type lock(m_pool.m_mutex);
+
+                    for (entry& resource : m_resources)
+                    {
+                        if (m_pool.m_free_vector.size() < m_pool.m_capacity)
+                        {
+                            m_pool.push_free(std::move(resource));
+                        }
+                        else
+                        {
+                            m_pool.forget(resource);
+                            excess.push_back(std::move(resource));
+                        }
+                    }
+
+                    // Unless a snapshot was restored in the meantime
+                    if (m_snapshot && !m_pool.get_extras().m_snapshot)
+                        m_pool.make_extras().m_snapshot = std::move(m_snapshot);
+                }
+
+                saved_resources(const saved_resources&) = delete;
+                saved_resources& operator=(const saved_resources&) = delete;
+
+                impl& m_pool;
+                std::vector<entry> m_resources;
+                std::shared_ptr<snapshot> m_snapshot;
+            };
+
+            /// Takes the next record of the snapshot, the caller must
+            /// hold the lock
+            snapshot_record take_record()
+            {
+                snapshot_record record;
+                std::shared_ptr<snapshot>& restoring = make_extras().m_snapshot;
+
+                if (restoring->m_reader.next(record.m_data, record.m_size))
+                    record.m_snapshot = restoring;
+
+                // A truncated file has no records left either
+                if (restoring->m_reader.remaining() == 0)
+                    restoring.reset();
+
+                return record;
+            }
+
+            /// The configuration of the parallel destruction
+            struct destruction
+            {
+                /// Runs the destruction tasks
+                executor_function m_executor;
+
+                /// The largest number of tasks
+                std::size_t m_tasks = 1;
+            };
+
+            /// Moves all unused resources out of the pool and frees
+            /// the unused control blocks, the caller must hold the lock
+            /// @param resources Receives the resources
+            void detach_unused(std::vector<entry>& resources)
+            {
+                resources.swap(m_free_vector);
+
+                if (extras* state = find_extras())
+                {
+                    state->m_key_index.reset();
+
+                    // The per-CPU stacks are drained even if the cache
+                    // was disabled, since a thread may have pushed to
+                    // them while it was being disabled.
+                    if (state->m_cpu_resources)
+                        state->m_cpu_resources->drain(resources);
+                }
+
+                for (entry& resource : resources)
+                    forget(resource);
+
+                free_blocks();
+            }
+
+            /// Destroys resources in parallel, split into ranges
+            /// destroyed by separate tasks. Without an executor the
+            /// caller destroys the first range while threads of its own
+            /// destroy the others, and they are joined before we
+            /// return.
+            /// @return A future which is ready when all the resources
+            ///         have been destroyed
+            std::future<void> destroy_async(std::vector<entry> resources)
+            {
+                // Tracks the tasks which have not completed
+                struct completion
+                {
+                    std::promise<void> m_done;
+                    std::atomic<std::size_t> m_remaining{0};
+                };
+
+                auto state = std::make_shared<completion>();
+                std::future<void> done = state->m_done.get_future();
+
+                const std::unique_ptr<destruction>& parallel =
+                    get_extras().m_destruction;
+
+                std::size_t tasks = parallel ? parallel->m_tasks : 4;
+                tasks = std::min(tasks, resources.size());
+
+                if (tasks == 0)
+                {
+                    state->m_done.set_value();
+                    return done;
+                }
+
+                auto shared =
+                    std::make_shared<std::vector<entry>>(std::move(resources));
+
+                state->m_remaining.store(tasks, std::memory_order_relaxed);
+
+                std::size_t size = shared->size();
+
+                // The tasks destroy disjoint ranges of the vector
+                auto range = [shared, state, size, tasks](std::size_t i)
+                {
+                    std::size_t first = i * size / tasks;
+                    std::size_t last = (i + 1) * size / tasks;
+
+                    for (std::size_t j = first; j < last; ++j)
+                        (*shared)[j].m_resource.reset();
+
+                    if (state->m_remaining.fetch_sub(
+                            1, std::memory_order_acq_rel) == 1)
+                    {
+                        state->m_done.set_value();
+                    }
+                };
+
+                if (parallel)
+                {
+                    for (std::size_t i = 0; i < tasks; ++i)
+                        parallel->m_executor(std::bind(range, i));
+
+                    return done;
+                }
+
+                std::vector<std::future<void>> helpers;
+
+                for (std::size_t i = 1; i < tasks; ++i)
+                {
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+                    try
+                    {
+                        helpers.push_back(
+                            std::async(std::launch::async, range, i));
+                    }
+                    catch (const std::system_error&)
+                    {
+                        // No thread could be started, destroy the
+                        // range ourselves
+                        range(i);
+                    }
+#else
+                    // Without exceptions a failure to start a thread
+                    // cannot be recovered, destroy the range ourselves
+                    range(i);
+#endif
+                }
+
+                range(0);
+
+                for (std::future<void>& helper : helpers)
+                    helper.get();
+
+                return done;
+            }
+
+            /// State used to tune the capacity, protected by the pool
+            /// mutex
+            struct tuning
+            {
+                /// The smallest capacity
+                std::size_t m_min_capacity = 0;
+
+                /// The largest capacity
+                std::size_t m_max_capacity = 0;
+
+                /// The number of allocations between decisions
+                uint32_t m_window = 0;
+
+                /// The allocations in the current window
+                uint32_t m_allocations = 0;
+
+                /// The allocations which missed the free list
+                uint64_t m_misses = 0;
+
+                /// The resources dropped since the pool was full
+                uint64_t m_drops = 0;
+
+                /// The smallest size of the free list
+                std::size_t m_low_water = 0;
+
+                /// The number of windows completed
+                uint64_t m_windows = 0;
+
+                /// The most recent decisions, the oldest first
+                std::vector<capacity_decision> m_decisions;
+            };
+
+            /// Counts an allocation taking the pool mutex and adjusts
+            /// the capacity at the end of a window. The caller must
+            /// hold the lock.
+            /// @param found Whether the allocation hit the free list
+            /// @param excess Receives the resources beyond the new
+            ///        capacity
+            void tune(bool found, std::vector<entry>& excess)
+            {
+                tuning& t = *get_extras().m_tuning;
+
+                ++t.m_allocations;
+
+                if (!found)
+                    ++t.m_misses;
+
+                t.m_low_water = std::min(t.m_low_water, m_free_vector.size());
+
+                if (t.m_allocations < t.m_window)
+                    return;
+
+                capacity_decision decision;
+                decision.m_window = t.m_windows++;
+                decision.m_old_capacity = m_capacity;
+                decision.m_misses = t.m_misses;
+                decision.m_drops = t.m_drops;
+                decision.m_idle = t.m_low_water;
+
+                std::size_t capacity = m_capacity;
+
+                if (t.m_drops > 0 && t.m_misses > 0)
+                {
+                    // We dropped resources and later constructed new
+                    // ones, the capacity was too small
+                    std::size_t grow = static_cast<std::size_t>(
+                        std::min(t.m_drops, t.m_misses));
+
+                    capacity = std::min(t.m_max_capacity, capacity + grow);
+                }
+                else if (t.m_drops == 0 && t.m_low_water > 0)
+                {
+                    // Some resources were never used during the
+                    // window, shrink by half of them to avoid
+                    // oscillating
+                    std::size_t shrink = (t.m_low_water + 1) / 2;
+
+                    capacity = capacity > shrink ? capacity - shrink : 0;
+                    capacity = std::max(t.m_min_capacity, capacity);
+                }
+
+                m_capacity = capacity;
+                decision.m_new_capacity = capacity;
+                update_fair_share();
+
+                while (m_free_vector.size() > m_capacity)
+                {
+                    excess.push_back(take_free(m_free_vector.size() - 1));
+                    forget(excess.back());
+                }
+
+                if (t.m_decisions.size() == max_decisions)
+                    t.m_decisions.erase(t.m_decisions.begin());
+
+                t.m_decisions.push_back(decision);
+
+                t.m_allocations = 0;
+                t.m_misses = 0;
+                t.m_drops = 0;
+                t.m_low_water = m_free_vector.size();
+            }
+
+            /// State used to enable the per-CPU cache while the pool is
+            /// contended
+            struct adaptive
+            {
+                /// The number of operations served by the per-CPU
+                /// cache on a CPU between two probes of the pool mutex
+                static const uint32_t sample_period = 64;
+
+                /// Counts the operations served by the per-CPU cache
+                /// on one CPU. The padding keeps the counters of two
+                /// neighbouring CPUs on different cache lines.
+                struct tick
+                {
+                    std::atomic<uint32_t> m_count{0};
+                    char m_padding[60];
+                };
+
+                /// The fraction of contended acquisitions enabling the
+                /// cache
+                double m_threshold = 0;
+
+                /// The number of acquisitions between decisions
+                uint32_t m_window = 0;
+
+                /// The time the cache stays enabled after the last
+                /// contended window
+                std::chrono::milliseconds m_cooldown{0};
+
+                /// The acquisitions in the current window
+                std::atomic<uint32_t> m_acquisitions{0};
+
+                /// The contended acquisitions in the current window
+                std::atomic<uint32_t> m_contended{0};
+
+                /// When the last contended window ended, in steady
+                /// clock ticks
+                std::atomic<int64_t> m_contended_at{0};
+
+                /// The number of counters in m_ticks
+                std::size_t m_cpus = 0;
+
+                /// The per-CPU operation counters
+                std::unique_ptr<tick[]> m_ticks;
+            };
+
+            /// Counts an operation served by the per-CPU cache. Since
+            /// these never acquire the pool mutex, every
+            /// adaptive::sample_period operations on a CPU probe the
+            /// mutex to keep measuring the contention while the cache
+            /// is enabled. Must be called without holding the lock.
+            void sample_cpu_cache()
+            {
+                adaptive* a = get_extras().m_adaptive.get();
+
+                if (a == nullptr)
+                    return;
+
+                std::atomic<uint32_t>& ticks =
+                    a->m_ticks[current_cpu() % a->m_cpus].m_count;
+
+                if (ticks.fetch_add(1, std::memory_order_relaxed) + 1 <
+                    adaptive::sample_period)
+                {
+                    return;
+                }
+
+                ticks.store(0, std::memory_order_relaxed);
+
+                bool contended;
+                {
+                    probe_lock lock(m_mutex);
+                    contended = lock.contended();
+                }
+
+                adapt(contended);
+            }
+
+            /// Records an acquisition of the pool mutex and enables or
+            /// disables the per-CPU cache. Must be called without
+            /// holding the lock.
+            /// @param contended Whether the acquisition was contended
+            void adapt(bool contended)
+            {
+                adaptive* a = get_extras().m_adaptive.get();
+
+                if (a == nullptr)
+                    return;
+
+                if (contended)
+                {
+                    a->m_contended.fetch_add(
+                        1, std::memory_order_relaxed);
+                }
+
+                uint32_t acquisitions = a->m_acquisitions.fetch_add(
+                    1, std::memory_order_relaxed) + 1;
+
+                // Only the thread completing the window decides
+                if (acquisitions != a->m_window)
+                    return;
+
+                uint32_t contentions = a->m_contended.exchange(
+                    0, std::memory_order_relaxed);
+                a->m_acquisitions.store(0, std::memory_order_relaxed);
+
+                using clock = std::chrono::steady_clock;
+                clock::duration now = clock::now().time_since_epoch();
+
+                if (contentions > 0 &&
+                    contentions >= a->m_threshold * acquisitions)
+                {
+                    a->m_contended_at.store(now.count(),
+                                            std::memory_order_relaxed);
+                    m_cpu_cache_enabled.store(true, std::memory_order_release);
+                    return;
+                }
+
+                if (!m_cpu_cache_enabled.load(std::memory_order_acquire))
+                    return;
+
+                // The contention subsided, collapse once the cache has
+                // not been needed for the cool-down
+                clock::duration idle = now - clock::duration(
+                    a->m_contended_at.load(std::memory_order_relaxed));
+
+                if (idle >= a->m_cooldown)
+                    disable_cpu_cache();
+            }
+
+            /// Disables the per-CPU cache and moves the cached
+            /// resources and control blocks back to the free lists.
+            /// The caches themselves are kept, since outstanding
+            /// resources may still be recycled into them by threads
+            /// which saw the cache enabled.
+            void disable_cpu_cache()
+            {
+                bool enabled = true;
+                if (!m_cpu_cache_enabled.compare_exchange_strong(enabled, false))
+                    return;
+
+                const extras& state = get_extras();
+
+                std::vector<entry> resources;
+                state.m_cpu_resources->drain(resources);
+
+                std::vector<control_block*> blocks;
+                state.m_cpu_blocks->drain(blocks);
+
+                std::vector<control_block*> excess;
+
+                {
+                    lock_type lock(m_mutex);
+
+                    for (auto& resource : resources)
+                    {
+                        if (m_free_vector.size() < m_capacity)
+                            push_free(std::move(resource));
+                        else
+                            forget(resource);
+                    }
+
+                    for (control_block* block : blocks)
+                    {
+                        if (!push_block(block))
+                            excess.push_back(block);
+                    }
+                }
+
+                // Resources which did not fit are destroyed without
+                // holding the lock
+                for (control_block* block : excess)
+                    detail::free_block(block);
+            }
+
+            /// Finds an unused resource last used with a key, the
+            /// caller must hold the lock.
+            /// @return true if a resource was found
+            bool find_free(key_type key, std::size_t& position) const
+            {
+                const key_index* index = get_extras().m_key_index.get();
+
+                if (index == nullptr)
+                    return false;
+
+                auto slots = index->find(key);
+
+                if (slots == index->end() || slots->second.empty())
+                    return false;
+
+                position = slots->second.back();
+                return true;
+            }
+
+            /// Takes an unused resource and a control block from the
+            /// pool, constructing a new resource on a miss. The caller
+            /// owns the control block also when false is returned or an
+            /// exception is thrown, see block_guard.
+            /// @return false if there was no unused resource and the
+            ///         request does not allow constructing one
+            bool take_or_construct(request& r, entry& resource,
+                                   control_block*& block)
+            {
+                const key_type* key = r.m_key;
+
+                if (scope_batch* batch = find_batch())
+                    batch->pop(key, resource, block);
+
+                if (m_cpu_cache_enabled.load(std::memory_order_acquire))
+                {
+                    const extras& state = get_extras();
+
+                    if (!resource.m_resource &&
+                        state.m_cpu_resources->pop(resource))
+                    {
+                        sample_cpu_cache();
+                    }
+
+                    if (block == nullptr)
+                        state.m_cpu_blocks->pop(block);
+                }
+
+                if (key != nullptr && resource.m_resource &&
+                    !(resource.m_has_key && resource.m_key == *key) &&
+                    get_extras().m_key_index)
+                {
+                    // The resource from the CPU cache is in the wrong
+                    // state, look for a better match in the free list
+                    lock_type lock(m_mutex);
+
+                    std::size_t position;
+                    if (find_free(*key, position))
+                    {
+                        entry match = take_free(position);
+                        std::swap(match, resource);
+
+                        if (m_free_vector.size() < m_capacity)
+                            push_free(std::move(match));
+                        else
+                            forget(match);
+                    }
+                }
+
+                if (!resource.m_resource)
+                {
+                    bool contended;
+
+                    // Resources trimmed by the capacity tuning are
+                    // destroyed without holding the lock
+                    std::vector<entry> excess;
+
+                    // A miss restores a resource from the snapshot
+                    snapshot_record record;
+                    {
+                        probe_lock lock(m_mutex);
+                        contended = lock.contended();
 
-        /// Create a resource pool using a specific allocate function and
-        /// recycle function.
-        /// @param allocate Allocation function
-        /// @param recycle Recycle function
-        resource_pool(allocate_function allocate, recycle_function recycle, std::size_t capacity = DEFAULT_CAPACITY) :
-            m_pool(std::make_shared<impl>(std::move(allocate),
-                                          std::move(recycle), capacity))
-        { }
+                        bool found = take_free(r, resource);
 
-        /// Copy constructor
-        resource_pool(const resource_pool& other) :
-            m_pool(std::make_shared<impl>(*other.m_pool))
-        { }
+                        if (!found && get_extras().m_snapshot)
+                            record = take_record();
 
-        /// Move constructor
-        resource_pool(resource_pool&& other) :
-            m_pool(std::move(other.m_pool))
-        {
-            assert(m_pool);
-        }
+                        // A cached control block can be used both when
+                        // we hit and miss the free list, since blocks
+                        // are also kept when their resource was dropped.
+                        if (block == nullptr)
+                            block = pop_block();
 
-        /// Copy assignment
-        resource_pool& operator=(const resource_pool& other)
-        {
-            resource_pool tmp(other);
-            std::swap(*this, tmp);
-            return *this;
-        }
+                        if (get_extras().m_tuning)
+                            tune(found, excess);
+                    }
 
-        /// Move assignment
-        resource_pool& operator=(resource_pool&& other)
-        {
-            m_pool = std::move(other.m_pool);
-            return *this;
-        }
+                    adapt(contended);
 
-        /// @returns the number of unused resources
-        std::size_t unused_resources() const
-        {
-            assert(m_pool);
-            return m_pool->unused_resources();
-        }
+                    // Deserializing is done without holding the lock,
+                    // if it fails we construct a resource instead
+                    if (record.m_snapshot)
+                    {
+                        resource = entry(record.m_snapshot->m_deserialize(
+                            record.m_data, record.m_size));
+                    }
+                }
 
-        /// Frees all unused resources
-        void free_unused()
-        {
-            assert(m_pool);
-            m_pool->free_unused();
-        }
+                if (!resource.m_resource && get_extras().m_parent)
+                {
+                    // Our parent allocates on a miss, so we never
+                    // construct resources ourselves
+                    bool hit = take_from_parent(r.m_construct, resource);
 
-        /// @return A resource from the pool.
-        value_ptr allocate()
-        {
-            assert(m_pool);
-            return m_pool->allocate();
-        }
+                    if (!resource.m_resource)
+                        return false;
 
-    private:
+                    if (hit)
+                    {
+                        ++resource.m_reuses;
+                        r.m_hit = true;
+                    }
 
-        /// The actual pool implementation. We use the
-        /// enable_shared_from_this helper to make sure we can pass a
-        /// "back-pointer" to the pooled objects. The idea behind this
-        /// is that we need objects to be able to add themselves back
-        /// into the pool once they go out of scope.
-        struct impl : public std::enable_shared_from_this<impl>
-        {
-            /// @copydoc resource_pool::resource_pool(allocate_function)
-            impl(allocate_function allocate, std::size_t capacity) :
-                m_allocate(std::move(allocate))
-            {
-                assert(m_allocate);
-                m_free_vector.reserve(capacity);
-                m_free_vector_control_blocks.reserve(capacity);
-            }
+                    return true;
+                }
 
-            /// @copydoc resource_pool::resource_pool(allocate_function,
-            ///                                       recycle_function)
-            impl(allocate_function allocate, recycle_function recycle, std::size_t capacity) :
-                m_allocate(std::move(allocate)),
-                m_recycle(std::move(recycle))
-            {
-                assert(m_allocate);
-                assert(m_recycle);
-                m_free_vector.reserve(capacity);
-                m_free_vector_control_blocks.reserve(capacity);
+                // With a construction limit we may get a recycled
+                // resource while waiting for our turn to construct
+                construction_slot slot(*this);
+
+                if (!resource.m_resource && r.m_construct &&
+                    get_extras().m_throttle)
+                {
+                    slot.acquire(r, resource);
+                }
+
+                if (!resource.m_resource && !r.m_construct)
+                    return false;
+
+                if (!resource.m_resource)
+                {
+                    // If we did not find a cached control block we
+                    // ask for a spare one to be allocated with the
+                    // value.
+                    resource.m_resource =
+                        construct(block == nullptr ? &block : nullptr);
+
+                    // The allocate function failed
+                    if (!resource.m_resource)
+                        return false;
+                }
+                else
+                {
+                    ++resource.m_reuses;
+                    r.m_hit = true;
+                }
+
+                return true;
             }
 
-            /// Copy constructor
-            impl(const impl& other) :
-                std::enable_shared_from_this<impl>(other),
-                m_allocate(other.m_allocate),
-                m_recycle(other.m_recycle)
+            /// Takes a batch of resources from the parent pool, the
+            /// first is returned and the others kept as unused. The
+            /// ones which do not fit are given back.
+            /// @return true if the resources were unused in the parent
+            bool take_from_parent(bool construct, entry& resource)
             {
-                m_free_vector.reserve(other.m_free_vector.capacity());
-                m_free_vector_control_blocks.reserve(other.m_free_vector_control_blocks.capacity());
-                uint32_t size = other.unused_resources();
-                for (uint32_t i = 0; i < size; ++i)
+                parent_link& parent = *get_extras().m_parent;
+
+                std::vector<value_ptr> resources;
+                bool hit = parent.m_take(parent.m_batch, construct, resources);
+
+                if (resources.empty())
+                    return false;
+
+                resource = entry(std::move(resources.front()));
+
+                std::size_t kept = 1;
+
+                if (resources.size() > 1)
                 {
-                    m_free_vector.push_back(m_allocate());
+                    lock_type lock(m_mutex);
+
+                    while (kept < resources.size() &&
+                           m_free_vector.size() < m_capacity)
+                    {
+                        push_free(entry(std::move(resources[kept])));
+                        ++kept;
+                    }
                 }
-            }
 
-            /// Move constructor
-            impl(impl&& other) :
-                std::enable_shared_from_this<impl>(other),
-                m_allocate(std::move(other.m_allocate)),
-                m_recycle(std::move(other.m_recycle)),
-                m_free_vector(std::move(other.m_free_vector)),
-                m_free_vector_control_blocks(std::move(other.m_free_vector_control_blocks))
-            { }
+                if (kept < resources.size())
+                {
+                    resources.erase(resources.begin(),
+                                    resources.begin() + kept);
+                    parent.m_give(resources);
+                }
 
-            ~impl()
-            {
-                m_free_vector.clear();
-                for (void* p : m_free_vector_control_blocks)
-                    std::free(p);
-                m_free_vector_control_blocks.clear();
+                return hit;
             }
 
-            /// Copy assignment
-            impl& operator=(const impl& other)
+            /// Moves a released resource and unused ones to the batch
+            /// given to the parent pool, the caller must hold the lock
+            void spill(entry& resource, std::vector<value_ptr>& resources)
             {
-                impl tmp(other);
-                std::swap(*this, tmp);
-                return *this;
+                forget(resource);
+                resources.push_back(std::move(resource.m_resource));
+
+                while (resources.size() < get_extras().m_parent->m_batch &&
+                       !m_free_vector.empty())
+                {
+                    entry unused = take_free(m_free_vector.size() - 1);
+                    forget(unused);
+                    resources.push_back(std::move(unused.m_resource));
+                }
             }
 
-            /// Move assignment
-            impl& operator=(impl&& other)
+            /// Hands back a control block which was not used, if any
+            void release_block(control_block* block)
             {
-                m_allocate = std::move(other.m_allocate);
-                m_recycle = std::move(other.m_recycle);
-                m_free_vector = std::move(other.m_free_vector);
-                m_free_vector_control_blocks = std::move(other.m_free_vector_control_blocks);
-                return *this;
+                if (block != nullptr && !recycle_block(block))
+                    detail::free_block(block);
             }
 
-            /// Allocate a new value from the pool
-            value_ptr allocate()
+            /// Hands back the control block taken for an allocation
+            /// when it goes out of scope, unless it was handed to the
+            /// returned std::shared_ptr<T>
+            struct block_guard
             {
-                value_ptr resource;
-                value_ptr result;
-
-                auto pool = impl::shared_from_this();
+                block_guard(impl& pool, control_block*& block) :
+                    m_pool(pool),
+                    m_block(block)
+                { }
 
+                ~block_guard()
                 {
-                    lock_type lock(m_mutex);
+                    if (m_armed)
+                        m_pool.release_block(m_block);
+                }
 
-                    if (m_free_vector.size() > 0)
-                    {
-                        resource = m_free_vector.back();
-                        m_free_vector.pop_back();
+                block_guard(const block_guard&) = delete;
+                block_guard& operator=(const block_guard&) = delete;
 
-                        // The allocator's value_type doesn't matter, will rebind it anyway. (See: shared_ptr_base.h : 468)
-                        result = value_ptr(resource.get(), deleter(pool, resource), SimpleAllocator<void>(true, pool));
-                    }
+                /// The block is used, keep it
+                void dismiss()
+                {
+                    m_armed = false;
                 }
 
-                if (!resource)
+                impl& m_pool;
+                control_block*& m_block;
+                bool m_armed = true;
+            };
+
+            /// @return A cached control block from the per-CPU cache or
+            ///         the free list, nullptr if none is cached
+            control_block* take_block()
+            {
+                control_block* block = nullptr;
+
+                if (m_cpu_cache_enabled.load(std::memory_order_acquire) &&
+                    get_extras().m_cpu_blocks->pop(block))
                 {
-                    assert(m_allocate);
-                    resource = m_allocate();
+                    return block;
+                }
 
-                    // The allocator's value_type doesn't matter, will rebind it anyway. (See: shared_ptr_base.h : 468)
-                    result = value_ptr(resource.get(), deleter(pool, resource), SimpleAllocator<void>(false, pool));
+                lock_type lock(m_mutex);
+                return pop_block();
+            }
+
+            /// Pops a cached control block, the caller must hold the
+            /// lock.
+            /// @return The block or nullptr if no blocks are cached
+            control_block* pop_block()
+            {
+                control_block* block = m_free_blocks;
+
+                if (block != nullptr)
+                {
+                    m_free_blocks = block->m_next;
+                    --m_free_block_count;
                 }
 
-                // Here we create a std::shared_ptr<T> with a naked
-                // pointer to the resource and a custom deleter
-                // object. The custom deleter object stores two
-                // things:
-                //
-                //   1. A std::weak_ptr<T> to the pool (used when we
-                //      need to put the resource back in the pool). If
-                //      the pool dies before the resource then we can
-                //      detect this with the weak_ptr and no try to
-                //      access it.
-                //
-                //   2. A std::shared_ptr<T> that points to the actual
-                //      resource and is the one actually keeping it alive.
+                return block;
+            }
 
-                // The allocator's value_type doesn't matter, will rebind it anyway. (See: shared_ptr_base.h : 468)
-                return result; 
+            /// Pushes an unused control block onto the free list,
+            /// the caller must hold the lock.
+            /// @return true if the block was cached otherwise the
+            ///         pool is at capacity and the caller should
+            ///         release the memory.
+            bool push_block(control_block* block)
+            {
+                if (m_free_block_count >= m_capacity)
+                    return false;
+
+                block->m_next = m_free_blocks;
+                m_free_blocks = block;
+                ++m_free_block_count;
+                return true;
             }
 
-            /// @copydoc resource_pool::free_unused()
-            void free_unused()
+            /// Releases all cached control blocks, the caller must
+            /// hold the lock.
+            void free_blocks()
             {
-                lock_type lock(m_mutex);
-                m_free_vector.clear();
-                for (void* p : m_free_vector_control_blocks)
-                    std::free(p);
-                m_free_vector_control_blocks.clear();
+                const std::unique_ptr<cpu_cache<control_block*>>& cached =
+                    get_extras().m_cpu_blocks;
+
+                if (cached)
+                {
+                    std::vector<control_block*> blocks;
+                    cached->drain(blocks);
+
+                    for (control_block* block : blocks)
+                        detail::free_block(block);
+                }
+
+                while (m_free_blocks != nullptr)
+                {
+                    control_block* next = m_free_blocks->m_next;
+                    detail::free_block(m_free_blocks);
+                    m_free_blocks = next;
+                }
+                m_free_block_count = 0;
             }
 
-            /// @copydoc resource_pool::unused_resources()
-            std::size_t unused_resources() const
+            /// Constructs a new value
+            /// @param block If not nullptr and the pool constructs the
+            ///        values itself, a spare control block is allocated
+            ///        together with the value and stored in block.
+            value_ptr construct(control_block** block)
             {
-                lock_type lock(m_mutex);
-                return m_free_vector.size();
+                if (m_allocate)
+                    return m_allocate();
+
+                return construct_in_place(block,
+                    std::is_default_constructible<value_type>());
             }
 
-            /// This function called when a resource should be added
-            /// back into the pool
-            void recycle(const value_ptr& resource)
+            /// Constructs a new value with std::allocate_shared placing
+            /// the value and the spare control block in one chunk
+            value_ptr construct_in_place(control_block** block, std::true_type)
             {
-                if (m_recycle)
+                // The chunk only guarantees the alignment of the
+                // storage header.
+                if (alignof(value_type) > detail::storage_header_size)
                 {
-                    m_recycle(resource);
+                    return std::allocate_shared<value_type>(
+                        detail::aligned_allocator<value_type,
+                                                  alignof(value_type)>());
                 }
 
-                lock_type lock(m_mutex);
-                if (m_free_vector.size() < m_free_vector.capacity())
-                    m_free_vector.push_back(resource);
-            }
+                std::size_t block_size = 0;
+                void* spare = nullptr;
 
-        private:
+                if (block != nullptr)
+                    block_size = m_block_size.load(std::memory_order_relaxed);
+
+                value_ptr resource = std::allocate_shared<value_type>(
+                    detail::chunk_allocator<value_type>(block_size, &spare));
 
-            using control_block_ptr = void*;
+                if (block != nullptr)
+                    *block = static_cast<control_block*>(spare);
+
+                return resource;
+            }
+
+            /// Only pools of default constructible values are created
+            /// without an allocate function
+            value_ptr construct_in_place(control_block**, std::false_type)
+            {
+                assert(0 && "No allocate function");
+                return value_ptr();
+            }
 
             template <class T>
             struct SimpleAllocator {
                 typedef T value_type;
 
-                SimpleAllocator(bool should_take_cached, const std::weak_ptr<impl>& pool)
-                    : m_should_take_cached(should_take_cached)
-                    , m_pool_weak_ptr(pool)
+                SimpleAllocator(control_block* block, const pool_pointer& pool)
+                    : m_block(block)
+                    , m_pool(pool)
                 {}
 
-                template <class U> 
+                template <class U>
                 SimpleAllocator(const SimpleAllocator<U>& other)
-                    : m_should_take_cached(other.m_should_take_cached)
-                    , m_pool_weak_ptr(other.m_pool_weak_ptr)
+                    : m_block(other.m_block)
+                    , m_pool(other.m_pool)
                 {}
 
-                T* allocate(std::size_t n) 
+                T* allocate(std::size_t n)
                 {
+                    // The cached block was handed to us by
+                    // impl::allocate() while it held the lock, all
+                    // blocks have the same size since the
+                    // std::shared_ptr<T> always rebinds to the same
+                    // control block type.
+                    if (m_block != nullptr && n == 1)
                     {
-                        auto pool = m_pool_weak_ptr.lock();
-                        if (m_should_take_cached && pool && !pool->m_free_vector_control_blocks.empty())
-                        {
-                            auto result = pool->m_free_vector_control_blocks.back();
-                            pool->m_free_vector_control_blocks.pop_back();
-                            return (T*)result;
-                        }
+                        T* result = reinterpret_cast<T*>(m_block);
+                        m_block = nullptr;
+                        return result;
+                    }
+
+                    // Remember the block size so that later misses
+                    // can allocate a spare block with the value
+                    auto pool = lifetime_policy::lock(m_pool);
+                    if (pool && n == 1)
+                    {
+                        pool->m_block_size.store(
+                            sizeof(T), std::memory_order_relaxed);
                     }
 
-                    return (T*)std::malloc(n * sizeof(T));
+                    return static_cast<T*>(
+                        detail::allocate_block(n * sizeof(T)));
                 }
 
-                void deallocate(T* p, std::size_t)
+                void deallocate(T* p, std::size_t n)
                 {
-                    {
-                        auto pool = m_pool_weak_ptr.lock();
-                        if (pool) {
-                            lock_type lock(pool->m_mutex);
-                            if (pool->m_free_vector_control_blocks.size() < pool->m_free_vector_control_blocks.capacity())
-                            {
-                                pool->m_free_vector_control_blocks.push_back(p);
-                                return;
-                            }
-                        }
-                    }
+                    // The block must be able to hold the intrusive
+                    // free list link
+                    assert(sizeof(T) >= sizeof(control_block));
+
+                    auto pool = lifetime_policy::lock(m_pool);
 
-                    std::free(p);
+                    if (pool)
+                        pool->count_outstanding(-1);
+
+                    if (n == 1 && pool && pool->recycle_block(p))
+                        return;
+
+                    detail::free_block(p);
                 }
 
-                const bool m_should_take_cached;
-                std::weak_ptr<impl> m_pool_weak_ptr;
+                control_block* m_block;
+                pool_pointer m_pool;
+            };
+
+            /// The optional state of the pool. It is created the first
+            /// time a feature is configured or needs it, so that an
+            /// idle pool using none only costs a null pointer.
+            struct extras
+            {
+                /// The footprint function
+                footprint_function m_footprint;
+
+                /// The largest footprint kept
+                std::size_t m_max_footprint = 0;
+
+                /// The shrink function
+                shrink_function m_shrink;
+
+                /// The reconfigure function
+                reconfigure_function m_reconfigure;
+
+                /// The number of unused resources reserved for high
+                /// priority allocations
+                std::size_t m_reserved = 0;
+
+                /// Index of the free list by key, created the first
+                /// time a resource allocated with a key is recycled
+                std::unique_ptr<key_index> m_key_index;
+
+                /// The construction limit, if any
+                std::unique_ptr<throttle> m_throttle;
+
+                /// The adaptive per-CPU cache state, if enabled
+                std::unique_ptr<adaptive> m_adaptive;
+
+                /// The capacity tuning state, if enabled
+                std::unique_ptr<tuning> m_tuning;
+
+                /// The tenants with a quota, if any
+                std::unique_ptr<tenant_table> m_tenants;
+
+                /// The trace recorder, if any
+                std::shared_ptr<trace_recorder> m_trace;
+
+                /// The parent pool, if any
+                std::unique_ptr<parent_link> m_parent;
+
+                /// The parallel destruction, if enabled
+                std::unique_ptr<destruction> m_destruction;
+
+                /// The restored snapshot, if resources remain in it
+                std::shared_ptr<snapshot> m_snapshot;
+
+                /// The soft trimming, if enabled
+                std::unique_ptr<soft_trim> m_soft_trim;
+
+                /// Per-CPU stacks of unused resources, created the
+                /// first time the per-CPU cache is enabled
+                std::unique_ptr<cpu_cache<entry>> m_cpu_resources;
+
+                /// Per-CPU stacks of unused control blocks
+                std::unique_ptr<cpu_cache<control_block*>> m_cpu_blocks;
             };
 
+            /// @return The optional state, nullptr if not created yet
+            extras* find_extras() const
+            {
+                return m_extras.load(std::memory_order_acquire);
+            }
+
+            /// @return The optional state, an empty one if not created
+            ///         yet. Use make_extras() to change it.
+            const extras& get_extras() const
+            {
+                static const extras none;
+
+                const extras* state = find_extras();
+                return state != nullptr ? *state : none;
+            }
+
+            /// @return The optional state, created if needed. Threads
+            ///         may read it without the lock, so it is published
+            ///         once and never replaced while the pool is shared.
+            extras& make_extras()
+            {
+                extras* state = find_extras();
+
+                if (state == nullptr)
+                {
+                    extras* created = new extras();
+
+                    if (m_extras.compare_exchange_strong(
+                            state, created, std::memory_order_acq_rel))
+                    {
+                        state = created;
+                    }
+                    else
+                    {
+                        delete created;
+                    }
+                }
+
+                return *state;
+            }
+
             /// The allocator to use
             allocate_function m_allocate;
 
             /// The recycle function
             recycle_function m_recycle;
 
-            /// Stores all the free resources
-            std::vector<value_ptr> m_free_vector;
+            /// The number of reuses before a resource is retired, zero
+            /// for no limit
+            uint32_t m_max_reuses = 0;
+
+            /// Whether the unused resources are leaked at exit
+            bool m_leak_on_exit = false;
+
+            /// The maximum number of unused resources and control
+            /// blocks kept in the pool
+            std::size_t m_capacity;
+
+            /// Stores all the free resources. The vector grows on
+            /// demand so that an idle pool only costs the size of
+            /// the impl object.
+            std::vector<entry> m_free_vector;
+
+            /// Head of the intrusive list of unused control blocks
+            control_block* m_free_blocks = nullptr;
 
-            std::vector<control_block_ptr> m_free_vector_control_blocks;
+            /// The number of control blocks in the list
+            std::size_t m_free_block_count = 0;
+
+            /// The size of a control block, zero until the first
+            /// block has been allocated
+            std::atomic<std::size_t> m_block_size{0};
+
+            /// Whether the per-CPU stacks are used
+            std::atomic<bool> m_cpu_cache_enabled{false};
+
+            /// The optional state, owned by the pool
+            std::atomic<extras*> m_extras{nullptr};
+
+            /// The number of allocated objects, used to check the
+            /// contract of the pool_outlives_objects_policy
+            std::atomic<std::size_t> m_outstanding{0};
 
             /// Mutex used to coordinate access to the pool. We had to
             /// make it mutable as we have to lock in the
@@ -387,14 +3715,18 @@ namespace recycle
         /// object contained it will call the operator() define here.
         struct deleter
         {
-            /// @param pool. A weak_ptr to the pool
-            deleter(const std::weak_ptr<impl>& pool,
-                    const value_ptr& resource) :
+            /// The back-pointer to the pool
+            using pool_pointer =
+                typename lifetime_policy::template pointer_type<impl>;
+
+            /// @param pool. A back-pointer to the pool, a weak_ptr
+            ///        unless the pool_outlives_objects_policy is used
+            deleter(const pool_pointer& pool, entry resource) :
                 m_pool(pool),
-                m_resource(resource)
+                m_resource(std::move(resource))
             {
-                assert(!m_pool.expired());
-                assert(m_resource);
+                assert(lifetime_policy::lock(m_pool));
+                assert(m_resource.m_resource);
             }
 
             /// Call operator called by std::shared_ptr<T> when
@@ -402,11 +3734,11 @@ namespace recycle
             void operator()(value_type*)
             {
                 // Place the resource in the free list
-                auto pool = m_pool.lock();
+                auto pool = lifetime_policy::lock(m_pool);
 
                 if (pool)
                 {
-                    pool->recycle(m_resource);
+                    pool->recycle(std::move(m_resource));
                 }
 
                 // This reset() is needed because otherwise a circular
@@ -464,18 +3796,25 @@ namespace recycle
                 //
                 // By calling reset on the shared_ptr in the custom deleter
                 // we break the cyclic dependency.
-                m_resource.reset();
+                m_resource.m_resource.reset();
             }
 
             // Pointer to the pool needed for recycling
-            std::weak_ptr<impl> m_pool;
+            pool_pointer m_pool;
 
-            // The resource object
-            value_ptr m_resource;
+            // The resource object and its bookkeeping
+            entry m_resource;
         };
 
     private:
 
+        /// The scope attaches itself to the pool impl
+        friend class pool_scope;
+
+        /// Pools link to the impl of their parent
+        template<class, class, class>
+        friend class resource_pool;
+
         // The pool impl
         std::shared_ptr<impl> m_pool;
     };
@@ -0,0 +1,225 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define RECYCLE_SCRUB_X86 1
+#else
+#define RECYCLE_SCRUB_X86 0
+#endif
+
+namespace recycle
+{
+    /// The instruction sets used to scrub memory
+    enum class scrub_isa
+    {
+        scalar,
+        avx2,
+        avx512
+    };
+
+    namespace detail
+    {
+        /// Ranges smaller than this are cleared with std::memset().
+        /// Non-temporal stores bypass the cache, which only pays off
+        /// when the range would evict data the caller still needs.
+        const std::size_t scrub_stream_threshold = 32 * 1024;
+
+#if RECYCLE_SCRUB_X86
+        /// Zero a range with 32 byte non-temporal stores
+        __attribute__((target("avx2")))
+        inline void stream_zero_avx2(uint8_t* data, std::size_t size)
+        {
+            // Stores must be aligned, the head and tail are cleared
+            // with std::memset()
+            std::size_t head =
+                (32 - (reinterpret_cast<uintptr_t>(data) & 31)) & 31;
+            std::memset(data, 0, head);
+            data += head;
+            size -= head;
+
+            const __m256i zero = _mm256_setzero_si256();
+            std::size_t blocks = size / 32;
+
+            for (std::size_t i = 0; i < blocks; ++i)
+            {
+                _mm256_stream_si256(
+                    reinterpret_cast<__m256i*>(data + i * 32), zero);
+            }
+
+            // Order the stores before the buffer is handed out again
+            _mm_sfence();
+            std::memset(data + blocks * 32, 0, size - blocks * 32);
+        }
+
+        /// Zero a range with 64 byte non-temporal stores
+        __attribute__((target("avx512f")))
+        inline void stream_zero_avx512(uint8_t* data, std::size_t size)
+        {
+            std::size_t head =
+                (64 - (reinterpret_cast<uintptr_t>(data) & 63)) & 63;
+            std::memset(data, 0, head);
+            data += head;
+            size -= head;
+
+            const __m512i zero = _mm512_setzero_si512();
+            std::size_t blocks = size / 64;
+
+            for (std::size_t i = 0; i < blocks; ++i)
+            {
+                _mm512_stream_si512(
+                    reinterpret_cast<__m512i*>(data + i * 64), zero);
+            }
+
+            _mm_sfence();
+            std::memset(data + blocks * 64, 0, size - blocks * 64);
+        }
+#endif
+
+        /// @return The best instruction set supported by the CPU
+        inline scrub_isa detect_scrub_isa()
+        {
+#if RECYCLE_SCRUB_X86
+            __builtin_cpu_init();
+
+            if (__builtin_cpu_supports("avx512f"))
+                return scrub_isa::avx512;
+
+            if (__builtin_cpu_supports("avx2"))
+                return scrub_isa::avx2;
+#endif
+            return scrub_isa::scalar;
+        }
+
+        /// Zero a range with the given instruction set
+        inline void scrub(void* data, std::size_t size, scrub_isa isa)
+        {
+            uint8_t* bytes = static_cast<uint8_t*>(data);
+
+#if RECYCLE_SCRUB_X86
+            if (size >= scrub_stream_threshold)
+            {
+                switch (isa)
+                {
+                case scrub_isa::avx512:
+                    stream_zero_avx512(bytes, size);
+                    return;
+                case scrub_isa::avx2:
+                    stream_zero_avx2(bytes, size);
+                    return;
+                case scrub_isa::scalar:
+                    break;
+                }
+            }
+#else
+            (void) isa;
+#endif
+            std::memset(bytes, 0, size);
+        }
+    }
+
+    /// @return The instruction set used by scrub(), detected the first
+    ///         time it is called
+    inline scrub_isa scrub_level()
+    {
+        static const scrub_isa isa = detail::detect_scrub_isa();
+        return isa;
+    }
+
+    /// Zero a memory range, e.g. a buffer handed to another tenant.
+    /// Large ranges are cleared with AVX-512 or AVX2 non-temporal
+    /// stores when the CPU supports them, since clearing them would
+    /// otherwise evict the working set from the cache. Small ranges,
+    /// and all ranges on other CPUs, are cleared with std::memset().
+    inline void scrub(void* data, std::size_t size)
+    {
+        detail::scrub(data, size, scrub_level());
+    }
+
+    namespace detail
+    {
+        /// Picks the most precise way a buffer supports, the higher
+        /// rank is preferred
+        template<int Rank>
+        struct scrub_rank : scrub_rank<Rank - 1>
+        { };
+
+        template<>
+        struct scrub_rank<0>
+        { };
+
+        /// Clears the ranges written, if the buffer keeps track of
+        /// them, and forgets the writes
+        template<class Buffer>
+        auto scrub_dirty(Buffer& buffer, scrub_rank<2>) ->
+            decltype(buffer.clear_dirty())
+        {
+            uint8_t* data = buffer.data();
+
+            buffer.for_each_dirty_range(
+                [data](std::size_t offset, std::size_t size)
+                { recycle::scrub(data + offset, size); });
+
+            buffer.clear_dirty();
+        }
+
+        /// Clears up to the high water mark, if the buffer has one
+        template<class Buffer>
+        auto scrub_dirty(Buffer& buffer, scrub_rank<1>) ->
+            decltype(void(std::size_t(buffer.dirty_size())))
+        {
+            std::size_t size = buffer.dirty_size();
+
+            if (size > 0)
+                recycle::scrub(buffer.data(), size);
+        }
+
+        template<class Buffer>
+        void scrub_dirty(Buffer& buffer, scrub_rank<0>)
+        {
+            std::size_t size = buffer.size() * sizeof(*buffer.data());
+
+            if (size > 0)
+                recycle::scrub(buffer.data(), size);
+        }
+    }
+
+    /// Zero the content of a buffer with data() and size(), e.g.
+    /// std::vector<uint8_t>. If the buffer keeps track of the parts
+    /// written, only those are cleared: a buffer with
+    /// for_each_dirty_range() and clear_dirty(), e.g. a
+    /// recycle::dirty_buffer, has the ranges written cleared and then
+    /// forgotten, and a buffer with dirty_size() has that many bytes
+    /// from the start cleared.
+    template<class Buffer>
+    void scrub_buffer(Buffer& buffer)
+    {
+        detail::scrub_dirty(buffer, detail::scrub_rank<2>());
+    }
+
+    /// A recycle function for pools of buffers zeroing each buffer
+    /// when it is recycled, see scrub_buffer().
+    ///
+    /// Example:
+    ///
+    ///     recycle::resource_pool<std::vector<uint8_t>> pool(
+    ///         [] { return std::make_shared<std::vector<uint8_t>>(4096); },
+    ///         recycle::scrub_recycle());
+    struct scrub_recycle
+    {
+        template<class BufferPtr>
+        void operator()(const BufferPtr& buffer) const
+        {
+            scrub_buffer(*buffer);
+        }
+    };
+}
@@ -0,0 +1,283 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+namespace recycle
+{
+    /// The events recorded by the recycle::trace_recorder
+    enum class trace_event_type : uint8_t
+    {
+        /// An allocation served from the unused resources
+        hit = 0,
+
+        /// An allocation which constructed a new resource
+        miss = 1,
+
+        /// A resource was released and kept by the pool
+        release = 2,
+
+        /// A resource was released and destroyed, e.g. since the pool
+        /// was full
+        drop = 3
+    };
+
+    /// An event in a trace
+    struct trace_event
+    {
+        /// The time of the event in nanoseconds since the recorder was
+        /// created
+        uint64_t m_time;
+
+        /// Identifies the resource, the same resource has the same id
+        /// while it is owned by the pool
+        uint64_t m_object;
+
+        /// What happened
+        trace_event_type m_type;
+    };
+
+    /// @brief Records the allocations and releases of a pool.
+    ///
+    /// The events are kept in a fixed size ring buffer in memory, so
+    /// the recorder keeps the most recent events and its memory use
+    /// is bounded. Each event is stored in 16 bytes. Recording is
+    /// lock-free and can be done from any thread.
+    ///
+    /// The trace can be written to a compact binary file and replayed
+    /// against other pool configurations with the recycle_replay
+    /// program.
+    ///
+    /// Example:
+    ///
+    ///     auto recorder = std::make_shared<recycle::trace_recorder>(1 << 20);
+    ///     pool.set_trace_recorder(recorder);
+    ///     ...
+    ///     std::ofstream file("pool.trace", std::ios::binary);
+    ///     recorder->write(file);
+    ///
+    class trace_recorder
+    {
+    public:
+
+        /// The clock used for the time stamps
+        using clock_type = std::chrono::steady_clock;
+
+    public:
+
+        /// Create a recorder
+        /// @param capacity The number of most recent events kept
+        trace_recorder(std::size_t capacity) :
+            m_capacity(capacity),
+            m_slots(new slot[capacity]),
+            m_start(clock_type::now())
+        {
+            assert(m_capacity > 0);
+        }
+
+        trace_recorder(const trace_recorder&) = delete;
+        trace_recorder& operator=(const trace_recorder&) = delete;
+
+        /// Record an event
+        /// @param type What happened
+        /// @param object The address of the resource
+        void record(trace_event_type type, const void* object)
+        {
+            uint64_t time = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    clock_type::now() - m_start).count());
+
+            uint64_t index = m_next.fetch_add(1, std::memory_order_relaxed);
+            slot& s = m_slots[index % m_capacity];
+
+            // The object address and the type share a word, addresses
+            // fit in 56 bits on all common platforms
+            uint64_t address = static_cast<uint64_t>(
+                reinterpret_cast<uintptr_t>(object));
+
+            s.m_time.store(time, std::memory_order_relaxed);
+            s.m_object.store((address << 8) | static_cast<uint8_t>(type),
+                             std::memory_order_relaxed);
+        }
+
+        /// @return The number of events recorded, including the ones
+        ///         overwritten
+        uint64_t recorded() const
+        {
+            return m_next.load(std::memory_order_relaxed);
+        }
+
+        /// @return The maximum number of events kept
+        std::size_t capacity() const
+        {
+            return m_capacity;
+        }
+
+        /// @return The events kept, the oldest first. Events recorded
+        ///         while reading may be mixed in.
+        std::vector<trace_event> events() const
+        {
+            uint64_t next = recorded();
+            uint64_t first = next > m_capacity ? next - m_capacity : 0;
+
+            std::vector<trace_event> events;
+            events.reserve(static_cast<std::size_t>(next - first));
+
+            for (uint64_t i = first; i < next; ++i)
+            {
+                const slot& s = m_slots[i % m_capacity];
+                uint64_t word = s.m_object.load(std::memory_order_relaxed);
+
+                trace_event event;
+                event.m_time = s.m_time.load(std::memory_order_relaxed);
+                event.m_object = word >> 8;
+                event.m_type = static_cast<trace_event_type>(word & 0xff);
+                events.push_back(event);
+            }
+
+            return events;
+        }
+
+        /// Write the events kept to a binary stream, see read_trace()
+        void write(std::ostream& out) const
+        {
+            write_trace(out, events());
+        }
+
+        /// Write events to a binary stream. The format is a header
+        /// with a magic string, a version and the number of events,
+        /// followed by the events in 16 bytes each. Integers are
+        /// stored in little-endian byte order.
+        static void write_trace(std::ostream& out,
+                                const std::vector<trace_event>& events)
+        {
+            out.write(magic(), magic_size);
+            write_u64(out, version);
+            write_u64(out, events.size());
+
+            for (const trace_event& event : events)
+            {
+                write_u64(out, event.m_time);
+                write_u64(out, (event.m_object << 8) |
+                          static_cast<uint8_t>(event.m_type));
+            }
+        }
+
+        /// Read events written with write()
+        /// @param events Assigned the events
+        /// @return false if the stream does not hold a valid trace
+        static bool read_trace(std::istream& in,
+                               std::vector<trace_event>& events)
+        {
+            char header[magic_size];
+            in.read(header, magic_size);
+
+            if (!in || std::memcmp(header, magic(), magic_size) != 0)
+                return false;
+
+            uint64_t file_version = 0;
+            uint64_t count = 0;
+
+            if (!read_u64(in, file_version) || file_version != version)
+                return false;
+
+            if (!read_u64(in, count))
+                return false;
+
+            events.clear();
+
+            for (uint64_t i = 0; i < count; ++i)
+            {
+                uint64_t time = 0;
+                uint64_t word = 0;
+
+                if (!read_u64(in, time) || !read_u64(in, word))
+                    return false;
+
+                trace_event event;
+                event.m_time = time;
+                event.m_object = word >> 8;
+                event.m_type = static_cast<trace_event_type>(word & 0xff);
+
+                if (event.m_type > trace_event_type::drop)
+                    return false;
+
+                events.push_back(event);
+            }
+
+            return true;
+        }
+
+    private:
+
+        /// The size of the magic string
+        static const std::size_t magic_size = 8;
+
+        /// The version of the file format
+        static const uint64_t version = 1;
+
+        /// @return The magic string starting a trace file
+        static const char* magic()
+        {
+            return "RCYTRACE";
+        }
+
+        static void write_u64(std::ostream& out, uint64_t value)
+        {
+            char bytes[8];
+            for (std::size_t i = 0; i < 8; ++i)
+                bytes[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+
+            out.write(bytes, 8);
+        }
+
+        static bool read_u64(std::istream& in, uint64_t& value)
+        {
+            char bytes[8];
+            in.read(bytes, 8);
+
+            if (!in)
+                return false;
+
+            value = 0;
+            for (std::size_t i = 0; i < 8; ++i)
+                value |= uint64_t(static_cast<uint8_t>(bytes[i])) << (8 * i);
+
+            return true;
+        }
+
+    private:
+
+        /// An event, stored in two words so it can be written without
+        /// a lock
+        struct slot
+        {
+            std::atomic<uint64_t> m_time{0};
+            std::atomic<uint64_t> m_object{0};
+        };
+
+        /// The number of events kept
+        const std::size_t m_capacity;
+
+        /// The ring buffer
+        std::unique_ptr<slot[]> m_slots;
+
+        /// The index of the next event
+        std::atomic<uint64_t> m_next{0};
+
+        /// When the recorder was created
+        clock_type::time_point m_start;
+    };
+}
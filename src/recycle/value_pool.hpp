@@ -0,0 +1,275 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "no_locking_policy.hpp"
+
+namespace recycle
+{
+    namespace detail
+    {
+        /// Calls value.clear() if the value type has a clear()
+        /// member, e.g. std::string or std::vector<T>
+        template<class T>
+        auto clear_value(T& value, int) -> decltype(value.clear(), void())
+        {
+            value.clear();
+        }
+
+        /// Fallback for value types without a clear() member
+        template<class T>
+        void clear_value(T&, long)
+        { }
+    }
+
+    /// @brief The value pool stores movable values and recycles them.
+    ///
+    /// Where the recycle::resource_pool hands out std::shared_ptr's,
+    /// the value pool hands out the values themselves. This is useful
+    /// for small movable types such as std::string or std::vector<T>
+    /// where the expensive part is the heap memory they own, not the
+    /// object itself. A value given back to the pool keeps its
+    /// memory, so the next value taken from the pool can reuse it.
+    ///
+    /// The unused values are stored in a contiguous array and no
+    /// control blocks are involved.
+    ///
+    /// Example:
+    ///
+    ///     recycle::value_pool<std::vector<uint8_t>> pool;
+    ///
+    ///     std::vector<uint8_t> buffer = pool.take();
+    ///     buffer.resize(1500);
+    ///     ...
+    ///     pool.give(std::move(buffer));
+    ///
+    template<class Value, class LockingPolicy = no_locking_policy>
+    class value_pool
+    {
+    public:
+
+        /// The type managed
+        using value_type = Value;
+
+        /// The allocate function type
+        /// Should take no arguments and return a new value
+        using allocate_function = std::function<value_type()>;
+
+        /// The recycle function type
+        /// If specified the recycle function will be called every time a
+        /// value is given back to the pool. If not specified values with
+        /// a clear() member function are cleared.
+        using recycle_function = std::function<void(value_type&)>;
+
+        /// The footprint function type
+        /// Should return the footprint of a value, e.g. its capacity
+        using footprint_function = std::function<std::size_t(const value_type&)>;
+
+        /// The locking policy mutex type
+        using mutex_type = typename LockingPolicy::mutex_type;
+
+        /// The locking policy lock type
+        using lock_type = typename LockingPolicy::lock_type;
+
+        /// The default maximum number of unused values kept in the
+        /// pool
+        static const std::size_t DEFAULT_CAPACITY = 10000;
+
+    public:
+
+        /// Default constructor, only available if the value_type is
+        /// default constructible. See the recycle::resource_pool for
+        /// details.
+        template
+        <
+            class T = Value,
+            typename std::enable_if<
+                std::is_default_constructible<T>::value, uint8_t>::type = 0
+        >
+        value_pool(std::size_t capacity = DEFAULT_CAPACITY) :
+            m_pool(new impl([]() { return T(); }, recycle_function(), capacity))
+        { }
+
+        /// Create a value pool using a specific allocate function.
+        /// @param allocate Allocation function
+        value_pool(allocate_function allocate,
+                   std::size_t capacity = DEFAULT_CAPACITY) :
+            m_pool(new impl(std::move(allocate), recycle_function(), capacity))
+        { }
+
+        /// Create a value pool using a specific allocate function and
+        /// recycle function.
+        /// @param allocate Allocation function
+        /// @param recycle Recycle function
+        value_pool(allocate_function allocate, recycle_function recycle,
+                   std::size_t capacity = DEFAULT_CAPACITY) :
+            m_pool(new impl(std::move(allocate), std::move(recycle), capacity))
+        { }
+
+        /// The value pool owns values not shared with anybody, so it
+        /// is not copyable
+        value_pool(const value_pool&) = delete;
+        value_pool& operator=(const value_pool&) = delete;
+
+        /// Move constructor
+        value_pool(value_pool&& other) = default;
+
+        /// Move assignment
+        value_pool& operator=(value_pool&& other) = default;
+
+        /// Drop values given back to the pool whose footprint exceeds a
+        /// limit. This avoids that a value which once grew very large,
+        /// e.g. a buffer used for a giant message, keeps its memory
+        /// forever.
+        ///
+        /// Must be called before the pool is shared between threads.
+        /// @param footprint Returns the footprint of a value
+        /// @param max_footprint The largest footprint kept
+        void set_footprint_limit(footprint_function footprint,
+                                 std::size_t max_footprint)
+        {
+            assert(m_pool);
+            assert(footprint);
+
+            m_pool->m_footprint = std::move(footprint);
+            m_pool->m_max_footprint = max_footprint;
+        }
+
+        /// @return A value from the pool, or a new value if the pool is
+        ///         empty
+        value_type take()
+        {
+            assert(m_pool);
+
+            {
+                lock_type lock(m_pool->m_mutex);
+
+                if (!m_pool->m_free_vector.empty())
+                {
+                    value_type value = std::move(m_pool->m_free_vector.back());
+                    m_pool->m_free_vector.pop_back();
+                    return value;
+                }
+            }
+
+            assert(m_pool->m_allocate);
+            return m_pool->m_allocate();
+        }
+
+        /// Give a value back to the pool
+        /// @param value The value, always moved from
+        void give(value_type&& value)
+        {
+            assert(m_pool);
+
+            value_type unused = std::move(value);
+
+            // The recycle function and the footprint are evaluated
+            // without holding the lock.
+            if (m_pool->m_recycle)
+            {
+                m_pool->m_recycle(unused);
+            }
+            else
+            {
+                detail::clear_value(unused, 0);
+            }
+
+            if (m_pool->m_footprint &&
+                m_pool->m_footprint(unused) > m_pool->m_max_footprint)
+            {
+                return;
+            }
+
+            lock_type lock(m_pool->m_mutex);
+
+            if (m_pool->m_free_vector.size() < m_pool->m_capacity)
+                m_pool->m_free_vector.push_back(std::move(unused));
+        }
+
+        /// @returns the number of unused values
+        std::size_t unused_resources() const
+        {
+            assert(m_pool);
+
+            lock_type lock(m_pool->m_mutex);
+            return m_pool->m_free_vector.size();
+        }
+
+        /// @returns the maximum number of unused values kept
+        std::size_t capacity() const
+        {
+            assert(m_pool);
+            return m_pool->m_capacity;
+        }
+
+        /// @return The mutex of the pool, e.g. to read the statistics
+        ///         of the recycle::profiled_locking_policy
+        const mutex_type& mutex() const
+        {
+            assert(m_pool);
+            return m_pool->m_mutex;
+        }
+
+        /// Frees all unused values
+        void free_unused()
+        {
+            assert(m_pool);
+
+            lock_type lock(m_pool->m_mutex);
+            m_pool->m_free_vector.clear();
+            m_pool->m_free_vector.shrink_to_fit();
+        }
+
+    private:
+
+        /// The pool state, kept on the heap to make the pool movable
+        /// even if the mutex is not
+        struct impl
+        {
+            impl(allocate_function allocate, recycle_function recycle,
+                 std::size_t capacity) :
+                m_allocate(std::move(allocate)),
+                m_recycle(std::move(recycle)),
+                m_capacity(capacity)
+            {
+                assert(m_allocate);
+            }
+
+            /// The allocator to use
+            allocate_function m_allocate;
+
+            /// The recycle function
+            recycle_function m_recycle;
+
+            /// The footprint function
+            footprint_function m_footprint;
+
+            /// The largest footprint kept
+            std::size_t m_max_footprint = 0;
+
+            /// The maximum number of unused values
+            const std::size_t m_capacity;
+
+            /// Stores all the unused values
+            std::vector<value_type> m_free_vector;
+
+            /// Mutex used to coordinate access to the pool
+            mutable mutex_type m_mutex;
+        };
+
+        /// The pool impl
+        std::unique_ptr<impl> m_pool;
+    };
+}
@@ -0,0 +1,55 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/async_resource_pool.hpp>
+#include <recycle/resource_pool.hpp>
+#include <recycle/value_pool.hpp>
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Compiled with exceptions disabled to check that the pools build
+// without them. The explicit instantiations compile every member
+// function, also those not called below.
+namespace
+{
+    struct object
+    {
+        int m_value = 0;
+    };
+
+    struct lock_policy
+    {
+        using mutex_type = std::mutex;
+        using lock_type = std::lock_guard<mutex_type>;
+    };
+}
+
+template class recycle::resource_pool<object>;
+template class recycle::resource_pool<object, lock_policy>;
+template class recycle::value_pool<std::vector<uint8_t>>;
+template class recycle::value_pool<std::vector<uint8_t>, lock_policy>;
+template class recycle::async_resource_pool<object, lock_policy>;
+
+int main()
+{
+    recycle::resource_pool<object, lock_policy> pool;
+    auto resource = pool.allocate();
+    resource.reset();
+    pool.free_unused_async().wait();
+
+    recycle::value_pool<std::vector<uint8_t>> values;
+    values.give(values.take());
+
+    recycle::async_resource_pool<object, lock_policy> async_pool(
+        []() { return std::async(std::launch::async,
+                                 []() { return std::make_shared<object>(); }); });
+    async_pool.allocate();
+
+    return 0;
+}
@@ -0,0 +1,37 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/allocate_result.hpp>
+
+#include <memory>
+
+#include <gtest/gtest.h>
+
+/// Test a successful result
+TEST(test_allocate_result, value)
+{
+    auto p = std::make_shared<int>(42);
+    recycle::allocate_result<std::shared_ptr<int>> result(p);
+
+    EXPECT_TRUE(result.has_value());
+    EXPECT_TRUE((bool) result);
+    EXPECT_EQ(result.error(), recycle::allocate_error::none);
+    EXPECT_EQ(result.value(), p);
+    EXPECT_EQ(*result.value(), 42);
+
+    std::shared_ptr<int> moved = std::move(result.value());
+    EXPECT_EQ(moved, p);
+}
+
+/// Test a failed result
+TEST(test_allocate_result, error)
+{
+    recycle::allocate_result<std::shared_ptr<int>> result(
+        recycle::allocate_error::allocate_failed);
+
+    EXPECT_FALSE(result.has_value());
+    EXPECT_FALSE((bool) result);
+    EXPECT_EQ(result.error(), recycle::allocate_error::allocate_failed);
+}
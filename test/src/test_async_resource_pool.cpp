@@ -0,0 +1,230 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/async_resource_pool.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+    // Non default constructible dummy object
+    struct dummy_session
+    {
+        dummy_session(uint32_t id) :
+            m_id(id)
+        { }
+
+        uint32_t m_id;
+    };
+
+    // Factory completing the construction on a worker thread
+    struct worker_factory
+    {
+        std::future<std::shared_ptr<dummy_session>> operator()()
+        {
+            uint32_t id = ++(*m_started);
+            std::shared_ptr<std::atomic<uint32_t>> running = m_running;
+            std::shared_ptr<std::atomic<uint32_t>> peak = m_peak;
+
+            return std::async(std::launch::async, [id, running, peak]()
+            {
+                uint32_t now = ++(*running);
+
+                uint32_t seen = peak->load();
+                while (now > seen && !peak->compare_exchange_weak(seen, now))
+                { }
+
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                --(*running);
+
+                return std::make_shared<dummy_session>(id);
+            });
+        }
+
+        std::shared_ptr<std::atomic<uint32_t>> m_started =
+            std::make_shared<std::atomic<uint32_t>>(0);
+
+        std::shared_ptr<std::atomic<uint32_t>> m_running =
+            std::make_shared<std::atomic<uint32_t>>(0);
+
+        std::shared_ptr<std::atomic<uint32_t>> m_peak =
+            std::make_shared<std::atomic<uint32_t>>(0);
+    };
+
+    struct lock_policy
+    {
+        using mutex_type = std::mutex;
+        using lock_type = std::lock_guard<mutex_type>;
+    };
+}
+
+/// Test that resources constructed asynchronously are recycled and
+/// that unused resources are returned with a ready future
+TEST(test_async_resource_pool, api)
+{
+    worker_factory factory;
+    recycle::async_resource_pool<dummy_session> pool(factory);
+
+    EXPECT_EQ(pool.unused_resources(), 0U);
+
+    std::future<std::shared_ptr<dummy_session>> f1 = pool.allocate_async();
+    std::shared_ptr<dummy_session> s1 = f1.get();
+
+    ASSERT_TRUE((bool) s1);
+    EXPECT_EQ(s1->m_id, 1U);
+    EXPECT_EQ(factory.m_started->load(), 1U);
+
+    dummy_session* naked = s1.get();
+    s1.reset();
+    EXPECT_EQ(pool.unused_resources(), 1U);
+
+    std::future<std::shared_ptr<dummy_session>> f2 = pool.allocate_async();
+    EXPECT_EQ(f2.wait_for(std::chrono::seconds(0)),
+              std::future_status::ready);
+
+    std::shared_ptr<dummy_session> s2 = f2.get();
+    EXPECT_EQ(s2.get(), naked);
+    EXPECT_EQ(factory.m_started->load(), 1U);
+
+    // The synchronous API waits for the construction
+    std::shared_ptr<dummy_session> s3 = pool.allocate();
+    EXPECT_EQ(s3->m_id, 2U);
+
+    s2.reset();
+    s3.reset();
+    EXPECT_EQ(pool.unused_resources(), 2U);
+
+    pool.free_unused();
+    EXPECT_EQ(pool.unused_resources(), 0U);
+}
+
+/// Test that constructions requested in a row are in flight at the
+/// same time
+TEST(test_async_resource_pool, pipelined)
+{
+    worker_factory factory;
+    recycle::async_resource_pool<dummy_session> pool(factory);
+
+    std::vector<std::future<std::shared_ptr<dummy_session>>> pending;
+
+    for (uint32_t i = 0; i < 4; ++i)
+        pending.push_back(pool.allocate_async());
+
+    EXPECT_EQ(factory.m_started->load(), 4U);
+
+    std::vector<std::shared_ptr<dummy_session>> sessions;
+    for (auto& f : pending)
+        sessions.push_back(f.get());
+
+    EXPECT_GT(factory.m_peak->load(), 1U);
+
+    sessions.clear();
+    EXPECT_EQ(pool.unused_resources(), 4U);
+}
+
+/// Test that the future returned on a miss becomes ready without
+/// waiting for it, so it can be polled
+TEST(test_async_resource_pool, poll)
+{
+    worker_factory factory;
+    recycle::async_resource_pool<dummy_session> pool(factory);
+
+    std::future<std::shared_ptr<dummy_session>> pending =
+        pool.allocate_async();
+
+    uint32_t polls = 0;
+    while (pending.wait_for(std::chrono::seconds(0)) !=
+           std::future_status::ready)
+    {
+        ASSERT_LT(polls, 10000U);
+        ++polls;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::shared_ptr<dummy_session> s1 = pending.get();
+    ASSERT_TRUE((bool) s1);
+    EXPECT_EQ(s1->m_id, 1U);
+
+    // A dropped future still hands the resource to the pool
+    pool.allocate_async();
+    EXPECT_EQ(factory.m_started->load(), 2U);
+    EXPECT_EQ(pool.unused_resources(), 1U);
+
+    s1.reset();
+    EXPECT_EQ(pool.unused_resources(), 2U);
+}
+
+/// Test that a pending construction keeps the pool alive
+TEST(test_async_resource_pool, pool_dies_first)
+{
+    worker_factory factory;
+    std::future<std::shared_ptr<dummy_session>> pending;
+
+    {
+        recycle::async_resource_pool<dummy_session> pool(factory);
+        pending = pool.allocate_async();
+    }
+
+    std::shared_ptr<dummy_session> s1 = pending.get();
+    ASSERT_TRUE((bool) s1);
+    EXPECT_EQ(s1->m_id, 1U);
+}
+
+/// Test that a factory resolving to a null resource fails the future
+/// instead of constructing synchronously
+TEST(test_async_resource_pool, null_resource)
+{
+    uint32_t calls = 0;
+    recycle::async_resource_pool<dummy_session> pool([&calls]()
+    {
+        ++calls;
+        std::promise<std::shared_ptr<dummy_session>> empty;
+        empty.set_value(nullptr);
+        return empty.get_future();
+    });
+
+    std::future<std::shared_ptr<dummy_session>> pending =
+        pool.allocate_async();
+
+    EXPECT_THROW(pending.get(), std::runtime_error);
+    EXPECT_EQ(calls, 1U);
+    EXPECT_EQ(pool.unused_resources(), 0U);
+}
+
+/// Test the pool using a locking policy
+TEST(test_async_resource_pool, threads)
+{
+    worker_factory factory;
+    recycle::async_resource_pool<dummy_session, lock_policy> pool(factory);
+
+    auto run = [&pool]()
+    {
+        for (uint32_t i = 0; i < 10; ++i)
+        {
+            std::shared_ptr<dummy_session> s = pool.allocate_async().get();
+            EXPECT_TRUE((bool) s);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < 4; ++i)
+        workers.emplace_back(run);
+
+    for (auto& t : workers)
+        t.join();
+
+    EXPECT_LE(pool.unused_resources(), 4U);
+    EXPECT_LE(factory.m_started->load(), 40U);
+}
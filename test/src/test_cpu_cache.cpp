@@ -0,0 +1,173 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/cpu_cache.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+TEST(test_cpu_cache, current_cpu)
+{
+    EXPECT_GT(recycle::cpu_count(), 0U);
+
+    // On Linux the CPU id is always smaller than the number of
+    // configured CPUs
+#if defined(__linux__)
+    EXPECT_LT(recycle::current_cpu(), recycle::cpu_count());
+#endif
+}
+
+TEST(test_cpu_cache, push_pop)
+{
+    // Use a single slot so the test does not depend on which CPU we
+    // are scheduled on
+    recycle::cpu_cache<std::unique_ptr<uint32_t>> cache(2, 1);
+
+    EXPECT_EQ(cache.cpus(), 1U);
+    EXPECT_EQ(cache.per_cpu_capacity(), 2U);
+    EXPECT_EQ(cache.size(), 0U);
+
+    std::unique_ptr<uint32_t> value;
+    EXPECT_FALSE(cache.pop(value));
+
+    std::unique_ptr<uint32_t> v1(new uint32_t(1));
+    std::unique_ptr<uint32_t> v2(new uint32_t(2));
+    std::unique_ptr<uint32_t> v3(new uint32_t(3));
+
+    EXPECT_TRUE(cache.push(v1));
+    EXPECT_TRUE(cache.push(v2));
+    EXPECT_FALSE(cache.push(v3));
+
+    EXPECT_FALSE((bool) v1);
+    EXPECT_FALSE((bool) v2);
+    EXPECT_TRUE((bool) v3);
+    EXPECT_EQ(cache.size(), 2U);
+
+    EXPECT_TRUE(cache.pop(value));
+    EXPECT_EQ(*value, 2U);
+
+    std::vector<std::unique_ptr<uint32_t>> drained;
+    cache.drain(drained);
+
+    EXPECT_EQ(drained.size(), 1U);
+    EXPECT_EQ(*drained[0], 1U);
+    EXPECT_EQ(cache.size(), 0U);
+}
+
+TEST(test_cpu_cache, thread)
+{
+    recycle::cpu_cache<uint32_t> cache(10);
+
+    auto run = [&cache]()
+        {
+            for (uint32_t i = 0; i < 1000; ++i)
+            {
+                uint32_t value = i;
+                if (!cache.push(value))
+                {
+                    cache.pop(value);
+                }
+            }
+        };
+
+    const uint32_t number_threads = 8;
+    std::thread t[number_threads];
+
+    for (uint32_t i = 0; i < number_threads; ++i)
+    {
+        t[i] = std::thread(run);
+    }
+
+    for (uint32_t i = 0; i < number_threads; ++i)
+    {
+        t[i].join();
+    }
+
+    EXPECT_LE(cache.size(), cache.cpus() * cache.per_cpu_capacity());
+}
+
+/// Test that no value is lost or duplicated while threads push, pop
+/// and drain concurrently
+TEST(test_cpu_cache, drain_thread)
+{
+    recycle::cpu_cache<uint32_t> cache(4);
+
+    // The restartable sequences are used on x86-64 Linux with glibc
+    // 2.35 or newer
+#if RECYCLE_HAS_RSEQ_CS
+    EXPECT_EQ(cache.restartable(), recycle::has_rseq_critical_sections());
+#else
+    EXPECT_FALSE(cache.restartable());
+#endif
+
+    const uint32_t number_threads = 4;
+    const uint32_t values_per_thread = 16;
+
+    std::vector<uint32_t> held[number_threads];
+    std::vector<uint32_t> drained;
+    std::atomic<bool> done(false);
+
+    auto run = [&cache](std::vector<uint32_t>& values)
+        {
+            for (uint32_t i = 0; i < 20000; ++i)
+            {
+                if (i % 2 == 0 && !values.empty())
+                {
+                    uint32_t value = values.back();
+                    if (cache.push(value))
+                        values.pop_back();
+                }
+                else
+                {
+                    uint32_t value;
+                    if (cache.pop(value))
+                        values.push_back(value);
+                }
+            }
+        };
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < number_threads; ++i)
+    {
+        for (uint32_t j = 0; j < values_per_thread; ++j)
+            held[i].push_back(i * values_per_thread + j);
+
+        workers.emplace_back(run, std::ref(held[i]));
+    }
+
+    std::thread drainer([&cache, &drained, &done]()
+        {
+            while (!done)
+            {
+                cache.drain(drained);
+                std::this_thread::yield();
+            }
+        });
+
+    for (auto& t : workers)
+        t.join();
+
+    done = true;
+    drainer.join();
+    cache.drain(drained);
+    EXPECT_EQ(cache.size(), 0U);
+
+    std::vector<uint32_t> all = drained;
+    for (uint32_t i = 0; i < number_threads; ++i)
+        all.insert(all.end(), held[i].begin(), held[i].end());
+
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(all.size(), number_threads * values_per_thread);
+
+    for (uint32_t i = 0; i < all.size(); ++i)
+        EXPECT_EQ(all[i], i);
+}
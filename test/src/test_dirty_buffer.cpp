@@ -0,0 +1,140 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/dirty_buffer.hpp>
+#include <recycle/resource_pool.hpp>
+#include <recycle/scrub.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+    using range = std::pair<std::size_t, std::size_t>;
+
+    std::vector<range> dirty_ranges(const recycle::dirty_buffer& buffer)
+    {
+        std::vector<range> ranges;
+        buffer.for_each_dirty_range(
+            [&ranges](std::size_t offset, std::size_t size)
+            { ranges.push_back(range(offset, size)); });
+
+        return ranges;
+    }
+}
+
+/// Test that the writes are recorded per page
+TEST(test_dirty_buffer, api)
+{
+    recycle::dirty_buffer buffer(10000, 1000);
+
+    EXPECT_EQ(buffer.size(), 10000U);
+    EXPECT_EQ(buffer.page_size(), 1000U);
+    EXPECT_EQ(buffer.dirty_size(), 0U);
+    EXPECT_EQ(buffer.dirty_pages(), 0U);
+    EXPECT_TRUE(dirty_ranges(buffer).empty());
+
+    uint8_t bytes[10] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    buffer.write(10, bytes, sizeof(bytes));
+    EXPECT_EQ(buffer.data()[10], 1);
+    EXPECT_EQ(buffer.dirty_size(), 20U);
+
+    // Spans the pages 1 and 2
+    buffer.writable(1990, 20)[0] = 0xff;
+    buffer.mark_dirty(9999, 1);
+    buffer.mark_dirty(5000, 0);
+
+    EXPECT_EQ(buffer.dirty_size(), 10000U);
+    EXPECT_EQ(buffer.dirty_pages(), 4U);
+
+    std::vector<range> expected = {range(0, 3000), range(9000, 1000)};
+    EXPECT_EQ(dirty_ranges(buffer), expected);
+
+    buffer.clear_dirty();
+    EXPECT_EQ(buffer.dirty_size(), 0U);
+    EXPECT_EQ(buffer.dirty_pages(), 0U);
+    EXPECT_TRUE(dirty_ranges(buffer).empty());
+
+    // The content is kept
+    EXPECT_EQ(buffer.data()[1990], 0xff);
+}
+
+/// Test runs of pages crossing the words of the bitmap and a last page
+/// shorter than the others
+TEST(test_dirty_buffer, ranges)
+{
+    recycle::dirty_buffer buffer(200 * 16 + 5, 16);
+
+    buffer.mark_dirty(60 * 16, 10 * 16);
+    buffer.mark_dirty(200 * 16, 5);
+
+    std::vector<range> expected = {range(60 * 16, 10 * 16),
+                                   range(200 * 16, 5)};
+    EXPECT_EQ(dirty_ranges(buffer), expected);
+    EXPECT_EQ(buffer.dirty_pages(), 11U);
+}
+
+/// Test that scrubbing clears the pages written only
+TEST(test_dirty_buffer, scrub)
+{
+    recycle::dirty_buffer buffer(64 * 1024);
+
+    std::fill(buffer.data(), buffer.data() + buffer.size(), 0xaa);
+    buffer.mark_dirty(100, 10);
+    buffer.mark_dirty(40000, 100);
+
+    recycle::scrub_buffer(buffer);
+
+    EXPECT_EQ(buffer.dirty_size(), 0U);
+    EXPECT_TRUE(std::all_of(buffer.data(), buffer.data() + 4096,
+                            [](uint8_t v) { return v == 0; }));
+    EXPECT_EQ(buffer.data()[4096], 0xaa);
+    EXPECT_EQ(buffer.data()[36864], 0);
+    EXPECT_EQ(buffer.data()[40000], 0);
+    EXPECT_EQ(buffer.data()[36864 - 1], 0xaa);
+}
+
+/// Test the recycle functions in a pool
+TEST(test_dirty_buffer, recycle)
+{
+    std::vector<range> seen;
+
+    recycle::resource_pool<recycle::dirty_buffer> pool(
+        []() { return std::make_shared<recycle::dirty_buffer>(16384); },
+        recycle::dirty_recycle(
+            [&seen](recycle::dirty_buffer& b, std::size_t offset,
+                    std::size_t size)
+            {
+                EXPECT_EQ(b.size(), 16384U);
+                seen.push_back(range(offset, size));
+            }));
+
+    auto b1 = pool.allocate();
+    b1->mark_dirty(5000, 10);
+    b1.reset();
+
+    std::vector<range> expected = {range(4096, 4096)};
+    EXPECT_EQ(seen, expected);
+
+    auto b2 = pool.allocate();
+    EXPECT_EQ(b2->dirty_size(), 0U);
+
+    recycle::resource_pool<recycle::dirty_buffer> scrubbed(
+        []() { return std::make_shared<recycle::dirty_buffer>(16384); },
+        recycle::scrub_recycle());
+
+    auto b3 = scrubbed.allocate();
+    b3->writable(0, 3)[2] = 7;
+    b3.reset();
+
+    auto b4 = scrubbed.allocate();
+    EXPECT_EQ(b4->data()[2], 0);
+    EXPECT_EQ(b4->dirty_size(), 0U);
+}
@@ -0,0 +1,43 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/lifetime_policy.hpp>
+
+#include <memory>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+    struct dummy_pool : std::enable_shared_from_this<dummy_pool>
+    { };
+}
+
+TEST(test_lifetime_policy, shared_lifetime_policy)
+{
+    using policy = recycle::shared_lifetime_policy;
+    EXPECT_FALSE(bool(policy::pool_outlives_objects));
+
+    policy::pointer_type<dummy_pool> pointer;
+
+    {
+        auto pool = std::make_shared<dummy_pool>();
+        pointer = policy::make_pointer(*pool);
+        EXPECT_EQ(policy::lock(pointer), pool);
+    }
+
+    EXPECT_FALSE((bool) policy::lock(pointer));
+}
+
+TEST(test_lifetime_policy, pool_outlives_objects_policy)
+{
+    using policy = recycle::pool_outlives_objects_policy;
+    EXPECT_TRUE(bool(policy::pool_outlives_objects));
+
+    dummy_pool pool;
+    policy::pointer_type<dummy_pool> pointer = policy::make_pointer(pool);
+
+    EXPECT_EQ(policy::lock(pointer), &pool);
+}
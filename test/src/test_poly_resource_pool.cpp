@@ -0,0 +1,261 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/poly_resource_pool.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+    // Base without a virtual destructor
+    struct dummy_base
+    {
+        dummy_base()
+        {
+            ++m_count;
+        }
+
+        ~dummy_base()
+        {
+            --m_count;
+        }
+
+        uint32_t m_uses = 0;
+
+        static int32_t m_count;
+    };
+
+    int32_t dummy_base::m_count = 0;
+
+    struct dummy_small : public dummy_base
+    {
+        uint8_t m_data[8];
+    };
+
+    struct dummy_large : public dummy_base
+    {
+        dummy_large()
+        {
+            ++m_large;
+        }
+
+        ~dummy_large()
+        {
+            --m_large;
+        }
+
+        uint8_t m_data[256];
+
+        static int32_t m_large;
+    };
+
+    int32_t dummy_large::m_large = 0;
+
+    // Types which are not counted, for use on several threads
+    struct plain_base
+    {
+        uint32_t m_value = 0;
+    };
+
+    struct plain_derived : public plain_base
+    {
+        uint32_t m_extra = 0;
+    };
+
+    // Derived type whose constructor may throw
+    struct throwing_derived : public plain_base
+    {
+        throwing_derived()
+        {
+            if (m_fail)
+                throw std::runtime_error("construction failed");
+        }
+
+        static bool m_fail;
+    };
+
+    bool throwing_derived::m_fail = false;
+
+    struct lock_policy
+    {
+        using mutex_type = std::mutex;
+        using lock_type = std::lock_guard<mutex_type>;
+    };
+}
+
+/// Test that objects are recycled per type
+TEST(test_poly_resource_pool, api)
+{
+    {
+        recycle::poly_resource_pool<dummy_base> pool;
+
+        std::shared_ptr<dummy_base> s1 = pool.allocate<dummy_small>();
+        std::shared_ptr<dummy_base> l1 = pool.allocate<dummy_large>();
+        EXPECT_EQ(dummy_base::m_count, 2);
+        EXPECT_EQ(pool.unused_resources(), 0U);
+
+        dummy_base* small = s1.get();
+        dummy_base* large = l1.get();
+
+        s1.reset();
+        l1.reset();
+        EXPECT_EQ(pool.unused_resources(), 2U);
+        EXPECT_EQ(pool.unused_resources<dummy_small>(), 1U);
+        EXPECT_EQ(pool.unused_resources<dummy_large>(), 1U);
+        EXPECT_EQ(pool.unused_bytes(),
+                  sizeof(dummy_small) + sizeof(dummy_large));
+
+        std::shared_ptr<dummy_base> l2 = pool.allocate<dummy_large>();
+        std::shared_ptr<dummy_base> s2 = pool.allocate<dummy_small>();
+        EXPECT_EQ(l2.get(), large);
+        EXPECT_EQ(s2.get(), small);
+        EXPECT_EQ(dummy_base::m_count, 2);
+
+        // Objects are destroyed through their own type
+        l2.reset();
+        pool.free_unused();
+        EXPECT_EQ(pool.unused_resources(), 0U);
+        EXPECT_EQ(dummy_large::m_large, 0);
+        EXPECT_EQ(dummy_base::m_count, 1);
+    }
+
+    EXPECT_EQ(dummy_base::m_count, 0);
+}
+
+/// Test pools using the types in a different order
+TEST(test_poly_resource_pool, type_order)
+{
+    {
+        recycle::poly_resource_pool<dummy_base> first;
+        recycle::poly_resource_pool<dummy_base> second;
+
+        first.allocate<dummy_small>().reset();
+
+        // A type never allocated from a pool has no unused objects
+        EXPECT_EQ(second.unused_resources<dummy_small>(), 0U);
+        EXPECT_EQ(first.unused_resources<dummy_large>(), 0U);
+
+        second.allocate<dummy_large>().reset();
+        second.allocate<dummy_small>().reset();
+
+        EXPECT_EQ(first.unused_resources(), 1U);
+        EXPECT_EQ(first.unused_resources<dummy_small>(), 1U);
+        EXPECT_EQ(second.unused_resources<dummy_small>(), 1U);
+        EXPECT_EQ(second.unused_resources<dummy_large>(), 1U);
+        EXPECT_EQ(dummy_large::m_large, 1);
+    }
+
+    EXPECT_EQ(dummy_base::m_count, 0);
+    EXPECT_EQ(dummy_large::m_large, 0);
+}
+
+/// Test that the capacity and memory budget are shared by the types
+TEST(test_poly_resource_pool, budget)
+{
+    {
+        recycle::poly_resource_pool<dummy_base> pool(
+            3, sizeof(dummy_large) + sizeof(dummy_small));
+
+        EXPECT_EQ(pool.capacity(), 3U);
+
+        std::vector<std::shared_ptr<dummy_base>> objects;
+        objects.push_back(pool.allocate<dummy_large>());
+        objects.push_back(pool.allocate<dummy_large>());
+        objects.push_back(pool.allocate<dummy_small>());
+        objects.push_back(pool.allocate<dummy_small>());
+
+        objects.clear();
+
+        // The second object of each type does not fit the budget
+        EXPECT_EQ(pool.unused_resources<dummy_large>(), 1U);
+        EXPECT_EQ(pool.unused_resources<dummy_small>(), 1U);
+        EXPECT_LE(pool.unused_bytes(), pool.max_bytes());
+        EXPECT_EQ(dummy_large::m_large, 1);
+    }
+
+    EXPECT_EQ(dummy_base::m_count, 0);
+}
+
+/// Test the recycle function and objects outliving the pool
+TEST(test_poly_resource_pool, recycle)
+{
+    std::shared_ptr<dummy_base> survivor;
+
+    {
+        recycle::poly_resource_pool<dummy_base> pool(
+            [](dummy_base& o) { ++o.m_uses; });
+
+        auto o1 = pool.allocate<dummy_small>();
+        o1.reset();
+
+        auto o2 = pool.allocate<dummy_small>();
+        EXPECT_EQ(o2->m_uses, 1U);
+
+        survivor = pool.allocate<dummy_large>();
+    }
+
+    EXPECT_EQ(dummy_base::m_count, 1);
+    survivor.reset();
+    EXPECT_EQ(dummy_base::m_count, 0);
+    EXPECT_EQ(dummy_large::m_large, 0);
+}
+
+/// Test the pool using a locking policy
+TEST(test_poly_resource_pool, thread)
+{
+    recycle::poly_resource_pool<plain_base, lock_policy> pool;
+
+    auto run = [&pool]()
+    {
+        for (uint32_t i = 0; i < 100; ++i)
+        {
+            auto o = pool.allocate<plain_derived>();
+            EXPECT_TRUE((bool) o);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < 4; ++i)
+        workers.emplace_back(run);
+
+    for (auto& t : workers)
+        t.join();
+
+    EXPECT_LE(pool.unused_resources(), 4U);
+}
+
+/// Test that a throwing constructor leaves the pool usable, and that
+/// each pool numbers its own types
+TEST(test_poly_resource_pool, throwing_constructor)
+{
+    recycle::poly_resource_pool<plain_base> pool;
+
+    // A released object leaves its control block cached
+    pool.allocate<plain_derived>();
+
+    throwing_derived::m_fail = true;
+    EXPECT_THROW(pool.allocate<throwing_derived>(), std::runtime_error);
+    EXPECT_THROW(pool.allocate<throwing_derived>(), std::runtime_error);
+    throwing_derived::m_fail = false;
+
+    auto o = pool.allocate<throwing_derived>();
+    EXPECT_TRUE((bool) o);
+    o.reset();
+
+    // A type first seen by another pool
+    recycle::poly_resource_pool<plain_base> other;
+    other.allocate<throwing_derived>();
+    EXPECT_EQ(other.unused_resources<throwing_derived>(), 1U);
+    EXPECT_EQ(other.unused_resources<plain_derived>(), 0U);
+    EXPECT_EQ(pool.unused_resources<throwing_derived>(), 1U);
+    EXPECT_EQ(pool.unused_resources<plain_derived>(), 1U);
+}
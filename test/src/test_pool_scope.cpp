@@ -0,0 +1,222 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/pool_scope.hpp>
+#include <recycle/profiled_locking_policy.hpp>
+#include <recycle/resource_pool.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+    // Default constructible dummy object
+    struct dummy_one
+    {
+        dummy_one()
+        {
+            ++m_count;
+        }
+
+        ~dummy_one()
+        {
+            --m_count;
+        }
+
+        static int32_t m_count;
+    };
+
+    int32_t dummy_one::m_count = 0;
+
+    // Another default constructible dummy object
+    struct dummy_two
+    {
+        uint32_t m_value = 0;
+    };
+
+    struct lock_policy
+    {
+        using mutex_type = std::mutex;
+        using lock_type = std::lock_guard<mutex_type>;
+    };
+}
+
+/// Test that resources from several pools are returned when the scope
+/// ends
+TEST(test_pool_scope, bulk_return)
+{
+    {
+        recycle::resource_pool<dummy_one> pool_one;
+        recycle::resource_pool<dummy_two> pool_two;
+
+        {
+            recycle::pool_scope scope;
+
+            std::vector<std::shared_ptr<dummy_one>> ones;
+            for (uint32_t i = 0; i < 3; ++i)
+                ones.push_back(scope.allocate(pool_one));
+
+            auto two = scope.allocate(pool_two);
+            EXPECT_EQ(dummy_one::m_count, 3);
+
+            ones.clear();
+            two.reset();
+
+            EXPECT_EQ(pool_one.unused_resources(), 0U);
+            EXPECT_EQ(pool_two.unused_resources(), 0U);
+            EXPECT_EQ(dummy_one::m_count, 3);
+        }
+
+        EXPECT_EQ(pool_one.unused_resources(), 3U);
+        EXPECT_EQ(pool_two.unused_resources(), 1U);
+        EXPECT_EQ(dummy_one::m_count, 3);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
+
+/// Test that resources released early are reused within the scope and
+/// that flush() returns them before the scope ends
+TEST(test_pool_scope, early_release)
+{
+    recycle::resource_pool<dummy_two> pool;
+    recycle::pool_scope scope;
+
+    auto o1 = scope.allocate(pool);
+    dummy_two* naked = o1.get();
+    o1.reset();
+
+    auto o2 = pool.allocate();
+    EXPECT_EQ(o2.get(), naked);
+    EXPECT_EQ(pool.unused_resources(), 0U);
+
+    o2.reset();
+    scope.flush();
+    EXPECT_EQ(pool.unused_resources(), 1U);
+
+    // A pool which is not attached is not affected
+    recycle::resource_pool<dummy_two> other;
+    other.allocate();
+    EXPECT_EQ(other.unused_resources(), 1U);
+}
+
+/// Test that the resources are returned taking the pool lock once
+TEST(test_pool_scope, one_lock)
+{
+    using policy = recycle::profiled_locking_policy<lock_policy>;
+    recycle::resource_pool<dummy_two, policy> pool;
+    const recycle::lock_statistics& stats = pool.mutex().statistics();
+    uint64_t acquisitions = 0;
+
+    {
+        recycle::pool_scope scope;
+
+        std::vector<std::shared_ptr<dummy_two>> objects;
+        for (uint32_t i = 0; i < 10; ++i)
+            objects.push_back(scope.allocate(pool));
+
+        acquisitions = stats.m_acquisitions.load();
+        objects.clear();
+
+        EXPECT_EQ(stats.m_acquisitions.load(), acquisitions);
+    }
+
+    EXPECT_EQ(stats.m_acquisitions.load(), acquisitions + 1);
+    EXPECT_EQ(pool.unused_resources(), 10U);
+}
+
+/// Test that the capacity is respected and that resources released on
+/// other threads bypass the scope
+TEST(test_pool_scope, capacity_and_threads)
+{
+    {
+        recycle::resource_pool<dummy_one, lock_policy> pool(2);
+
+        {
+            recycle::pool_scope scope;
+
+            std::vector<std::shared_ptr<dummy_one>> objects;
+            for (uint32_t i = 0; i < 4; ++i)
+                objects.push_back(scope.allocate(pool));
+
+            std::shared_ptr<dummy_one> other = objects.back();
+            objects.pop_back();
+
+            std::thread t([&other]() { other.reset(); });
+            t.join();
+            EXPECT_EQ(pool.unused_resources(), 1U);
+
+            // The batch is returned once it holds as many resources
+            // as the pool's capacity, the third is kept in the scope
+            objects.clear();
+            EXPECT_EQ(pool.unused_resources(), 2U);
+            EXPECT_EQ(dummy_one::m_count, 3);
+        }
+
+        EXPECT_EQ(pool.unused_resources(), 2U);
+        EXPECT_EQ(dummy_one::m_count, 2);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
+
+/// Test that a long-lived scope does not keep more resources than the
+/// pool would
+TEST(test_pool_scope, bounded_batch)
+{
+    recycle::resource_pool<dummy_two> pool(4);
+    recycle::pool_scope scope;
+
+    for (uint32_t round = 0; round < 3; ++round)
+    {
+        std::vector<std::shared_ptr<dummy_two>> objects;
+        for (uint32_t i = 0; i < 6; ++i)
+            objects.push_back(scope.allocate(pool));
+
+        for (uint32_t i = 0; i < 3; ++i)
+            objects.pop_back();
+
+        EXPECT_EQ(pool.unused_resources(), 0U);
+
+        // The fourth release fills the batch, which goes back to the
+        // pool
+        objects.pop_back();
+        EXPECT_EQ(pool.unused_resources(), 4U);
+    }
+}
+
+/// Test nested scopes and pools dying before the scope ends
+TEST(test_pool_scope, nested)
+{
+    {
+        recycle::pool_scope outer;
+        std::unique_ptr<recycle::resource_pool<dummy_one>> pool(
+            new recycle::resource_pool<dummy_one>());
+
+        auto o1 = outer.allocate(*pool);
+
+        {
+            recycle::pool_scope inner;
+            auto o2 = pool->allocate();
+
+            // Kept by the outer scope since the pool is only attached
+            // to it
+            o1.reset();
+            o2.reset();
+        }
+
+        EXPECT_EQ(pool->unused_resources(), 0U);
+        EXPECT_EQ(dummy_one::m_count, 2);
+
+        pool.reset();
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
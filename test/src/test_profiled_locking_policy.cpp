@@ -0,0 +1,157 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/profiled_locking_policy.hpp>
+
+#include <recycle/no_locking_policy.hpp>
+#include <recycle/resource_pool.hpp>
+#include <recycle/value_pool.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+    struct lock_policy
+    {
+        using mutex_type = std::mutex;
+        using lock_type = std::lock_guard<mutex_type>;
+    };
+
+    // Lock type which cannot adopt a locked mutex
+    struct unique_lock_policy
+    {
+        struct lock_type
+        {
+            lock_type(std::mutex& m) :
+                m_lock(m)
+            { }
+
+            std::unique_lock<std::mutex> m_lock;
+        };
+
+        using mutex_type = std::mutex;
+    };
+
+    struct dummy_one
+    {
+        uint32_t m_value = 0;
+    };
+}
+
+/// Test the histogram buckets
+TEST(test_profiled_locking_policy, histogram)
+{
+    recycle::lock_histogram histogram;
+    EXPECT_EQ(histogram.count(), 0U);
+
+    histogram.record(std::chrono::nanoseconds(0));
+    histogram.record(std::chrono::nanoseconds(1));
+    histogram.record(std::chrono::nanoseconds(5));
+    histogram.record(std::chrono::nanoseconds(7));
+    histogram.record(std::chrono::hours(10000));
+
+    EXPECT_EQ(histogram.count(), 5U);
+    EXPECT_EQ(histogram.bucket(0), 1U);
+    EXPECT_EQ(histogram.bucket(1), 1U);
+    EXPECT_EQ(histogram.bucket(3), 2U);
+    EXPECT_EQ(histogram.bucket(recycle::lock_histogram::bucket_count - 1), 1U);
+
+    EXPECT_EQ(recycle::lock_histogram::bucket_floor(0).count(), 0);
+    EXPECT_EQ(recycle::lock_histogram::bucket_floor(3).count(), 4);
+
+    histogram.reset();
+    EXPECT_EQ(histogram.count(), 0U);
+}
+
+/// Test that the acquisitions of the pool mutex are recorded
+TEST(test_profiled_locking_policy, resource_pool)
+{
+    using policy = recycle::profiled_locking_policy<lock_policy>;
+    recycle::resource_pool<dummy_one, policy> pool;
+
+    const recycle::lock_statistics& stats = pool.mutex().statistics();
+    EXPECT_EQ(stats.m_acquisitions.load(), 0U);
+
+    auto o1 = pool.allocate();
+    o1.reset();
+
+    EXPECT_GT(stats.m_acquisitions.load(), 0U);
+    EXPECT_EQ(stats.m_wait.count(), stats.m_acquisitions.load());
+    EXPECT_EQ(stats.m_hold.count(), stats.m_acquisitions.load());
+    EXPECT_EQ(stats.m_contended.load(), 0U);
+}
+
+/// Test wrapping policies with and without try_lock() and adopt_lock
+TEST(test_profiled_locking_policy, inner_policies)
+{
+    {
+        using policy =
+            recycle::profiled_locking_policy<recycle::no_locking_policy>;
+
+        recycle::value_pool<std::vector<uint8_t>, policy> pool;
+        pool.give(pool.take());
+
+        EXPECT_EQ(pool.mutex().statistics().m_acquisitions.load(), 2U);
+        EXPECT_EQ(pool.mutex().statistics().m_contended.load(), 0U);
+    }
+
+    {
+        using policy = recycle::profiled_locking_policy<unique_lock_policy>;
+
+        policy::mutex_type mutex;
+        {
+            policy::lock_type lock(mutex);
+        }
+
+        EXPECT_EQ(mutex.statistics().m_acquisitions.load(), 1U);
+        EXPECT_EQ(mutex.statistics().m_contended.load(), 0U);
+        EXPECT_EQ(mutex.statistics().m_hold.count(), 1U);
+    }
+}
+
+/// Test that contended acquisitions are counted
+TEST(test_profiled_locking_policy, contended)
+{
+    using policy = recycle::profiled_locking_policy<lock_policy>;
+
+    policy::mutex_type mutex;
+    std::thread waiter;
+
+    {
+        policy::lock_type lock(mutex);
+
+        waiter = std::thread([&mutex]()
+        {
+            policy::lock_type lock(mutex);
+        });
+
+        // Give the waiter time to block on the mutex
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+
+    waiter.join();
+
+    const recycle::lock_statistics& stats = mutex.statistics();
+    EXPECT_EQ(stats.m_acquisitions.load(), 2U);
+    EXPECT_EQ(stats.m_contended.load(), 1U);
+
+    // The waiter waited for at least a millisecond
+    uint64_t long_waits = 0;
+    for (std::size_t i = 21; i < recycle::lock_histogram::bucket_count; ++i)
+        long_waits += stats.m_wait.bucket(i);
+
+    EXPECT_EQ(long_waits, 1U);
+
+    mutex.reset_statistics();
+    EXPECT_EQ(stats.m_acquisitions.load(), 0U);
+    EXPECT_EQ(stats.m_wait.count(), 0U);
+}
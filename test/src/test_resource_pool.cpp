@@ -5,12 +5,25 @@
 
 #include <recycle/resource_pool.hpp>
 
+#include <recycle/profiled_locking_policy.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <functional>
+#include <future>
 #include <memory>
 #include <mutex>
+#include <stdexcept>
+#include <string>
 #include <thread>
 #include <type_traits>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -506,4 +519,1605 @@ TEST(test_resource_pool, capacity)
     }
 
     EXPECT_EQ(dummy_one::m_count, 0);
-}
\ No newline at end of file
+}
+
+/// Test that the capacity is only an upper limit and that unused
+/// control blocks are reused
+TEST(test_resource_pool, capacity_on_demand)
+{
+    {
+        recycle::resource_pool<dummy_one> pool(2);
+        EXPECT_EQ(pool.capacity(), 2U);
+
+        std::shared_ptr<dummy_one> d1 = pool.allocate();
+        std::shared_ptr<dummy_one> d2 = pool.allocate();
+        std::shared_ptr<dummy_one> d3 = pool.allocate();
+
+        dummy_one* p1 = d1.get();
+
+        d1.reset();
+        d2.reset();
+        d3.reset();
+        EXPECT_EQ(pool.unused_resources(), 2U);
+        EXPECT_EQ(dummy_one::m_count, 2);
+
+        // Allocating many times from a warm pool keeps reusing the
+        // same resources
+        for (uint32_t i = 0; i < 100; ++i)
+        {
+            auto d4 = pool.allocate();
+            auto d5 = pool.allocate();
+            EXPECT_TRUE(d4.get() == p1 || d5.get() == p1);
+        }
+
+        EXPECT_EQ(pool.unused_resources(), 2U);
+        EXPECT_EQ(dummy_one::m_count, 2);
+
+        recycle::resource_pool<dummy_one> copy(pool);
+        EXPECT_EQ(copy.capacity(), 2U);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
+
+/// Test the per-CPU cache
+TEST(test_resource_pool, cpu_cache)
+{
+    {
+        recycle::resource_pool<dummy_one> pool;
+        EXPECT_FALSE(pool.cpu_cache_enabled());
+
+        pool.enable_cpu_cache(4);
+        EXPECT_TRUE(pool.cpu_cache_enabled());
+
+        {
+            auto d1 = pool.allocate();
+            auto d2 = pool.allocate();
+        }
+
+        EXPECT_EQ(pool.unused_resources(), 2U);
+        EXPECT_EQ(dummy_one::m_count, 2);
+
+        recycle::resource_pool<dummy_one> copy(pool);
+        EXPECT_TRUE(copy.cpu_cache_enabled());
+        EXPECT_EQ(copy.unused_resources(), 2U);
+        EXPECT_EQ(dummy_one::m_count, 4);
+
+        pool.free_unused();
+        EXPECT_EQ(pool.unused_resources(), 0U);
+        EXPECT_EQ(dummy_one::m_count, 2);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
+
+TEST(test_resource_pool, cpu_cache_thread)
+{
+    {
+        using pool_type = recycle::resource_pool<dummy_two, lock_policy>;
+
+        pool_type pool(std::bind(make_dummy_two, 4U));
+        pool.enable_cpu_cache(2);
+
+        auto run = [&pool]()
+            {
+                for (uint32_t i = 0; i < 100; ++i)
+                {
+                    auto a1 = pool.allocate();
+                    auto a2 = pool.allocate();
+                }
+            };
+
+        const uint32_t number_threads = 8;
+        std::thread t[number_threads];
+
+        for (uint32_t i = 0; i < number_threads; ++i)
+        {
+            t[i] = std::thread(run);
+        }
+
+        for (uint32_t i = 0; i < number_threads; ++i)
+        {
+            t[i].join();
+        }
+
+        EXPECT_EQ(dummy_two::m_count, (int32_t) pool.unused_resources());
+    }
+
+    EXPECT_EQ(dummy_two::m_count, 0);
+}
+
+/// Test the pool with raw back-pointers in the objects
+TEST(test_resource_pool, pool_outlives_objects)
+{
+    using pool_type = recycle::resource_pool<
+        dummy_one, recycle::no_locking_policy,
+        recycle::pool_outlives_objects_policy>;
+
+    {
+        pool_type pool(3);
+
+        {
+            auto d1 = pool.allocate();
+            auto d2 = pool.allocate();
+            EXPECT_EQ(pool.unused_resources(), 0U);
+
+            std::weak_ptr<dummy_one> w1 = d1;
+            d1.reset();
+            EXPECT_EQ(pool.unused_resources(), 1U);
+        }
+
+        EXPECT_EQ(pool.unused_resources(), 2U);
+        EXPECT_EQ(dummy_one::m_count, 2);
+
+        auto d3 = pool.allocate();
+        EXPECT_EQ(pool.unused_resources(), 1U);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
+
+#if !defined(NDEBUG) && GTEST_HAS_DEATH_TEST
+/// Test that destroying the pool before its objects is detected
+TEST(test_resource_pool, pool_outlives_objects_death)
+{
+    using pool_type = recycle::resource_pool<
+        dummy_one, recycle::no_locking_policy,
+        recycle::pool_outlives_objects_policy>;
+
+    auto run = []()
+        {
+            std::shared_ptr<dummy_one> d1;
+            {
+                pool_type pool;
+                d1 = pool.allocate();
+            }
+        };
+
+    EXPECT_DEATH(run(), "");
+}
+#endif
+
+namespace
+{
+    // Over-aligned default constructible dummy object
+    struct alignas(64) dummy_aligned
+    {
+        dummy_aligned()
+        {
+            ++m_count;
+        }
+
+        ~dummy_aligned()
+        {
+            --m_count;
+        }
+
+        uint8_t m_data[64];
+
+        static int32_t m_count;
+    };
+
+    int32_t dummy_aligned::m_count = 0;
+}
+
+/// Test that values constructed by the pool, which share a single
+/// allocation with a control block, are released correctly
+TEST(test_resource_pool, construct_in_place)
+{
+    {
+        std::weak_ptr<dummy_one> w1;
+        std::shared_ptr<dummy_one> d2;
+
+        {
+            recycle::resource_pool<dummy_one> pool(1);
+
+            // The first miss learns the size of the control blocks
+            auto d1 = pool.allocate();
+            w1 = d1;
+            d1.reset();
+
+            EXPECT_EQ(pool.unused_resources(), 1U);
+            EXPECT_TRUE(w1.expired());
+
+            // Drop the value while its control block is cached
+            pool.free_unused();
+            EXPECT_EQ(dummy_one::m_count, 0);
+
+            d1 = pool.allocate();
+            d2 = pool.allocate();
+            EXPECT_EQ(dummy_one::m_count, 2);
+
+            // The control block of d1 is kept alive by the weak_ptr
+            // while the value goes back to the pool
+            w1 = d1;
+            d1.reset();
+            EXPECT_EQ(pool.unused_resources(), 1U);
+            EXPECT_EQ(dummy_one::m_count, 2);
+        }
+
+        EXPECT_EQ(dummy_one::m_count, 1);
+        EXPECT_TRUE(w1.expired());
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+
+    {
+        recycle::resource_pool<dummy_aligned> pool;
+
+        auto d1 = pool.allocate();
+        auto d2 = pool.allocate();
+
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(d1.get()) % 64, 0U);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(d2.get()) % 64, 0U);
+        EXPECT_EQ(dummy_aligned::m_count, 2);
+    }
+
+    EXPECT_EQ(dummy_aligned::m_count, 0);
+}
+
+/// Test that resources are retired after a number of reuses
+TEST(test_resource_pool, max_reuses)
+{
+    {
+        recycle::resource_pool<dummy_one> pool;
+        pool.set_max_reuses(2);
+
+        dummy_one* first = pool.allocate().get();
+        dummy_one* second = pool.allocate().get();
+        dummy_one* third = pool.allocate().get();
+
+        EXPECT_EQ(first, second);
+        EXPECT_EQ(second, third);
+
+        // The third use was the second reuse, so the resource was
+        // retired
+        EXPECT_EQ(pool.unused_resources(), 0U);
+        EXPECT_EQ(dummy_one::m_count, 0);
+
+        recycle::resource_pool<dummy_one> copy(pool);
+        copy.allocate();
+        copy.allocate();
+        copy.allocate();
+        EXPECT_EQ(copy.unused_resources(), 0U);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
+
+/// Test that resources with a too large footprint are shrunk or
+/// dropped
+TEST(test_resource_pool, footprint_limit)
+{
+    using pool_type = recycle::resource_pool<std::vector<uint8_t>>;
+
+    auto footprint = [](const std::vector<uint8_t>& v)
+        {
+            return v.capacity();
+        };
+
+    {
+        pool_type pool;
+        pool.set_footprint_limit(footprint, 100);
+
+        auto v1 = pool.allocate();
+        auto v2 = pool.allocate();
+        v1->resize(50);
+        v2->resize(500);
+
+        v1.reset();
+        v2.reset();
+
+        EXPECT_EQ(pool.unused_resources(), 1U);
+        EXPECT_EQ(pool.allocate()->size(), 50U);
+    }
+
+    {
+        pool_type pool(
+            []() { return std::make_shared<std::vector<uint8_t>>(); },
+            [](std::shared_ptr<std::vector<uint8_t>> v) { v->clear(); });
+
+        pool.set_footprint_limit(footprint, 100,
+            [](std::vector<uint8_t>& v) { v.shrink_to_fit(); });
+
+        auto v1 = pool.allocate();
+        v1->resize(500);
+        v1.reset();
+
+        EXPECT_EQ(pool.unused_resources(), 1U);
+        EXPECT_EQ(pool.allocate()->capacity(), 0U);
+    }
+}
+
+/// Test that allocating with a key prefers resources in that state
+TEST(test_resource_pool, allocate_key)
+{
+    struct codec
+    {
+        std::size_t m_profile = 0;
+        uint32_t m_configured = 0;
+    };
+
+    recycle::resource_pool<codec> pool;
+
+    pool.set_reconfigure_function([](codec& c, std::size_t profile)
+        {
+            c.m_profile = profile;
+            ++c.m_configured;
+        });
+
+    auto c1 = pool.allocate(1);
+    auto c2 = pool.allocate(2);
+    auto c3 = pool.allocate(3);
+    auto c4 = pool.allocate();
+
+    EXPECT_EQ(c1->m_profile, 1U);
+    EXPECT_EQ(c2->m_profile, 2U);
+    EXPECT_EQ(c3->m_profile, 3U);
+    EXPECT_EQ(c4->m_configured, 0U);
+
+    codec* p1 = c1.get();
+    codec* p2 = c2.get();
+    codec* p3 = c3.get();
+
+    c1.reset();
+    c2.reset();
+    c3.reset();
+    c4.reset();
+    EXPECT_EQ(pool.unused_resources(), 4U);
+
+    // The resources in the requested state are found regardless of
+    // their position in the free list
+    auto d2 = pool.allocate(2);
+    EXPECT_EQ(d2.get(), p2);
+    EXPECT_EQ(d2->m_configured, 1U);
+
+    auto d1 = pool.allocate(1);
+    EXPECT_EQ(d1.get(), p1);
+    EXPECT_EQ(d1->m_configured, 1U);
+
+    // No resource in state 4, so one is reconfigured
+    auto d4 = pool.allocate(4);
+    EXPECT_EQ(d4->m_profile, 4U);
+    EXPECT_NE(d4.get(), p3);
+
+    auto d3 = pool.allocate(3);
+    EXPECT_EQ(d3.get(), p3);
+    EXPECT_EQ(d3->m_configured, 1U);
+    EXPECT_EQ(pool.unused_resources(), 0U);
+
+    // Resources can migrate between keys
+    d3.reset();
+    auto e3 = pool.allocate(5);
+    EXPECT_EQ(e3.get(), p3);
+    EXPECT_EQ(e3->m_profile, 5U);
+    EXPECT_EQ(e3->m_configured, 2U);
+
+    e3.reset();
+    EXPECT_EQ(pool.allocate(3)->m_configured, 3U);
+
+    pool.free_unused();
+    EXPECT_EQ(pool.unused_resources(), 0U);
+}
+
+/// Test the key index with many keys
+TEST(test_resource_pool, allocate_key_many)
+{
+    recycle::resource_pool<std::size_t> pool;
+    uint32_t reconfigured = 0;
+
+    pool.set_reconfigure_function(
+        [&reconfigured](std::size_t& v, std::size_t key)
+        {
+            v = key;
+            ++reconfigured;
+        });
+
+    std::vector<std::shared_ptr<std::size_t>> values;
+
+    for (std::size_t i = 0; i < 100; ++i)
+    {
+        values.push_back(pool.allocate(i % 10));
+    }
+
+    values.clear();
+    EXPECT_EQ(pool.unused_resources(), 100U);
+
+    for (std::size_t i = 0; i < 100; ++i)
+    {
+        std::size_t key = (i * 7) % 10;
+        values.push_back(pool.allocate(key));
+        EXPECT_EQ(*values.back(), key);
+    }
+
+    EXPECT_EQ(reconfigured, 100U);
+    EXPECT_EQ(pool.unused_resources(), 0U);
+}
+
+/// Test that the number of concurrent constructions can be limited
+TEST(test_resource_pool, max_constructions)
+{
+    using pool_type = recycle::resource_pool<dummy_two, lock_policy>;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    uint32_t constructing = 0;
+    uint32_t max_constructing = 0;
+    bool finish = false;
+
+    auto make = [&]()->std::shared_ptr<dummy_two>
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ++constructing;
+            max_constructing = std::max(max_constructing, constructing);
+            changed.notify_all();
+
+            // The constructions are held until the test lets them
+            // finish
+            changed.wait(lock, [&finish]() { return finish; });
+            --constructing;
+
+            // The counter of the dummy is not thread-safe
+            return std::make_shared<dummy_two>(3U);
+        };
+
+    {
+        pool_type pool(make);
+
+        // The callers waiting for a construction slot never give up,
+        // so the test hangs if they are not woken
+        pool.set_max_constructions(2, std::chrono::hours(1));
+
+        const uint32_t number_threads = 6;
+        std::vector<std::shared_ptr<dummy_two>> resources(number_threads);
+        std::thread t[number_threads];
+
+        // Every caller keeps its resource, so the callers waiting can
+        // only be woken by a construction slot freeing up
+        for (uint32_t i = 0; i < number_threads; ++i)
+        {
+            t[i] = std::thread([&pool, &resources, i]()
+                {
+                    resources[i] = pool.allocate();
+                });
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&constructing]()
+                { return constructing == 2; });
+
+            finish = true;
+            changed.notify_all();
+        }
+
+        for (uint32_t i = 0; i < number_threads; ++i)
+        {
+            t[i].join();
+        }
+
+        EXPECT_EQ(max_constructing, 2U);
+        EXPECT_EQ(dummy_two::m_count, (int32_t) number_threads);
+
+        resources.clear();
+        EXPECT_EQ(pool.unused_resources(), number_threads);
+    }
+
+    EXPECT_EQ(dummy_two::m_count, 0);
+
+    {
+        // Callers which time out construct anyway
+        pool_type pool(make);
+        pool.set_max_constructions(1, std::chrono::microseconds(0));
+
+        pool_type copy(pool);
+
+        auto a1 = copy.allocate();
+        auto a2 = copy.allocate();
+        EXPECT_EQ(dummy_two::m_count, 2);
+    }
+
+    EXPECT_EQ(dummy_two::m_count, 0);
+}
+
+/// Test allocating only unused resources and adopting resources
+/// constructed outside the pool
+TEST(test_resource_pool, adopt)
+{
+    {
+        recycle::resource_pool<dummy_one> pool;
+
+        // Nothing is constructed on a miss
+        auto o1 = pool.allocate_unused();
+        EXPECT_FALSE((bool) o1);
+        EXPECT_EQ(dummy_one::m_count, 0);
+
+        auto o2 = pool.adopt(std::make_shared<dummy_one>());
+        dummy_one* naked = o2.get();
+        EXPECT_EQ(dummy_one::m_count, 1);
+
+        o2.reset();
+        EXPECT_EQ(pool.unused_resources(), 1U);
+        EXPECT_EQ(dummy_one::m_count, 1);
+
+        auto o3 = pool.allocate_unused();
+        EXPECT_EQ(o3.get(), naked);
+        EXPECT_EQ(pool.unused_resources(), 0U);
+
+        auto o4 = pool.allocate_unused();
+        EXPECT_FALSE((bool) o4);
+        EXPECT_EQ(dummy_one::m_count, 1);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+
+    {
+        recycle::resource_pool<dummy_one> pool;
+        pool.enable_cpu_cache(4);
+
+        auto o1 = pool.allocate_unused();
+        EXPECT_FALSE((bool) o1);
+
+        auto o2 = pool.adopt(std::make_shared<dummy_one>());
+        o2.reset();
+
+        auto o3 = pool.allocate_unused();
+        EXPECT_TRUE((bool) o3);
+        EXPECT_EQ(dummy_one::m_count, 1);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
+
+/// Test that allocate functions may fail by returning nullptr
+TEST(test_resource_pool, try_allocate)
+{
+    bool fail = true;
+
+    auto make = [&fail]()->std::shared_ptr<dummy_two>
+    {
+        if (fail)
+            return nullptr;
+
+        return std::make_shared<dummy_two>(3U);
+    };
+
+    {
+        recycle::resource_pool<dummy_two> pool(make);
+
+        auto r1 = pool.try_allocate();
+        EXPECT_FALSE((bool) r1);
+        EXPECT_EQ(r1.error(), recycle::allocate_error::allocate_failed);
+        EXPECT_EQ(pool.unused_resources(), 0U);
+
+        // The plain allocate returns nullptr
+        auto o1 = pool.allocate();
+        EXPECT_FALSE((bool) o1);
+
+        auto r2 = pool.try_allocate(1U);
+        EXPECT_FALSE((bool) r2);
+
+        fail = false;
+
+        auto r3 = pool.try_allocate();
+        ASSERT_TRUE((bool) r3);
+        EXPECT_EQ(r3.error(), recycle::allocate_error::none);
+        EXPECT_EQ(dummy_two::m_count, 1);
+
+        dummy_two* naked = r3.value().get();
+        r3.value().reset();
+        EXPECT_EQ(pool.unused_resources(), 1U);
+
+        // A failing allocate function does not matter on a hit
+        fail = true;
+
+        auto r4 = pool.try_allocate();
+        ASSERT_TRUE((bool) r4);
+        EXPECT_EQ(r4.value().get(), naked);
+    }
+
+    EXPECT_EQ(dummy_two::m_count, 0);
+}
+
+namespace
+{
+    // Mutex whose try_lock() fails while m_contended is set, as if
+    // another thread held it
+    struct contended_mutex
+    {
+        void lock()
+        {
+            m_mutex.lock();
+        }
+
+        bool try_lock()
+        {
+            return !m_contended && m_mutex.try_lock();
+        }
+
+        void unlock()
+        {
+            m_mutex.unlock();
+        }
+
+        std::mutex m_mutex;
+        static bool m_contended;
+    };
+
+    bool contended_mutex::m_contended = false;
+
+    struct contended_lock_policy
+    {
+        using mutex_type = contended_mutex;
+        using lock_type = std::lock_guard<mutex_type>;
+    };
+}
+
+/// Test enabling the per-CPU cache when the pool is contended
+TEST(test_resource_pool, adaptive_cpu_cache)
+{
+    using pool_type = recycle::resource_pool<dummy_one, contended_lock_policy>;
+
+    {
+        // With a zero threshold every contended window enables the
+        // cache
+        contended_mutex::m_contended = true;
+
+        pool_type pool;
+        pool.enable_adaptive_cpu_cache(4, 0.0, 4, std::chrono::hours(1));
+        EXPECT_FALSE(pool.cpu_cache_enabled());
+
+        // Each allocation and release acquires the pool mutex once
+        pool.allocate().reset();
+        EXPECT_FALSE(pool.cpu_cache_enabled());
+
+        pool.allocate().reset();
+        EXPECT_TRUE(pool.cpu_cache_enabled());
+        EXPECT_EQ(pool.unused_resources(), 1U);
+        EXPECT_EQ(dummy_one::m_count, 1);
+
+        // The copy is adaptive as well, but starts with the cache
+        // disabled
+        pool_type copy(pool);
+        EXPECT_FALSE(copy.cpu_cache_enabled());
+
+        // The cache stays enabled for the cool-down after the
+        // contention is gone
+        contended_mutex::m_contended = false;
+
+        for (uint32_t i = 0; i < 1000; ++i)
+            pool.allocate().reset();
+
+        EXPECT_TRUE(pool.cpu_cache_enabled());
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+
+    {
+        // Without contention the cache is never enabled, even with a
+        // zero threshold
+        pool_type pool;
+        pool.enable_adaptive_cpu_cache(4, 0.0, 2);
+
+        for (uint32_t i = 0; i < 10; ++i)
+            pool.allocate().reset();
+
+        EXPECT_FALSE(pool.cpu_cache_enabled());
+    }
+
+    {
+        // The threshold is never reached without contention
+        pool_type pool;
+        pool.enable_adaptive_cpu_cache(4, 0.5, 2);
+
+        for (uint32_t i = 0; i < 10; ++i)
+            pool.allocate().reset();
+
+        EXPECT_FALSE(pool.cpu_cache_enabled());
+    }
+}
+
+/// Test that the per-CPU cache is disabled once the contention drops
+TEST(test_resource_pool, adaptive_cpu_cache_collapse)
+{
+    using pool_type = recycle::resource_pool<dummy_one, contended_lock_policy>;
+
+    {
+        contended_mutex::m_contended = true;
+
+        pool_type pool;
+        pool.enable_adaptive_cpu_cache(4, 0.5, 2, std::chrono::hours(0));
+
+        pool.allocate().reset();
+        EXPECT_TRUE(pool.cpu_cache_enabled());
+
+        // The allocations and releases are now served by the cache,
+        // which keeps probing the mutex
+        for (uint32_t i = 0; i < 1000; ++i)
+            pool.allocate().reset();
+
+        EXPECT_TRUE(pool.cpu_cache_enabled());
+
+        contended_mutex::m_contended = false;
+
+        for (uint32_t i = 0; i < 1000; ++i)
+            pool.allocate().reset();
+
+        EXPECT_FALSE(pool.cpu_cache_enabled());
+
+        // The resources cached per CPU moved back to the free list
+        EXPECT_EQ(pool.unused_resources(), 1U);
+        EXPECT_EQ(dummy_one::m_count, 1);
+
+        // It is enabled again when the contention returns
+        contended_mutex::m_contended = true;
+        pool.allocate().reset();
+        EXPECT_TRUE(pool.cpu_cache_enabled());
+        contended_mutex::m_contended = false;
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+
+    {
+        // The profiled lock reports the contention it measured
+        using policy =
+            recycle::profiled_locking_policy<contended_lock_policy>;
+
+        contended_mutex::m_contended = true;
+
+        recycle::resource_pool<dummy_one, policy> pool;
+        pool.enable_adaptive_cpu_cache(4, 0.0, 2);
+
+        pool.allocate().reset();
+        EXPECT_TRUE(pool.cpu_cache_enabled());
+        EXPECT_EQ(pool.mutex().statistics().m_contended.load(),
+                  pool.mutex().statistics().m_acquisitions.load());
+
+        contended_mutex::m_contended = false;
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
+
+/// Test enabling and disabling the per-CPU cache while threads use
+/// the pool
+TEST(test_resource_pool, adaptive_cpu_cache_thread)
+{
+    std::atomic<int32_t> count(0);
+
+    auto make = [&count]()
+    {
+        ++count;
+        return std::shared_ptr<int>(new int(0), [&count](int* p)
+        {
+            --count;
+            delete p;
+        });
+    };
+
+    {
+        recycle::resource_pool<int, lock_policy> pool(make);
+        pool.enable_adaptive_cpu_cache(
+            2, 0.0, 16, std::chrono::milliseconds(1));
+
+        auto run = [&pool]()
+        {
+            for (uint32_t i = 0; i < 2000; ++i)
+            {
+                auto a = pool.allocate();
+                auto b = pool.allocate();
+                ++(*a);
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (uint32_t i = 0; i < 4; ++i)
+            workers.emplace_back(run);
+
+        for (auto& t : workers)
+            t.join();
+
+        EXPECT_EQ(count.load(), (int32_t) pool.unused_resources());
+    }
+
+    EXPECT_EQ(count.load(), 0);
+}
+
+/// Test reserving unused resources for high priority allocations
+TEST(test_resource_pool, priority)
+{
+    {
+        recycle::resource_pool<dummy_one> pool;
+        pool.set_reserved(2);
+
+        auto o1 = pool.allocate();
+        auto o2 = pool.allocate();
+        auto o3 = pool.allocate();
+        dummy_one* n1 = o1.get();
+
+        o3.reset();
+        o2.reset();
+        o1.reset();
+        EXPECT_EQ(pool.unused_resources(), 3U);
+
+        // Normal allocations only use the unreserved resource
+        auto a1 = pool.allocate(recycle::priority::normal);
+        EXPECT_EQ(a1.get(), n1);
+        EXPECT_EQ(pool.unused_resources(), 2U);
+
+        auto a2 = pool.allocate();
+        EXPECT_EQ(pool.unused_resources(), 2U);
+        EXPECT_EQ(dummy_one::m_count, 4);
+
+        // High priority allocations use the reserve
+        auto h1 = pool.allocate(recycle::priority::high);
+        auto h2 = pool.allocate(recycle::priority::high);
+        EXPECT_EQ(pool.unused_resources(), 0U);
+        EXPECT_EQ(dummy_one::m_count, 4);
+
+        auto h3 = pool.allocate(recycle::priority::high);
+        EXPECT_EQ(dummy_one::m_count, 5);
+
+        // The copy keeps the reserve
+        h1.reset();
+        recycle::resource_pool<dummy_one> copy(pool);
+        EXPECT_EQ(copy.unused_resources(), 1U);
+
+        auto c1 = copy.allocate();
+        EXPECT_EQ(copy.unused_resources(), 1U);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
+
+/// Test that normal priority callers waiting for a construction slot
+/// do not take reserved resources
+TEST(test_resource_pool, priority_max_constructions)
+{
+    using pool_type = recycle::resource_pool<dummy_one, lock_policy>;
+
+    pool_type pool;
+    pool.set_reserved(1);
+    pool.set_max_constructions(1, std::chrono::microseconds(0));
+
+    auto o1 = pool.allocate();
+    dummy_one* naked = o1.get();
+    o1.reset();
+
+    auto o2 = pool.allocate();
+    EXPECT_NE(o2.get(), naked);
+    EXPECT_EQ(pool.unused_resources(), 1U);
+
+    auto o3 = pool.allocate(recycle::priority::high);
+    EXPECT_EQ(o3.get(), naked);
+}
+
+/// Test the per-tenant quotas
+TEST(test_resource_pool, tenant_quota)
+{
+    using pool_type = recycle::resource_pool<dummy_one, lock_policy>;
+
+    {
+        pool_type pool;
+        pool.set_tenant_quota(1, 2, 1);
+
+        auto r1 = pool.try_allocate_for(1);
+        auto r2 = pool.try_allocate_for(1);
+        ASSERT_TRUE((bool) r1);
+        ASSERT_TRUE((bool) r2);
+
+        // The third allocation exceeds the quota
+        auto r3 = pool.try_allocate_for(1);
+        EXPECT_FALSE((bool) r3);
+        EXPECT_EQ(r3.error(), recycle::allocate_error::quota_exceeded);
+
+        pool_type::tenant_statistics stats = pool.tenant_stats(1);
+        EXPECT_EQ(stats.m_outstanding, 2U);
+        EXPECT_EQ(stats.m_allocations, 2U);
+        EXPECT_EQ(stats.m_rejections, 1U);
+        EXPECT_EQ(stats.m_waits, 0U);
+
+        // Tenants without a quota are not limited
+        auto r4 = pool.try_allocate_for(2);
+        auto r5 = pool.try_allocate_for(2);
+        auto r6 = pool.try_allocate_for(2);
+        EXPECT_TRUE(r4 && r5 && r6);
+        EXPECT_EQ(pool.tenant_stats(2).m_allocations, 0U);
+
+        // Only one unused resource of the tenant is kept
+        r1.value().reset();
+        r2.value().reset();
+        EXPECT_EQ(pool.unused_resources(), 1U);
+
+        stats = pool.tenant_stats(1);
+        EXPECT_EQ(stats.m_outstanding, 0U);
+        EXPECT_EQ(stats.m_retained, 1U);
+        EXPECT_EQ(dummy_one::m_count, 4);
+
+        // Once allocated again it no longer counts as retained
+        auto o1 = pool.allocate();
+        EXPECT_EQ(pool.tenant_stats(1).m_retained, 0U);
+        o1.reset();
+        EXPECT_EQ(pool.tenant_stats(1).m_retained, 0U);
+
+        auto r7 = pool.try_allocate_for(1);
+        r7.value().reset();
+        EXPECT_EQ(pool.tenant_stats(1).m_retained, 1U);
+
+        pool.free_unused();
+        EXPECT_EQ(pool.tenant_stats(1).m_retained, 0U);
+
+        // The copy has the same quotas
+        pool_type copy(pool);
+        auto c1 = copy.try_allocate_for(1);
+        auto c2 = copy.try_allocate_for(1);
+        auto c3 = copy.try_allocate_for(1);
+        EXPECT_FALSE((bool) c3);
+        EXPECT_EQ(copy.tenant_stats(1).m_rejections, 1U);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
+
+/// Test that the free list is shared fairly by the tenants
+TEST(test_resource_pool, tenant_fair_share)
+{
+    using pool_type = recycle::resource_pool<dummy_one, lock_policy>;
+
+    {
+        pool_type pool(4);
+        pool.set_tenant_quota(1, 10, 10);
+        pool.set_tenant_quota(2, 10, 10);
+
+        std::vector<pool_type::value_ptr> objects;
+        for (uint32_t i = 0; i < 4; ++i)
+            objects.push_back(pool.try_allocate_for(1).value());
+
+        // The first tenant keeps half of the capacity
+        objects.clear();
+        EXPECT_EQ(pool.tenant_stats(1).m_retained, 2U);
+        EXPECT_EQ(pool.unused_resources(), 2U);
+
+        // Which leaves room for the second tenant
+        auto o1 = pool.try_allocate_for(2).value();
+        auto o2 = pool.try_allocate_for(2).value();
+        auto o3 = pool.try_allocate_for(2).value();
+        auto o4 = pool.try_allocate_for(2).value();
+        o1.reset();
+        o2.reset();
+        o3.reset();
+        o4.reset();
+
+        EXPECT_EQ(pool.tenant_stats(2).m_retained, 2U);
+        EXPECT_EQ(pool.unused_resources(), 2U);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
+
+/// Test that a throwing allocate function does not use up the quota
+TEST(test_resource_pool, tenant_quota_throws)
+{
+    using pool_type = recycle::resource_pool<dummy_one, lock_policy>;
+
+    bool fail = true;
+    pool_type pool([&fail]()
+    {
+        if (fail)
+            throw std::runtime_error("allocate failed");
+
+        return std::make_shared<dummy_one>();
+    });
+
+    pool.set_tenant_quota(1, 1, 1);
+
+    EXPECT_THROW(pool.try_allocate_for(1), std::runtime_error);
+    EXPECT_THROW(pool.try_allocate_for(1), std::runtime_error);
+    EXPECT_EQ(pool.tenant_stats(1).m_outstanding, 0U);
+
+    fail = false;
+    auto r1 = pool.try_allocate_for(1);
+    EXPECT_TRUE((bool) r1);
+    EXPECT_EQ(pool.tenant_stats(1).m_outstanding, 1U);
+}
+
+/// Test waiting for a tenant's resource to be released
+TEST(test_resource_pool, tenant_quota_wait)
+{
+    using pool_type = recycle::resource_pool<dummy_one, lock_policy>;
+
+    pool_type pool;
+    pool.set_tenant_quota(1, 1, 1, std::chrono::seconds(10));
+
+    auto r1 = pool.try_allocate_for(1);
+    ASSERT_TRUE((bool) r1);
+
+    std::thread releaser([&r1]()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        r1.value().reset();
+    });
+
+    auto r2 = pool.try_allocate_for(1);
+    releaser.join();
+
+    EXPECT_TRUE((bool) r2);
+
+    pool_type::tenant_statistics stats = pool.tenant_stats(1);
+    EXPECT_EQ(stats.m_waits, 1U);
+    EXPECT_EQ(stats.m_rejections, 0U);
+    EXPECT_EQ(stats.m_outstanding, 1U);
+}
+
+/// Test growing the capacity when resources are dropped and
+/// constructed again
+TEST(test_resource_pool, capacity_tuning_grow)
+{
+    using pool_type = recycle::resource_pool<dummy_one>;
+
+    {
+        pool_type pool(1);
+        pool.enable_capacity_tuning(1, 10, 4);
+        EXPECT_TRUE(pool.capacity_decisions().empty());
+
+        {
+            auto o1 = pool.allocate();
+            auto o2 = pool.allocate();
+            auto o3 = pool.allocate();
+        }
+
+        // Two resources were dropped
+        EXPECT_EQ(pool.unused_resources(), 1U);
+        EXPECT_EQ(dummy_one::m_count, 1);
+
+        auto o4 = pool.allocate();
+
+        std::vector<pool_type::capacity_decision> decisions =
+            pool.capacity_decisions();
+
+        ASSERT_EQ(decisions.size(), 1U);
+        EXPECT_EQ(decisions[0].m_window, 0U);
+        EXPECT_EQ(decisions[0].m_old_capacity, 1U);
+        EXPECT_EQ(decisions[0].m_new_capacity, 3U);
+        EXPECT_EQ(decisions[0].m_misses, 3U);
+        EXPECT_EQ(decisions[0].m_drops, 2U);
+        EXPECT_EQ(pool.capacity(), 3U);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+
+    {
+        // The capacity stays within the bounds
+        pool_type pool(100);
+        pool.enable_capacity_tuning(1, 10, 4);
+        EXPECT_EQ(pool.capacity(), 10U);
+
+        // The copy uses the same bounds but has its own decisions
+        pool_type copy(pool);
+        EXPECT_EQ(copy.capacity(), 10U);
+        EXPECT_TRUE(copy.capacity_decisions().empty());
+    }
+}
+
+/// Test shrinking the capacity when unused resources are not needed
+TEST(test_resource_pool, capacity_tuning_shrink)
+{
+    using pool_type = recycle::resource_pool<dummy_one>;
+
+    {
+        pool_type pool(10);
+        pool.enable_capacity_tuning(2, 10, 4);
+
+        {
+            std::vector<std::shared_ptr<dummy_one>> objects;
+            for (uint32_t i = 0; i < 6; ++i)
+                objects.push_back(pool.allocate());
+        }
+
+        EXPECT_EQ(pool.unused_resources(), 6U);
+
+        // A single resource is enough for this workload
+        for (uint32_t i = 0; i < 40; ++i)
+            pool.allocate();
+
+        EXPECT_EQ(pool.capacity(), 2U);
+        EXPECT_EQ(pool.unused_resources(), 2U);
+        EXPECT_EQ(dummy_one::m_count, 2);
+
+        std::vector<pool_type::capacity_decision> decisions =
+            pool.capacity_decisions();
+
+        ASSERT_FALSE(decisions.empty());
+        EXPECT_EQ(decisions.back().m_new_capacity, 2U);
+
+        bool shrunk = false;
+        for (const auto& decision : decisions)
+        {
+            EXPECT_LE(decision.m_new_capacity, decision.m_old_capacity);
+            shrunk |= decision.m_idle > 0;
+        }
+
+        EXPECT_TRUE(shrunk);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
+
+/// Test that a pool takes resources from its parent on a miss and
+/// gives them back when released beyond its capacity
+TEST(test_resource_pool, parent)
+{
+    {
+        recycle::resource_pool<dummy_one, lock_policy> parent(10);
+
+        {
+            std::vector<std::shared_ptr<dummy_one>> objects;
+            for (uint32_t i = 0; i < 6; ++i)
+                objects.push_back(parent.allocate());
+        }
+
+        EXPECT_EQ(parent.unused_resources(), 6U);
+
+        recycle::resource_pool<dummy_one> child(2);
+        child.set_parent(parent, 3);
+
+        auto o1 = child.allocate();
+        EXPECT_EQ(child.unused_resources(), 2U);
+        EXPECT_EQ(parent.unused_resources(), 3U);
+
+        auto o2 = child.allocate();
+        auto o3 = child.allocate();
+        auto o4 = child.allocate();
+        EXPECT_EQ(child.unused_resources(), 2U);
+        EXPECT_EQ(parent.unused_resources(), 0U);
+        EXPECT_EQ(dummy_one::m_count, 6);
+
+        // The released resource and the unused ones go to the parent
+        o1.reset();
+        EXPECT_EQ(child.unused_resources(), 0U);
+        EXPECT_EQ(parent.unused_resources(), 3U);
+
+        o2.reset();
+        o3.reset();
+        EXPECT_EQ(child.unused_resources(), 2U);
+
+        // The parent constructs when it has no unused resources
+        std::vector<std::shared_ptr<dummy_one>> objects;
+        for (uint32_t i = 0; i < 6; ++i)
+            objects.push_back(child.allocate());
+
+        EXPECT_EQ(dummy_one::m_count, 7);
+        EXPECT_EQ(child.unused_resources(), 0U);
+        EXPECT_EQ(parent.unused_resources(), 0U);
+
+        objects.clear();
+        o4.reset();
+        EXPECT_EQ(child.unused_resources() + parent.unused_resources(), 7U);
+
+        auto copy = child;
+        EXPECT_TRUE((bool) copy.allocate());
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+
+    {
+        recycle::resource_pool<dummy_one, lock_policy> parent;
+
+        {
+            recycle::resource_pool<dummy_one> child;
+            child.set_parent(parent);
+            child.allocate();
+            EXPECT_EQ(child.unused_resources(), 1U);
+        }
+
+        EXPECT_EQ(parent.unused_resources(), 1U);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
+
+/// Test a chain of pools with unsynchronized pools per thread
+TEST(test_resource_pool, parent_chain)
+{
+    {
+        // The resources are destroyed on the workers, so they are not
+        // counted
+        using value_type = std::vector<uint8_t>;
+
+        recycle::resource_pool<value_type, lock_policy> root(4);
+        recycle::resource_pool<value_type, lock_policy> shared(4);
+        shared.set_parent(root, 2);
+
+        auto run = [&shared]()
+        {
+            recycle::resource_pool<value_type> local(2);
+            local.set_parent(shared, 2);
+
+            for (uint32_t i = 0; i < 100; ++i)
+            {
+                std::vector<std::shared_ptr<value_type>> objects;
+                for (uint32_t j = 0; j < i % 5; ++j)
+                    objects.push_back(local.allocate());
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (uint32_t i = 0; i < 4; ++i)
+            workers.emplace_back(run);
+
+        for (auto& t : workers)
+            t.join();
+
+        // The local pools gave their unused resources back
+        EXPECT_EQ(shared.unused_resources(), 4U);
+        EXPECT_LE(root.unused_resources(), 4U);
+    }
+}
+
+namespace
+{
+    // Object counted with an atomic, since it is destroyed on other
+    // threads
+    struct dummy_buffer
+    {
+        dummy_buffer()
+        {
+            ++m_count;
+        }
+
+        ~dummy_buffer()
+        {
+            --m_count;
+        }
+
+        static std::atomic<int32_t> m_count;
+    };
+
+    std::atomic<int32_t> dummy_buffer::m_count(0);
+}
+
+/// Test destroying the unused resources in parallel
+TEST(test_resource_pool, free_unused_async)
+{
+    using pool_type = recycle::resource_pool<dummy_buffer>;
+
+    {
+        pool_type pool;
+
+        {
+            std::vector<std::shared_ptr<dummy_buffer>> objects;
+            for (uint32_t i = 0; i < 10; ++i)
+                objects.push_back(pool.allocate());
+        }
+
+        EXPECT_EQ(pool.unused_resources(), 10U);
+
+        // Without an executor the threads destroying the resources
+        // are joined before we return
+        std::future<void> done = pool.free_unused_async();
+        EXPECT_EQ(pool.unused_resources(), 0U);
+        EXPECT_EQ(dummy_buffer::m_count.load(), 0);
+        EXPECT_EQ(done.wait_for(std::chrono::seconds(0)),
+                  std::future_status::ready);
+
+        // Nothing to destroy
+        pool.free_unused_async().wait();
+    }
+
+    // The tasks run when we say so
+    std::vector<std::function<void()>> tasks;
+
+    {
+        pool_type pool;
+        pool.set_destruction_executor(
+            [&tasks](std::function<void()> task)
+            {
+                tasks.push_back(std::move(task));
+            }, 3);
+
+        {
+            std::vector<std::shared_ptr<dummy_buffer>> objects;
+            for (uint32_t i = 0; i < 10; ++i)
+                objects.push_back(pool.allocate());
+        }
+
+        std::future<void> done = pool.free_unused_async();
+        EXPECT_EQ(tasks.size(), 3U);
+        EXPECT_EQ(dummy_buffer::m_count.load(), 10);
+
+        tasks[0]();
+        tasks[1]();
+        EXPECT_EQ(done.wait_for(std::chrono::seconds(0)),
+                  std::future_status::timeout);
+
+        tasks[2]();
+        EXPECT_EQ(done.wait_for(std::chrono::seconds(0)),
+                  std::future_status::ready);
+        EXPECT_EQ(dummy_buffer::m_count.load(), 0);
+        tasks.clear();
+
+        // The resources left when the pool dies are destroyed by the
+        // executor as well
+        pool.allocate();
+        EXPECT_EQ(pool.unused_resources(), 1U);
+    }
+
+    EXPECT_EQ(dummy_buffer::m_count.load(), 1);
+    ASSERT_EQ(tasks.size(), 1U);
+
+    tasks[0]();
+    EXPECT_EQ(dummy_buffer::m_count.load(), 0);
+}
+
+namespace
+{
+    // Object ending the process with exit code 3 when destroyed
+    struct dummy_exit
+    {
+        ~dummy_exit()
+        {
+            std::_Exit(3);
+        }
+    };
+
+    // Exits with an unused resource in a static pool
+    void exit_with_unused(bool leak)
+    {
+        static recycle::resource_pool<dummy_exit> pool;
+
+        if (leak)
+            pool.set_leak_on_exit();
+
+        pool.allocate();
+        std::exit(0);
+    }
+
+    // Exits with unused resources in two function-local static pools
+    // constructed before the leak on exit was enabled for all pools
+    void exit_with_local_pools()
+    {
+        static recycle::resource_pool<dummy_exit> first;
+        static recycle::resource_pool<dummy_exit> second;
+
+        recycle::set_leak_on_exit(true);
+
+        first.allocate();
+        second.set_leak_on_exit();
+        second.allocate();
+
+        std::exit(0);
+    }
+}
+
+/// Test that the unused resources are only leaked when the process
+/// exits
+TEST(test_resource_pool, leak_on_exit)
+{
+    EXPECT_EXIT(exit_with_unused(true), ::testing::ExitedWithCode(0), "");
+    EXPECT_EXIT(exit_with_unused(false), ::testing::ExitedWithCode(3), "");
+    EXPECT_EXIT(exit_with_local_pools(), ::testing::ExitedWithCode(0), "");
+
+    {
+        recycle::resource_pool<dummy_one> pool;
+        pool.set_leak_on_exit();
+
+        pool.allocate();
+        EXPECT_EQ(dummy_one::m_count, 1);
+    }
+
+    EXPECT_EQ(dummy_one::m_count, 0);
+}
+
+/// Test that a snapshot is restored lazily into a new pool
+TEST(test_resource_pool, snapshot)
+{
+    using pool_type = recycle::resource_pool<std::vector<uint8_t>>;
+
+    const std::string path = "test_resource_pool_snapshot.bin";
+
+    auto serialize = [](const std::vector<uint8_t>& v,
+                        std::vector<uint8_t>& buffer)
+    {
+        buffer.insert(buffer.end(), v.begin(), v.end());
+    };
+
+    uint32_t restored = 0;
+    auto deserialize = [&restored](const uint8_t* data, std::size_t size)
+    {
+        ++restored;
+        return std::make_shared<std::vector<uint8_t>>(data, data + size);
+    };
+
+    {
+        pool_type pool;
+
+        auto a = pool.allocate();
+        auto b = pool.allocate();
+        a->assign(3, 1);
+        b->assign(5, 2);
+
+        a.reset();
+        b.reset();
+
+        EXPECT_TRUE(pool.save_snapshot(path, serialize));
+    }
+
+    pool_type pool;
+    EXPECT_TRUE(pool.restore_snapshot(path, deserialize));
+    EXPECT_EQ(pool.snapshot_resources(), 2U);
+    EXPECT_EQ(restored, 0U);
+
+    // Each miss restores one resource
+    auto c = pool.allocate();
+    EXPECT_EQ(restored, 1U);
+    EXPECT_EQ(pool.snapshot_resources(), 1U);
+
+    // Saving keeps the resources not restored yet
+    c.reset();
+    EXPECT_TRUE(pool.save_snapshot(path, serialize));
+
+    auto d = pool.allocate();
+    auto e = pool.allocate();
+    EXPECT_EQ(restored, 2U);
+    EXPECT_EQ(pool.snapshot_resources(), 0U);
+
+    std::size_t total = d->size() + e->size();
+    EXPECT_EQ(total, 8U);
+
+    // The snapshot is used up, so we construct
+    auto f = pool.allocate();
+    EXPECT_TRUE(f->empty());
+    EXPECT_EQ(restored, 2U);
+
+    pool_type copy;
+    EXPECT_TRUE(copy.restore_snapshot(path, deserialize));
+    EXPECT_EQ(copy.snapshot_resources(), 2U);
+
+    // A missing file or one which is not a snapshot is rejected
+    EXPECT_FALSE(copy.restore_snapshot(path + ".missing", deserialize));
+
+    std::vector<uint8_t> garbage(64, 0x55);
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(garbage.data()),
+                   garbage.size());
+    }
+    EXPECT_FALSE(copy.restore_snapshot(path, deserialize));
+    EXPECT_EQ(copy.snapshot_resources(), 2U);
+
+    std::remove(path.c_str());
+}
+
+/// Test that a snapshot includes the resources in the per-CPU cache
+/// and that they are put back into the pool afterwards
+TEST(test_resource_pool, snapshot_cpu_cache)
+{
+    using pool_type = recycle::resource_pool<std::vector<uint8_t>>;
+
+    const std::string path = "test_resource_pool_snapshot_cpu_cache.bin";
+
+    auto serialize = [](const std::vector<uint8_t>& v,
+                        std::vector<uint8_t>& buffer)
+    {
+        buffer.insert(buffer.end(), v.begin(), v.end());
+    };
+
+    auto deserialize = [](const uint8_t* data, std::size_t size)
+    {
+        return std::make_shared<std::vector<uint8_t>>(data, data + size);
+    };
+
+    pool_type pool;
+    pool.enable_cpu_cache(4);
+
+    auto a = pool.allocate();
+    auto b = pool.allocate();
+    a->assign(3, 1);
+    b->assign(5, 2);
+
+    a.reset();
+    b.reset();
+    EXPECT_EQ(pool.unused_resources(), 2U);
+
+    EXPECT_TRUE(pool.save_snapshot(path, serialize));
+    EXPECT_EQ(pool.unused_resources(), 2U);
+
+    pool_type copy;
+    EXPECT_TRUE(copy.restore_snapshot(path, deserialize));
+    EXPECT_EQ(copy.snapshot_resources(), 2U);
+
+    std::remove(path.c_str());
+}
+
+/// Test that idle resources beyond the watermark have their memory
+/// released and are reused afterwards
+TEST(test_resource_pool, soft_trim)
+{
+    using buffer = std::vector<uint8_t>;
+
+    recycle::resource_pool<buffer> pool;
+    pool.set_soft_trim(1, [](buffer& b)
+    {
+        return std::make_pair(static_cast<void*>(b.data()), b.size());
+    });
+
+    std::vector<std::shared_ptr<buffer>> buffers;
+    std::vector<uint8_t*> data;
+
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+        buffers.push_back(pool.allocate());
+        buffers.back()->assign(1 << 20, 0xab);
+        data.push_back(buffers.back()->data());
+    }
+
+    buffers.clear();
+
+#if defined(__unix__) || defined(__APPLE__)
+    EXPECT_EQ(pool.trimmed_resources(), 2U);
+#endif
+
+    // The buffers are reused, and the trimmed memory is usable
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+        buffers.push_back(pool.allocate());
+        std::fill(buffers.back()->begin(), buffers.back()->end(), 0xcd);
+        EXPECT_EQ(buffers.back()->size(), 1U << 20);
+    }
+
+    EXPECT_EQ(pool.trimmed_resources(), 0U);
+    EXPECT_EQ(pool.unused_resources(), 0U);
+
+    for (auto& b : buffers)
+    {
+        EXPECT_NE(std::find(data.begin(), data.end(), b->data()), data.end());
+        EXPECT_EQ(b->front(), 0xcd);
+        EXPECT_EQ(b->back(), 0xcd);
+    }
+
+    // Buffers smaller than a page have nothing to release, so only the
+    // remaining large buffer is trimmed
+    buffers.clear();
+    buffers.push_back(pool.allocate());
+    buffers.push_back(pool.allocate());
+    buffers[0]->resize(16);
+    buffers[1]->resize(16);
+    buffers[0]->shrink_to_fit();
+    buffers[1]->shrink_to_fit();
+    buffers.clear();
+
+    pool.trim_unused();
+#if defined(__unix__) || defined(__APPLE__)
+    EXPECT_EQ(pool.trimmed_resources(), 1U);
+#endif
+}
+
+/// Test that the cached control block is handed back when the allocate
+/// function throws
+TEST(test_resource_pool, allocate_throws)
+{
+    bool fail = false;
+
+    recycle::resource_pool<dummy_one> pool([&fail]()
+    {
+        if (fail)
+            throw std::runtime_error("allocate failed");
+
+        return std::make_shared<dummy_one>();
+    });
+
+    // Retiring the resource keeps its control block cached
+    pool.set_max_reuses(1);
+    pool.allocate();
+    pool.allocate();
+    EXPECT_EQ(pool.unused_resources(), 0U);
+
+    fail = true;
+    EXPECT_THROW(pool.allocate(), std::runtime_error);
+    EXPECT_THROW(pool.allocate(), std::runtime_error);
+
+    fail = false;
+    auto o = pool.allocate();
+    EXPECT_TRUE((bool) o);
+    EXPECT_EQ(dummy_one::m_count, 1);
+}
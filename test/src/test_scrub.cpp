@@ -0,0 +1,116 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/scrub.hpp>
+#include <recycle/resource_pool.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+    // Buffer keeping track of the bytes written
+    struct dummy_dirty
+    {
+        uint8_t* data()
+        {
+            return m_data.data();
+        }
+
+        std::size_t size() const
+        {
+            return m_data.size();
+        }
+
+        std::size_t dirty_size() const
+        {
+            return m_dirty;
+        }
+
+        std::vector<uint8_t> m_data;
+        std::size_t m_dirty = 0;
+    };
+
+    bool all_zero(const uint8_t* data, std::size_t size)
+    {
+        return std::all_of(data, data + size,
+                           [](uint8_t v) { return v == 0; });
+    }
+}
+
+/// Test that every instruction set supported clears exactly the range
+/// given, also when it is not aligned
+TEST(test_scrub, isa)
+{
+    std::vector<recycle::scrub_isa> levels = {recycle::scrub_isa::scalar};
+
+    if (recycle::scrub_level() != recycle::scrub_isa::scalar)
+        levels.push_back(recycle::scrub_isa::avx2);
+
+    if (recycle::scrub_level() == recycle::scrub_isa::avx512)
+        levels.push_back(recycle::scrub_isa::avx512);
+
+    std::vector<std::size_t> sizes = {0, 1, 63, 4096, 32 * 1024 + 7,
+                                      256 * 1024 + 33};
+
+    for (recycle::scrub_isa isa : levels)
+    {
+        for (std::size_t size : sizes)
+        {
+            for (std::size_t offset : {0, 1, 31})
+            {
+                std::vector<uint8_t> buffer(size + offset + 64, 0xff);
+
+                recycle::detail::scrub(buffer.data() + offset, size, isa);
+
+                EXPECT_TRUE(all_zero(buffer.data() + offset, size));
+                EXPECT_TRUE(std::all_of(
+                    buffer.begin(), buffer.begin() + offset,
+                    [](uint8_t v) { return v == 0xff; }));
+                EXPECT_TRUE(std::all_of(
+                    buffer.begin() + offset + size, buffer.end(),
+                    [](uint8_t v) { return v == 0xff; }));
+            }
+        }
+    }
+}
+
+/// Test that only the dirty part of a buffer is cleared
+TEST(test_scrub, buffer)
+{
+    std::vector<uint32_t> values(100, 7);
+    recycle::scrub_buffer(values);
+    EXPECT_TRUE(std::all_of(values.begin(), values.end(),
+                            [](uint32_t v) { return v == 0; }));
+
+    dummy_dirty dirty;
+    dirty.m_data.assign(100, 0xff);
+    dirty.m_dirty = 10;
+
+    recycle::scrub_buffer(dirty);
+    EXPECT_TRUE(all_zero(dirty.m_data.data(), 10));
+    EXPECT_EQ(dirty.m_data[10], 0xff);
+}
+
+/// Test the recycle function zeroing pooled buffers
+TEST(test_scrub, recycle)
+{
+    recycle::resource_pool<std::vector<uint8_t>> pool(
+        []() { return std::make_shared<std::vector<uint8_t>>(64 * 1024); },
+        recycle::scrub_recycle());
+
+    auto b1 = pool.allocate();
+    std::fill(b1->begin(), b1->end(), 0xab);
+    uint8_t* data = b1->data();
+    b1.reset();
+
+    auto b2 = pool.allocate();
+    EXPECT_EQ(b2->data(), data);
+    EXPECT_TRUE(all_zero(b2->data(), b2->size()));
+}
@@ -0,0 +1,117 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/trace_recorder.hpp>
+
+#include <recycle/resource_pool.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+    struct dummy_one
+    {
+        uint32_t m_value = 0;
+    };
+}
+
+/// Test recording into the ring buffer
+TEST(test_trace_recorder, record)
+{
+    recycle::trace_recorder recorder(4);
+    EXPECT_EQ(recorder.capacity(), 4U);
+    EXPECT_EQ(recorder.recorded(), 0U);
+    EXPECT_TRUE(recorder.events().empty());
+
+    int objects[6];
+
+    recorder.record(recycle::trace_event_type::miss, &objects[0]);
+    recorder.record(recycle::trace_event_type::release, &objects[0]);
+
+    std::vector<recycle::trace_event> events = recorder.events();
+    ASSERT_EQ(events.size(), 2U);
+    EXPECT_EQ(events[0].m_type, recycle::trace_event_type::miss);
+    EXPECT_EQ(events[1].m_type, recycle::trace_event_type::release);
+    EXPECT_EQ(events[0].m_object, events[1].m_object);
+    EXPECT_LE(events[0].m_time, events[1].m_time);
+
+    // Only the most recent events are kept
+    for (uint32_t i = 1; i < 6; ++i)
+        recorder.record(recycle::trace_event_type::hit, &objects[i]);
+
+    EXPECT_EQ(recorder.recorded(), 7U);
+
+    events = recorder.events();
+    ASSERT_EQ(events.size(), 4U);
+    EXPECT_EQ(events[0].m_object, uint64_t(uintptr_t(&objects[2])));
+    EXPECT_EQ(events[3].m_object, uint64_t(uintptr_t(&objects[5])));
+}
+
+/// Test writing and reading a trace
+TEST(test_trace_recorder, write_read)
+{
+    recycle::trace_recorder recorder(16);
+
+    int object;
+    recorder.record(recycle::trace_event_type::miss, &object);
+    recorder.record(recycle::trace_event_type::drop, &object);
+
+    std::stringstream file;
+    recorder.write(file);
+    EXPECT_EQ(file.str().size(), 8U + 16U + 2 * 16U);
+
+    std::vector<recycle::trace_event> events;
+    ASSERT_TRUE(recycle::trace_recorder::read_trace(file, events));
+    ASSERT_EQ(events.size(), 2U);
+
+    std::vector<recycle::trace_event> expected = recorder.events();
+    for (std::size_t i = 0; i < events.size(); ++i)
+    {
+        EXPECT_EQ(events[i].m_time, expected[i].m_time);
+        EXPECT_EQ(events[i].m_object, expected[i].m_object);
+        EXPECT_EQ(events[i].m_type, expected[i].m_type);
+    }
+
+    // A truncated trace is rejected
+    std::string data = file.str();
+    std::stringstream truncated(data.substr(0, data.size() - 1));
+    EXPECT_FALSE(recycle::trace_recorder::read_trace(truncated, events));
+
+    std::stringstream garbage("not a trace at all");
+    EXPECT_FALSE(recycle::trace_recorder::read_trace(garbage, events));
+}
+
+/// Test recording the events of a pool
+TEST(test_trace_recorder, resource_pool)
+{
+    auto recorder = std::make_shared<recycle::trace_recorder>(16);
+
+    recycle::resource_pool<dummy_one> pool(1);
+    pool.set_trace_recorder(recorder);
+
+    auto o1 = pool.allocate();
+    auto o2 = pool.allocate();
+    o1.reset();
+    o2.reset();
+
+    auto o3 = pool.allocate();
+
+    std::vector<recycle::trace_event> events = recorder->events();
+    ASSERT_EQ(events.size(), 5U);
+    EXPECT_EQ(events[0].m_type, recycle::trace_event_type::miss);
+    EXPECT_EQ(events[1].m_type, recycle::trace_event_type::miss);
+    EXPECT_EQ(events[2].m_type, recycle::trace_event_type::release);
+    EXPECT_EQ(events[3].m_type, recycle::trace_event_type::drop);
+    EXPECT_EQ(events[4].m_type, recycle::trace_event_type::hit);
+
+    EXPECT_EQ(events[0].m_object, events[2].m_object);
+    EXPECT_EQ(events[1].m_object, events[3].m_object);
+    EXPECT_EQ(events[4].m_object, uint64_t(uintptr_t(o3.get())));
+}
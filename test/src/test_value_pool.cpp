@@ -0,0 +1,151 @@
+// Copyright Steinwurf ApS 2014.
+// All Rights Reserved
+//
+// Distributed under the "BSD License". See the accompanying LICENSE.rst file.
+
+#include <recycle/value_pool.hpp>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+    // Movable non default constructible dummy object
+    struct dummy_value
+    {
+        dummy_value(uint32_t value) :
+            m_value(value)
+        { }
+
+        uint32_t m_value;
+    };
+}
+
+/// Test the basic API
+TEST(test_value_pool, api)
+{
+    recycle::value_pool<std::vector<uint8_t>> pool;
+
+    EXPECT_EQ(pool.unused_resources(), 0U);
+    EXPECT_EQ(pool.capacity(), 10000U);
+
+    std::vector<uint8_t> v1 = pool.take();
+    EXPECT_TRUE(v1.empty());
+
+    v1.resize(1000);
+    const uint8_t* data = v1.data();
+
+    pool.give(std::move(v1));
+    EXPECT_EQ(pool.unused_resources(), 1U);
+
+    // We get the same memory back, cleared
+    std::vector<uint8_t> v2 = pool.take();
+    EXPECT_TRUE(v2.empty());
+    EXPECT_GE(v2.capacity(), 1000U);
+    EXPECT_EQ(v2.data(), data);
+    EXPECT_EQ(pool.unused_resources(), 0U);
+
+    pool.give(std::move(v2));
+    pool.free_unused();
+    EXPECT_EQ(pool.unused_resources(), 0U);
+}
+
+/// Test the capacity
+TEST(test_value_pool, capacity)
+{
+    recycle::value_pool<std::string> pool(2);
+
+    pool.give(std::string("a"));
+    pool.give(std::string("b"));
+    pool.give(std::string("c"));
+
+    EXPECT_EQ(pool.unused_resources(), 2U);
+    EXPECT_TRUE(pool.take().empty());
+}
+
+/// Test that values with a too large footprint are dropped
+TEST(test_value_pool, footprint_limit)
+{
+    recycle::value_pool<std::vector<uint8_t>> pool;
+
+    pool.set_footprint_limit(
+        [](const std::vector<uint8_t>& v) { return v.capacity(); }, 100);
+
+    pool.give(std::vector<uint8_t>(50));
+    EXPECT_EQ(pool.unused_resources(), 1U);
+
+    pool.give(std::vector<uint8_t>(500));
+    EXPECT_EQ(pool.unused_resources(), 1U);
+}
+
+/// Test custom allocate and recycle functions
+TEST(test_value_pool, allocate_recycle)
+{
+    EXPECT_FALSE(std::is_default_constructible<
+                 recycle::value_pool<dummy_value>>::value);
+
+    uint32_t recycled = 0;
+
+    recycle::value_pool<dummy_value> pool(
+        []() { return dummy_value(42); },
+        [&recycled](dummy_value& v) { v.m_value = 0; ++recycled; });
+
+    dummy_value v1 = pool.take();
+    EXPECT_EQ(v1.m_value, 42U);
+
+    pool.give(std::move(v1));
+    EXPECT_EQ(recycled, 1U);
+
+    dummy_value v2 = pool.take();
+    EXPECT_EQ(v2.m_value, 0U);
+
+    recycle::value_pool<dummy_value> moved(std::move(pool));
+    moved.give(std::move(v2));
+    EXPECT_EQ(moved.unused_resources(), 1U);
+}
+
+/// Test that we are thread safe
+namespace
+{
+    struct lock_policy
+    {
+        using mutex_type = std::mutex;
+        using lock_type = std::lock_guard<mutex_type>;
+    };
+}
+
+TEST(test_value_pool, thread)
+{
+    recycle::value_pool<std::string, lock_policy> pool;
+
+    auto run = [&pool]()
+        {
+            for (uint32_t i = 0; i < 100; ++i)
+            {
+                std::string s = pool.take();
+                s.append("some text");
+                pool.give(std::move(s));
+            }
+        };
+
+    const uint32_t number_threads = 8;
+    std::thread t[number_threads];
+
+    for (uint32_t i = 0; i < number_threads; ++i)
+    {
+        t[i] = std::thread(run);
+    }
+
+    for (uint32_t i = 0; i < number_threads; ++i)
+    {
+        t[i].join();
+    }
+
+    EXPECT_LE(pool.unused_resources(), number_threads);
+}